@@ -11,16 +11,197 @@
 
 #include "pg_squeeze.h"
 
+#include "access/heapam_xlog.h"
+#include "access/nbtree.h"
+#include "access/rmgr.h"
+#include "access/xlog.h"
+#include "catalog/index.h"
 #include "executor/executor.h"
 #include "replication/decode.h"
+#include "utils/array.h"
+#include "utils/hsearch.h"
 #include "utils/rel.h"
+#include "utils/typcache.h"
+
+/*
+ * A change of a single row, as seen by apply_changes_coalesced(). UPDATE_OLD
+ * and UPDATE_NEW are merged into a single change of kind UPDATE_NEW, and
+ * UPDATE that changes the identity key is split into DELETE and INSERT.
+ */
+typedef struct KeyedChange
+{
+	ConcurrentChangeKind	kind;
+
+	/* The new tuple for INSERT and UPDATE, the old one for DELETE. */
+	HeapTuple	tup;
+
+	/* The tuple to get the identity key from. */
+	HeapTuple	tup_key;
+
+	/* Hash value of the identity key. */
+	uint32	hash;
+
+	/* Position in the batch. */
+	int	pos;
+
+	/* The existing row to be updated or deleted, see find_tuples_by_key(). */
+	ItemPointerData	ctid;
+} KeyedChange;
+
+/*
+ * An entry of the cache that apply_changes_in_order() uses to find rows it
+ * has inserted or updated itself w/o scanning the identity index.
+ *
+ * Only one key per hash value is cached. tup is the last version of the row
+ * written, so tup->t_self is its current TID.
+ */
+typedef struct TIDCacheEntry
+{
+	uint32	hash;
+
+	HeapTuple	tup;
+
+	/* Is tup our own copy? */
+	bool	copied;
+} TIDCacheEntry;
+
+/*
+ * Stages of the processing of a coalesced batch. Each stage can be
+ * interrupted and resumed, see coalesce_changes().
+ */
+typedef enum CoalescePhase
+{
+	COALESCE_READ,				/* Reading the changes. */
+	COALESCE_GROUP,				/* Reducing them to the net changes. */
+	COALESCE_LOOKUP,			/* Finding the existing rows. */
+	COALESCE_APPLY				/* Applying the net changes. */
+} CoalescePhase;
+
+/*
+ * The net changes of a batch, see apply_changes_coalesced(). The whole batch
+ * is allocated in cxt.
+ */
+typedef struct CoalescedBatch
+{
+	MemoryContext	cxt;
+
+	CoalescePhase	phase;
+
+	/* The changes before coalescing. */
+	KeyedChange	*changes;
+	int	nchanges;
+
+	/*
+	 * Changes already merged into a net change, and position of the next
+	 * change to be examined.
+	 */
+	bool	*grouped;
+	int	next_group;
+
+	KeyedChange	*net;
+	int	nnet;
+
+	/*
+	 * The net changes whose rows need to be found, in the index order, and
+	 * position of the next one.
+	 */
+	KeyedChange	**lookups;
+	int	nlookups;
+	int	next_lookup;
+
+	/* Position of the next change to be applied. */
+	int	next;
+
+	double	ninserts, nupdates, ndeletes;
+} CoalescedBatch;
+
+/* Argument of keyed_change_index_cmp(). */
+typedef struct IndexOrderArg
+{
+	IndexInsertState	*iistate;
+	Relation	relation;
+} IndexOrderArg;
+
+/*
+ * The minimum number of rows to be looked up for the parallel workers to be
+ * used.
+ */
+#define PARALLEL_LOOKUP_MIN_TUPLES	10000
+
+/*
+ * The number of rows looked up between two checks of the time left. If the
+ * parallel workers are used, the step needs to be bigger so that launching
+ * them pays off.
+ */
+#define LOOKUP_STEP_SIZE			1024
+#define PARALLEL_LOOKUP_STEP_SIZE	(8 * PARALLEL_LOOKUP_MIN_TUPLES)
 
 static bool decode_concurrent_changes(LogicalDecodingContext *ctx,
 									  XLogRecPtr end_of_wal,
-									  struct timeval *must_complete);
-static void apply_concurrent_changes(DecodingOutputState *dstate,
+									  struct timeval *must_complete,
+									  bool limit_size);
+static bool record_is_relevant(XLogReaderState *reader,
+							   DecodingOutputState *dstate);
+static bool apply_concurrent_changes(DecodingOutputState *dstate,
 									 Relation relation, ScanKey key,
-									 int nkeys, IndexInsertState *iistate);
+									 int nkeys, IndexInsertState *iistate,
+									 struct timeval *must_complete);
+static bool apply_changes_in_order(DecodingOutputState *dstate,
+								   Relation relation, ScanKey key, int nkeys,
+								   IndexInsertState *iistate,
+								   TupleTableSlot *slot,
+								   TupleTableSlot *ind_slot,
+								   struct timeval *must_complete);
+static bool apply_changes_coalesced(DecodingOutputState *dstate,
+									Relation relation, ScanKey key, int nkeys,
+									IndexInsertState *iistate,
+									TupleTableSlot *slot,
+									TupleTableSlot *ind_slot,
+									struct timeval *must_complete);
+static bool coalesce_changes(DecodingOutputState *dstate,
+							 CoalescedBatch *batch, Relation relation,
+							 ScanKey key, int nkeys,
+							 IndexInsertState *iistate,
+							 TupleTableSlot *ind_slot,
+							 struct timeval *must_complete);
+static HTAB *create_key_hash_set(void);
+static HTAB *create_tid_cache(void);
+static bool tid_cache_lookup(HTAB *cache, IndexInsertState *iistate,
+							 Relation relation, HeapTuple tup_key,
+							 uint32 hash, ItemPointer ctid);
+static void tid_cache_store(HTAB *cache, HeapTuple tup, bool transient,
+							uint32 hash);
+static void tid_cache_remove(HTAB *cache, IndexInsertState *iistate,
+							 Relation relation, HeapTuple tup_key,
+							 uint32 hash);
+static void tid_cache_destroy(HTAB *cache);
+static void start_reading_changes(DecodingOutputState *dstate);
+static HeapTuple get_next_change(DecodingOutputState *dstate,
+								 ConcurrentChangeKind *kind,
+								 bool *transient);
+static void reset_change_buffer(DecodingOutputState *dstate);
+static void find_tuples_by_key(Relation relation, IndexInsertState *iistate,
+							   ScanKey key, int nkeys, KeyedChange **lookups,
+							   int nlookups, TupleTableSlot *ind_slot);
+static void find_tuples_by_key_array(Relation relation,
+									 IndexInsertState *iistate, ScanKey key,
+									 KeyedChange **lookups, int nlookups,
+									 TupleTableSlot *ind_slot);
+static void insert_index_tuples_nocheck(IndexInsertState *iistate,
+										Relation relation,
+										TupleTableSlot *slot, HeapTuple tup);
+static void add_keyed_change(KeyedChange *changes, int *nchanges,
+							 ConcurrentChangeKind kind, HeapTuple tup,
+							 HeapTuple tup_key, IndexInsertState *iistate,
+							 Relation relation);
+static int keyed_change_cmp(const void *arg1, const void *arg2);
+static int keyed_change_index_cmp(const void *arg1, const void *arg2,
+								  void *arg);
+static int keyed_change_apply_cmp(const void *arg1, const void *arg2);
+static uint32 identity_key_hash(IndexInsertState *iistate, Relation relation,
+								HeapTuple tup);
+static bool identity_keys_equal(IndexInsertState *iistate, Relation relation,
+								HeapTuple tup1, HeapTuple tup2);
 static bool processing_time_elapsed(struct timeval *utmost);
 
 static void plugin_startup(LogicalDecodingContext *ctx,
@@ -34,12 +215,13 @@ static void plugin_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 						  Relation rel, ReorderBufferChange *change);
 static void store_change(LogicalDecodingContext *ctx,
 						 ConcurrentChangeKind kind, HeapTuple tuple);
-static HeapTuple get_changed_tuple(ConcurrentChange *change);
+static char *alloc_change_space(DecodingOutputState *dstate, Size size);
+static void write_spill_file(BufFile *file, void *data, Size size);
 
 /*
  * Decode and apply concurrent changes. If there are too many of them, split
  * the processing into multiple iterations so that the intermediate storage
- * (tuplestore) is not likely to be written to disk.
+ * is not likely to be written to disk.
  *
  * See check_catalog_changes() for explanation of lock_held argument.
  *
@@ -58,49 +240,107 @@ process_concurrent_changes(LogicalDecodingContext *ctx,
 	bool	done;
 
 	dstate = (DecodingOutputState *) ctx->output_writer_private;
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_WAL_TARGET, end_of_wal);
 	done = false;
 	while(!done)
 	{
 		CHECK_FOR_INTERRUPTS();
 
-		done = decode_concurrent_changes(ctx, end_of_wal, must_complete);
+		/*
+		 * If the previous call had to stop in the middle of a batch, finish
+		 * the batch before decoding more changes: the change buffer cannot be
+		 * written while it's being read.
+		 */
+		if (!dstate->apply_in_progress)
+		{
+			done = decode_concurrent_changes(ctx, end_of_wal, must_complete,
+											 true);
 
-		if (processing_time_elapsed(must_complete))
-			/* Caller is responsible for applying the changes. */
-			return false;
+			if (processing_time_elapsed(must_complete))
+				/* Caller is responsible for applying the changes. */
+				return false;
+
+			if (dstate->nchanges == 0)
+				continue;
+		}
 
-		if (dstate->nchanges == 0)
-			continue;
+		/*
+		 * Respect the rate limits and the replication lag, but never make
+		 * other backends wait for the exclusive lock longer.
+		 */
+		if (squeeze_stats.lock_acquired == 0)
+			squeeze_throttle();
 
 		/* Make sure the changes are still applicable. */
 		check_catalog_changes(cat_state, lock_held);
 
 		/*
-		 * XXX Consider if it's possible to check *must_complete and stop
-		 * processing partway through. Partial cleanup of the tuplestore seems
-		 * non-trivial.
+		 * The application can stop partway through the batch. In that case
+		 * the next call will resume it.
 		 */
-		apply_concurrent_changes(dstate, rel_dst, ident_key,
-								 ident_key_nentries, iistate);
+		if (!apply_concurrent_changes(dstate, rel_dst, ident_key,
+									  ident_key_nentries, iistate,
+									  must_complete))
+			return false;
 	}
 
 	return true;
 }
 
+/*
+ * Decode the changes that have been flushed to WAL so far, but do not apply
+ * them.
+ *
+ * This is called during the initial load and index build so that
+ * process_concurrent_changes() has less WAL to decode, and so that the slot
+ * does not prevent recycling of WAL segments for longer than necessary. The
+ * changes stay in the change buffer (which is written to disk if they do not
+ * fit into maintenance_work_mem) until process_concurrent_changes() applies
+ * them.
+ *
+ * To avoid the overhead of frequent calls, nothing is done unless at least
+ * one WAL segment is available for decoding.
+ *
+ * Must not be called in parallel mode because ReorderBufferCommit() starts a
+ * subtransaction.
+ */
+void
+decode_concurrent_changes_early(LogicalDecodingContext *ctx)
+{
+	XLogRecPtr	end_of_wal;
+
+	Assert(!IsInParallelMode());
+
+	end_of_wal = GetFlushRecPtr();
+#if PG_VERSION_NUM >= 110000
+	if (end_of_wal < ctx->reader->EndRecPtr + wal_segment_size)
+#else
+	if (end_of_wal < ctx->reader->EndRecPtr + XLOG_SEG_SIZE)
+#endif
+		return;
+
+	decode_concurrent_changes(ctx, end_of_wal, NULL, false);
+}
+
 /*
  * Decode logical changes from the XLOG sequence up to end_of_wal.
  *
+ * If limit_size is true, stop as soon as the decoded changes occupy
+ * maintenance_work_mem.
+ *
  * Returns true iff done (for now), i.e. no more changes below the end_of_wal
  * can be decoded.
  */
 static bool
 decode_concurrent_changes(LogicalDecodingContext *ctx,
 						  XLogRecPtr end_of_wal,
-						  struct timeval *must_complete)
+						  struct timeval *must_complete,
+						  bool limit_size)
 {
 	DecodingOutputState	*dstate;
 	ResourceOwner	resowner_old;
 	Size	maintenance_wm_bytes;
+	XLogRecPtr	start_lsn;
 
 	/*
 	 * Invalidate the "present" cache before moving to "(recent) history".
@@ -116,15 +356,18 @@ decode_concurrent_changes(LogicalDecodingContext *ctx,
 	InvalidateSystemCaches();
 
 	dstate = (DecodingOutputState *) ctx->output_writer_private;
+	/* The change buffer must not be written while it's being read. */
+	Assert(!dstate->apply_in_progress);
 	resowner_old = CurrentResourceOwner;
 	CurrentResourceOwner = dstate->resowner;
+	start_lsn = ctx->reader->EndRecPtr;
 
 	PG_TRY();
 	{
 		maintenance_wm_bytes = (Size) maintenance_work_mem * 1024L;
 
 		while (ctx->reader->EndRecPtr < end_of_wal &&
-			   dstate->data_size < maintenance_wm_bytes)
+			   (!limit_size || dstate->data_size < maintenance_wm_bytes))
 		{
 			XLogRecord *record;
 			XLogSegNo	segno_new;
@@ -135,7 +378,7 @@ decode_concurrent_changes(LogicalDecodingContext *ctx,
 			if (errm)
 				elog(ERROR, "%s", errm);
 
-			if (record != NULL)
+			if (record != NULL && record_is_relevant(ctx->reader, dstate))
 				LogicalDecodingProcessRecord(ctx, ctx->reader);
 
 			if (processing_time_elapsed(must_complete))
@@ -173,37 +416,89 @@ decode_concurrent_changes(LogicalDecodingContext *ctx,
 	PG_END_TRY();
 
 	elog(DEBUG1, "Decoded %.0f changes.", dstate->nchanges);
+	if (!XLogRecPtrIsInvalid(start_lsn) && ctx->reader->EndRecPtr > start_lsn)
+		squeeze_stats.wal_decoded += ctx->reader->EndRecPtr - start_lsn;
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_WAL_DECODED,
+								  ctx->reader->EndRecPtr);
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_CHANGES_PENDING,
+								  (int64) dstate->nchanges);
 
 	return ctx->reader->EndRecPtr >= end_of_wal;
 }
 
+/*
+ * Check if WAL record can contain data change of the relation whose changes
+ * we're decoding.
+ *
+ * Only the heap records that plugin_change() would receive (and those that
+ * complete speculative insertion) are examined. Skipping them for other
+ * relations saves a lot of work if many other tables (including our
+ * transient table) are being changed. All the other records (transaction
+ * control, catalog changes, etc.) are needed by the decoding machinery.
+ */
+static bool
+record_is_relevant(XLogReaderState *reader, DecodingOutputState *dstate)
+{
+	uint8	info;
+	RelFileNode	rnode;
+
+	/* Filtering not enabled? */
+	if (!OidIsValid(dstate->rnode.relNode))
+		return true;
+
+	info = XLogRecGetInfo(reader) & XLOG_HEAP_OPMASK;
+	switch (XLogRecGetRmid(reader))
+	{
+		case RM_HEAP_ID:
+			if (info != XLOG_HEAP_INSERT && info != XLOG_HEAP_UPDATE &&
+				info != XLOG_HEAP_HOT_UPDATE && info != XLOG_HEAP_DELETE &&
+				info != XLOG_HEAP_CONFIRM)
+				return true;
+			break;
+
+		case RM_HEAP2_ID:
+			if (info != XLOG_HEAP2_MULTI_INSERT)
+				return true;
+			break;
+
+		default:
+			return true;
+	}
+
+	/* The decoding code does not expect the block reference to be missing. */
+	if (!XLogRecGetBlockTag(reader, 0, &rnode, NULL, NULL))
+		return true;
+
+	if (RelFileNodeEquals(rnode, dstate->rnode))
+		return true;
+
+	return OidIsValid(dstate->toast_rnode.relNode) &&
+		RelFileNodeEquals(rnode, dstate->toast_rnode);
+}
+
 /*
  * Apply changes that happened during the initial load.
  *
  * Scan key is passed by caller, so it does not have to be constructed
  * multiple times. Key entries have all fields initialized, except for
  * sk_argument.
+ *
+ * If the time indicated by must_complete elapses, stop at a change boundary
+ * and return false. dstate->apply_in_progress is set in that case, and the
+ * next call continues where this one has stopped.
  */
-static void
+static bool
 apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
-						 ScanKey key, int nkeys, IndexInsertState *iistate)
+						 ScanKey key, int nkeys, IndexInsertState *iistate,
+						 struct timeval *must_complete)
 {
 	TupleTableSlot	*slot;
-#if PG_VERSION_NUM >= 120000
-	TupleTableSlot	*ind_slot;
-#endif
-	Form_pg_index ident_form;
-	int2vector	*ident_indkey;
-	HeapTuple tup_old = NULL;
-	BulkInsertState bistate = NULL;
-	double	ninserts, nupdates, ndeletes;
+	TupleTableSlot	*ind_slot = NULL;
+	Size	maintenance_wm_bytes;
+	bool	done;
 
 	if (dstate->nchanges == 0)
-		return;
-
-	/* Info needed to retrieve key values from heap tuple. */
-	ident_form = iistate->ident_index->rd_index;
-	ident_indkey = &ident_form->indkey;
+		return true;
 
 	/* TupleTableSlot is needed to pass the tuple to ExecInsertIndexTuples(). */
 #if PG_VERSION_NUM >= 120000
@@ -224,53 +519,178 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 	 */
 	PushActiveSnapshot(GetTransactionSnapshot());
 
-	ninserts = 0;
-	nupdates = 0;
-	ndeletes = 0;
-	while (tuplestore_gettupleslot(dstate->tstore, true, false,
-								   dstate->tsslot))
+	/*
+	 * Coalescing needs all the changes of the batch in memory at the same
+	 * time. decode_concurrent_changes() stops as soon as the batch size
+	 * reaches maintenance_work_mem, but the last transaction decoded can
+	 * exceed the limit, so allow for some slack. If the batch is bigger,
+	 * it's probably a single huge transaction, which usually does not change
+	 * the same row repeatedly.
+	 */
+	maintenance_wm_bytes = (Size) maintenance_work_mem * 1024L;
+	if (!dstate->apply_in_progress)
 	{
-#if PG_VERSION_NUM >= 120000
-		bool	shouldFree;
-#endif
-		HeapTuple tup_change, tup, tup_exist;
-		char	*change_raw;
-		ConcurrentChange	*change;
-		bool	isnull[1];
-		Datum	values[1];
+		start_reading_changes(dstate);
+		dstate->apply_coalesced = iistate->ident_key_hashable &&
+			dstate->data_size <= 2 * maintenance_wm_bytes;
+	}
+
+	if (dstate->apply_coalesced)
+		done = apply_changes_coalesced(dstate, relation, key, nkeys, iistate,
+									   slot, ind_slot, must_complete);
+	else
+		done = apply_changes_in_order(dstate, relation, key, nkeys, iistate,
+									  slot, ind_slot, must_complete);
+
+	dstate->apply_in_progress = !done;
+	if (done)
+		reset_change_buffer(dstate);
 
-		/* Get the change from the single-column tuple. */
+	PopActiveSnapshot();
+
+	/* Cleanup. */
+	ExecDropSingleTupleTableSlot(slot);
 #if PG_VERSION_NUM >= 120000
-		tup_change = ExecFetchSlotHeapTuple(dstate->tsslot, false, &shouldFree);
-#else
-		tup_change = ExecFetchSlotTuple(dstate->tsslot);
+	ExecDropSingleTupleTableSlot(ind_slot);
 #endif
-		heap_deform_tuple(tup_change, dstate->tupdesc_change, values, isnull);
-		Assert(!isnull[0]);
 
-		/* This is bytea, but char* is easier to work with. */
-		change_raw = (char *) DatumGetByteaP(values[0]);
+	return done;
+}
+
+/*
+ * Apply the changes one by one, in the order they were decoded.
+ *
+ * A change can only be applied if the previous change of the same row is
+ * visible, i.e. if the command counter has been incremented since then. If
+ * the identity key can be hashed, we only increment the counter when a key
+ * (actually its hash value) repeats since the last increment. Otherwise we
+ * have to increment it after each change.
+ *
+ * All the lookups in the identity index share a single scan descriptor. If
+ * the key can be hashed, the TIDs of the rows inserted or updated by the
+ * batch are also cached, so rows changed repeatedly are found w/o descending
+ * the index.
+ *
+ * If the time indicated by must_complete elapses, stop at a change boundary
+ * and return false. The next call continues at the current read position of
+ * the change buffer.
+ */
+static bool
+apply_changes_in_order(DecodingOutputState *dstate, Relation relation,
+					   ScanKey key, int nkeys, IndexInsertState *iistate,
+					   TupleTableSlot *slot, TupleTableSlot *ind_slot,
+					   struct timeval *must_complete)
+{
+	HeapTuple tup_old = NULL;
+	bool	tup_old_copied = false;
+	BulkInsertState bistate = NULL;
+	double	ninserts, nupdates, ndeletes, ncommands, ncache_hits;
+	HeapTuple	tup;
+	ConcurrentChangeKind	kind;
+	bool	transient;
+	HTAB	*keys_seen = NULL;
+	HTAB	*tid_cache = NULL;
+	IndexScanDesc	scan;
+	uint32	hash = 0, hash_old = 0;
+	bool	done = true;
+
+	if (iistate->ident_key_hashable)
+	{
+		keys_seen = create_key_hash_set();
+		tid_cache = create_tid_cache();
+	}
+
+	/*
+	 * The scan uses the active snapshot, so it sees the command ID updated
+	 * by UpdateActiveSnapshotCommandId().
+	 */
+	scan = index_beginscan(relation, iistate->ident_index,
+						   GetActiveSnapshot(), nkeys, 0);
+
+	ninserts = 0;
+	nupdates = 0;
+	ndeletes = 0;
+	ncache_hits = 0;
+	ncommands = keys_seen != NULL ? 1 : 0;
+	while (true)
+	{
+		/*
+		 * UPDATE_OLD and UPDATE_NEW must be applied together, so only stop
+		 * between them.
+		 */
+		if (tup_old == NULL && processing_time_elapsed(must_complete))
+		{
+			done = false;
+			break;
+		}
 
-		change = (ConcurrentChange *) VARDATA(change_raw);
+		tup = get_next_change(dstate, &kind, &transient);
+		if (tup == NULL)
+			break;
 
 		/*
 		 * Do not keep buffer pinned for insert if the current change is
 		 * something else.
 		 */
-		if (change->kind != PG_SQUEEZE_CHANGE_INSERT && bistate != NULL)
+		if (kind != PG_SQUEEZE_CHANGE_INSERT && bistate != NULL)
 		{
 			FreeBulkInsertState(bistate);
 			bistate = NULL;
 		}
 
-		tup = get_changed_tuple(change);
+		/*
+		 * If this change affects a key that the current command has already
+		 * affected, make the previous changes visible first.
+		 */
+		if (keys_seen != NULL && kind != PG_SQUEEZE_CHANGE_UPDATE_OLD)
+		{
+			uint32	hashes[2];
+			int	nhashes = 0;
+			bool	conflict = false;
+			int	i;
+
+			hash = identity_key_hash(iistate, relation, tup);
+			hashes[nhashes++] = hash;
+			if (tup_old != NULL)
+			{
+				hash_old = identity_key_hash(iistate, relation, tup_old);
+				hashes[nhashes++] = hash_old;
+			}
+
+			for (i = 0; i < nhashes; i++)
+			{
+				if (hash_search(keys_seen, &hashes[i], HASH_FIND, NULL) != NULL)
+					conflict = true;
+			}
+
+			if (conflict)
+			{
+				CommandCounterIncrement();
+				UpdateActiveSnapshotCommandId();
+				ncommands++;
+
+				hash_destroy(keys_seen);
+				keys_seen = create_key_hash_set();
+			}
+
+			for (i = 0; i < nhashes; i++)
+				hash_search(keys_seen, &hashes[i], HASH_ENTER, NULL);
+		}
 
-		if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_OLD)
+		if (kind == PG_SQUEEZE_CHANGE_UPDATE_OLD)
 		{
 			Assert(tup_old == NULL);
-			tup_old = tup;
+
+			/* The tuple is needed when processing the next change. */
+			if (transient)
+			{
+				tup_old = heap_copytuple(tup);
+				tup_old_copied = true;
+			}
+			else
+				tup_old = tup;
 		}
-		else if (change->kind == PG_SQUEEZE_CHANGE_INSERT)
+		else if (kind == PG_SQUEEZE_CHANGE_INSERT)
 		{
 			List	*recheck;
 
@@ -306,78 +726,41 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 			 * here are already committed.)
 			 */
 			list_free(recheck);
-			pfree(tup);
+
+			if (tid_cache != NULL)
+				tid_cache_store(tid_cache, tup, transient, hash);
 
 			ninserts++;
 		}
-		else if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW ||
-				 change->kind == PG_SQUEEZE_CHANGE_DELETE)
+		else if (kind == PG_SQUEEZE_CHANGE_UPDATE_NEW ||
+				 kind == PG_SQUEEZE_CHANGE_DELETE)
 		{
 			HeapTuple	tup_key;
-			IndexScanDesc	scan;
-			int i;
+			uint32	hash_key;
 			ItemPointerData	ctid;
 
-			if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW)
+			if (kind == PG_SQUEEZE_CHANGE_UPDATE_NEW)
 			{
 				tup_key = tup_old != NULL ? tup_old : tup;
+				hash_key = tup_old != NULL ? hash_old : hash;
 			}
 			else
 			{
 				Assert(tup_old == NULL);
 				tup_key = tup;
+				hash_key = hash;
 			}
 
-			/*
-			 * Find the tuple to be updated or deleted.
-			 *
-			 * XXX As no other transactions are engaged, SnapshotSelf might
-			 * seem to prevent us from wasting values of the command counter
-			 * (as we do not update catalog here, cache invalidation is not
-			 * the reason to increment the counter). However, heap_update()
-			 * does require CommandCounterIncrement().
-			 */
-			scan = index_beginscan(relation, iistate->ident_index,
-								   GetActiveSnapshot(), nkeys, 0);
-
-			index_rescan(scan, key, nkeys, NULL, 0);
-
-			/* Use the incoming tuple to finalize the scan key. */
-			for (i = 0; i < scan->numberOfKeys; i++)
-			{
-				ScanKey	entry;
-				bool	isnull;
-				int16	attno_heap;
-
-				entry = &scan->keyData[i];
-				attno_heap = ident_indkey->values[i];
-				entry->sk_argument = heap_getattr(tup_key,
-												  attno_heap,
-												  relation->rd_att,
-												  &isnull);
-				Assert(!isnull);
-			}
-#if PG_VERSION_NUM >= 120000
-			if (index_getnext_slot(scan, ForwardScanDirection, ind_slot))
-			{
-				bool	shouldFreeInd;
-
-				tup_exist = ExecFetchSlotHeapTuple(ind_slot, false,
-												   &shouldFreeInd);
-				/* TTSOpsBufferHeapTuple has .get_heap_tuple != NULL. */
-				Assert(!shouldFreeInd);
-			}
+			/* Find the tuple to be updated or deleted. */
+			if (tid_cache != NULL &&
+				tid_cache_lookup(tid_cache, iistate, relation, tup_key,
+								 hash_key, &ctid))
+				ncache_hits++;
 			else
-				tup_exist = NULL;
-#else
-			tup_exist = index_getnext(scan, ForwardScanDirection);
-#endif
-			if (tup_exist == NULL)
-				elog(ERROR, "Failed to find target tuple");
-			ItemPointerCopy(&tup_exist->t_self, &ctid);
-			index_endscan(scan);
+				find_tuple_by_key(relation, scan, key, nkeys, tup_key,
+								  ind_slot, &ctid);
 
-			if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW)
+			if (kind == PG_SQUEEZE_CHANGE_UPDATE_NEW)
 			{
 				simple_heap_update(relation, &ctid, tup);
 				if (!HeapTupleIsHeapOnly(tup))
@@ -401,99 +784,1137 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 					list_free(recheck);
 				}
 
+				if (tid_cache != NULL)
+				{
+					/* The old key is gone if the update changed it. */
+					if (hash_key != hash ||
+						!identity_keys_equal(iistate, relation, tup_key, tup))
+						tid_cache_remove(tid_cache, iistate, relation,
+										 tup_key, hash_key);
+					tid_cache_store(tid_cache, tup, transient, hash);
+				}
+
 				nupdates++;
 			}
 			else
 			{
 				simple_heap_delete(relation, &ctid);
+
+				if (tid_cache != NULL)
+					tid_cache_remove(tid_cache, iistate, relation, tup_key,
+									 hash_key);
+
 				ndeletes++;
 			}
 
-			if (tup_old != NULL)
+			if (tup_old_copied)
 			{
 				pfree(tup_old);
-				tup_old = NULL;
+				tup_old_copied = false;
 			}
-
-			pfree(tup);
+			tup_old = NULL;
 		}
 		else
-			elog(ERROR, "Unrecognized kind of change: %d", change->kind);
+			elog(ERROR, "Unrecognized kind of change: %d", kind);
+
+		squeeze_progress_incr_param(SQUEEZE_PROGRESS_CHANGES_PENDING, -1);
+		squeeze_progress_incr_param(SQUEEZE_PROGRESS_CHANGES_APPLIED, 1);
 
-		/* If there's any change, make it visible to the next iteration. */
-		if (change->kind != PG_SQUEEZE_CHANGE_UPDATE_OLD)
+		/*
+		 * If the keys cannot be checked, make any change visible to the next
+		 * iteration.
+		 */
+		if (keys_seen == NULL && kind != PG_SQUEEZE_CHANGE_UPDATE_OLD)
 		{
 			CommandCounterIncrement();
 			UpdateActiveSnapshotCommandId();
+			ncommands++;
 		}
-
-#if PG_VERSION_NUM >= 120000
-		/* TTSOpsMinimalTuple has .get_heap_tuple==NULL. */
-		Assert(shouldFree);
-		pfree(tup_change);
-#endif
 	}
 
-	elog(DEBUG1,
-		 "Concurrent changes applied: %.0f inserts, %.0f updates, %.0f deletes.",
-		 ninserts, nupdates, ndeletes);
+	index_endscan(scan);
 
-	tuplestore_clear(dstate->tstore);
-	dstate->nchanges = 0;
-	dstate->data_size = 0;
+	/*
+	 * Make the changes of the last command visible to the next batch (or to
+	 * the next call).
+	 */
+	if (keys_seen != NULL)
+	{
+		CommandCounterIncrement();
+		hash_destroy(keys_seen);
+		tid_cache_destroy(tid_cache);
+	}
 
-	PopActiveSnapshot();
+	elog(DEBUG1,
+		 "Concurrent changes %s: %.0f inserts, %.0f updates, %.0f deletes, %.0f commands, %.0f rows found in cache.",
+		 done ? "applied" : "partially applied",
+		 ninserts, nupdates, ndeletes, ncommands, ncache_hits);
+	squeeze_stats.changes_inserted += (int64) ninserts;
+	squeeze_stats.changes_updated += (int64) nupdates;
+	squeeze_stats.changes_deleted += (int64) ndeletes;
 
-	/* Cleanup. */
 	if (bistate != NULL)
 		FreeBulkInsertState(bistate);
-	ExecDropSingleTupleTableSlot(slot);
-#if PG_VERSION_NUM >= 120000
-	ExecDropSingleTupleTableSlot(ind_slot);
-#endif
+
+	return done;
 }
 
-static bool
-processing_time_elapsed(struct timeval *utmost)
+/*
+ * Create a hash table to keep track of the identity key hash values affected
+ * by the current command.
+ */
+static HTAB *
+create_key_hash_set(void)
 {
-	struct timeval	now;
+	HASHCTL	ctl;
 
-	if (utmost == NULL)
-		return false;
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint32);
+	ctl.entrysize = sizeof(uint32);
+	ctl.hcxt = CurrentMemoryContext;
 
-	gettimeofday(&now, NULL);
+	return hash_create("pg_squeeze keys", 1024, &ctl,
+					   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
 
-	if (now.tv_sec < utmost->tv_sec)
-		return false;
+/*
+ * Create a hash table to map identity keys (actually their hash values) to
+ * the rows apply_changes_in_order() has written.
+ *
+ * The tuples added are not copied unless they are transient, so the cache
+ * must be destroyed before the change buffer is reset.
+ */
+static HTAB *
+create_tid_cache(void)
+{
+	HASHCTL	ctl;
 
-	if (now.tv_sec > utmost->tv_sec)
-		return true;
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(uint32);
+	ctl.entrysize = sizeof(TIDCacheEntry);
+	ctl.hcxt = CurrentMemoryContext;
 
-	return now.tv_usec >= utmost->tv_usec;
+	return hash_create("pg_squeeze TID cache", 1024, &ctl,
+					   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
 }
 
-IndexInsertState *
-get_index_insert_state(Relation	relation, Oid ident_index_id)
+/*
+ * Find the current TID of the row whose identity key is equal to that of
+ * tup_key. Return false if the row is not in the cache.
+ */
+static bool
+tid_cache_lookup(HTAB *cache, IndexInsertState *iistate, Relation relation,
+				 HeapTuple tup_key, uint32 hash, ItemPointer ctid)
 {
-	EState	*estate;
-	int	i;
-	IndexInsertState	*result;
+	TIDCacheEntry	*entry;
 
-	result = (IndexInsertState *) palloc0(sizeof(IndexInsertState));
-	estate = CreateExecutorState();
-	result->econtext = GetPerTupleExprContext(estate);
+	entry = (TIDCacheEntry *) hash_search(cache, &hash, HASH_FIND, NULL);
+	if (entry == NULL ||
+		!identity_keys_equal(iistate, relation, entry->tup, tup_key))
+		return false;
 
-	result->rri = (ResultRelInfo *) palloc(sizeof(ResultRelInfo));
-	InitResultRelInfo(result->rri, relation,  0, 0, 0);
-	ExecOpenIndices(result->rri, false);
+	ItemPointerCopy(&entry->tup->t_self, ctid);
+	return true;
+}
 
-	/*
-	 * Find the relcache entry of the identity index so that we spend no extra
-	 * effort to open / close it.
-	 */
-	for (i = 0; i < result->rri->ri_NumIndices; i++)
-	{
-		Relation	ind_rel;
+/*
+ * Remember the row we've just inserted or updated. If another key with the
+ * same hash value is cached, it gets replaced.
+ */
+static void
+tid_cache_store(HTAB *cache, HeapTuple tup, bool transient, uint32 hash)
+{
+	TIDCacheEntry	*entry;
+	bool	found;
+
+	entry = (TIDCacheEntry *) hash_search(cache, &hash, HASH_ENTER, &found);
+	if (found && entry->copied)
+		heap_freetuple(entry->tup);
+
+	entry->copied = transient;
+	entry->tup = transient ? heap_copytuple(tup) : tup;
+}
+
+/*
+ * Forget the row whose identity key is equal to that of tup_key, if it's in
+ * the cache.
+ */
+static void
+tid_cache_remove(HTAB *cache, IndexInsertState *iistate, Relation relation,
+				 HeapTuple tup_key, uint32 hash)
+{
+	TIDCacheEntry	*entry;
+
+	entry = (TIDCacheEntry *) hash_search(cache, &hash, HASH_FIND, NULL);
+	if (entry == NULL ||
+		!identity_keys_equal(iistate, relation, entry->tup, tup_key))
+		return;
+
+	if (entry->copied)
+		heap_freetuple(entry->tup);
+	hash_search(cache, &hash, HASH_REMOVE, NULL);
+}
+
+/*
+ * Free the cache, including the tuples we had to copy.
+ */
+static void
+tid_cache_destroy(HTAB *cache)
+{
+	HASH_SEQ_STATUS	status;
+	TIDCacheEntry	*entry;
+
+	hash_seq_init(&status, cache);
+	while ((entry = (TIDCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->copied)
+			heap_freetuple(entry->tup);
+	}
+	hash_destroy(cache);
+}
+
+/*
+ * Apply the net effect of the changes on each row.
+ *
+ * The changes are grouped by the identity key and each group is reduced to
+ * at most one operation: INSERT if the row did not exist before the batch,
+ * DELETE if it does not exist after the batch, and UPDATE to the final image
+ * if it exists before and after. UPDATE that changes the identity key is
+ * treated as DELETE of the old key and INSERT of the new one.
+ *
+ * Since each row of the table is affected at most once, all the operations
+ * can use the same command ID and none of the index scans needs to see the
+ * other operations of the batch.
+ *
+ * Uniqueness of the index keys is not checked. The batch only contains
+ * complete transactions, so the table is consistent when we're done with the
+ * batch, but the order in which we apply the net changes does not
+ * necessarily correspond to any valid order of the original changes.
+ *
+ * If the time indicated by must_complete elapses, stop after the current
+ * operation and return false. The batch, including the partial result of
+ * coalescing if the time elapsed before the changes could be applied, is
+ * saved in dstate so that the next call can continue.
+ */
+static bool
+apply_changes_coalesced(DecodingOutputState *dstate, Relation relation,
+						ScanKey key, int nkeys, IndexInsertState *iistate,
+						TupleTableSlot *slot, TupleTableSlot *ind_slot,
+						struct timeval *must_complete)
+{
+	CoalescedBatch	*batch;
+	MemoryContext	old_cxt;
+	BulkInsertState bistate = NULL;
+	CommandId	cid;
+	bool	done = true;
+
+	batch = dstate->coalesced_batch;
+	if (batch == NULL)
+	{
+		MemoryContext	apply_cxt;
+
+		/* Freed by reset_change_buffer() at the latest. */
+		apply_cxt = AllocSetContextCreate(dstate->change_cxt,
+										  "pg_squeeze apply context",
+										  ALLOCSET_DEFAULT_SIZES);
+		batch = (CoalescedBatch *)
+			MemoryContextAllocZero(apply_cxt, sizeof(CoalescedBatch));
+		batch->cxt = apply_cxt;
+		batch->phase = COALESCE_READ;
+		dstate->coalesced_batch = batch;
+	}
+
+	if (!coalesce_changes(dstate, batch, relation, key, nkeys, iistate,
+						  ind_slot, must_complete))
+	{
+		elog(DEBUG1,
+			 "Coalescing of concurrent changes interrupted in phase %d.",
+			 batch->phase);
+		return false;
+	}
+
+	old_cxt = MemoryContextSwitchTo(batch->cxt);
+
+	cid = GetCurrentCommandId(true);
+	for (; batch->next < batch->nnet; batch->next++)
+	{
+		KeyedChange	*change = &batch->net[batch->next];
+
+		if (processing_time_elapsed(must_complete))
+		{
+			done = false;
+			break;
+		}
+
+		if (change->kind == PG_SQUEEZE_CHANGE_DELETE)
+		{
+			simple_heap_delete(relation, &change->ctid);
+			batch->ndeletes++;
+		}
+		else if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW)
+		{
+			simple_heap_update(relation, &change->ctid, change->tup);
+			if (!HeapTupleIsHeapOnly(change->tup))
+				insert_index_tuples_nocheck(iistate, relation, slot,
+											change->tup);
+			batch->nupdates++;
+		}
+		else
+		{
+			Assert(change->kind == PG_SQUEEZE_CHANGE_INSERT);
+
+			if (bistate == NULL)
+				bistate = GetBulkInsertState();
+
+			heap_insert(relation, change->tup, cid, 0, bistate);
+			insert_index_tuples_nocheck(iistate, relation, slot,
+										change->tup);
+			batch->ninserts++;
+		}
+	}
+
+	if (bistate != NULL)
+		FreeBulkInsertState(bistate);
+
+	/* Make the changes visible to the next batch (or the next call). */
+	CommandCounterIncrement();
+
+	MemoryContextSwitchTo(old_cxt);
+
+	if (!done)
+	{
+		elog(DEBUG1,
+			 "Application of concurrent changes interrupted after %d of %d operations.",
+			 batch->next, batch->nnet);
+		return false;
+	}
+
+	elog(DEBUG1,
+		 "Concurrent changes applied: %d changes coalesced into %.0f inserts, %.0f updates, %.0f deletes.",
+		 batch->nchanges, batch->ninserts, batch->nupdates, batch->ndeletes);
+
+	squeeze_stats.changes_inserted += (int64) batch->ninserts;
+	squeeze_stats.changes_updated += (int64) batch->nupdates;
+	squeeze_stats.changes_deleted += (int64) batch->ndeletes;
+
+	/* The progress is only reported for the whole batch. */
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_CHANGES_PENDING, 0);
+	squeeze_progress_incr_param(SQUEEZE_PROGRESS_CHANGES_APPLIED,
+								(int64) dstate->nchanges);
+
+	MemoryContextDelete(batch->cxt);
+	dstate->coalesced_batch = NULL;
+	return true;
+}
+
+/*
+ * Read the changes of the batch and reduce them to the net changes, see
+ * apply_changes_coalesced(), and find the rows to be updated or deleted.
+ *
+ * The work is done in phases, and each phase checks the time indicated by
+ * must_complete as it proceeds. If the time elapses, return false and keep
+ * the partial result in the batch, so that the next call continues where
+ * this one has stopped. Only the sorts are not interruptible, but those only
+ * work on the data in memory. Returns true when the net changes are ready to
+ * be applied.
+ */
+static bool
+coalesce_changes(DecodingOutputState *dstate, CoalescedBatch *batch,
+				 Relation relation, ScanKey key, int nkeys,
+				 IndexInsertState *iistate, TupleTableSlot *ind_slot,
+				 struct timeval *must_complete)
+{
+	MemoryContext	old_cxt;
+	int	i, j;
+
+	old_cxt = MemoryContextSwitchTo(batch->cxt);
+
+	if (batch->phase == COALESCE_READ)
+	{
+		HeapTuple	tup, tup_old = NULL;
+		ConcurrentChangeKind	kind;
+		bool	transient;
+
+		/*
+		 * Neither merging nor splitting of UPDATE changes can increase the
+		 * number of changes.
+		 */
+		if (batch->changes == NULL)
+			batch->changes = (KeyedChange *)
+				palloc((Size) dstate->nchanges * sizeof(KeyedChange));
+
+		while (true)
+		{
+			/*
+			 * The read position is kept in dstate, so we can stop anywhere
+			 * except between the old and the new tuple of an UPDATE.
+			 */
+			if (tup_old == NULL && processing_time_elapsed(must_complete))
+			{
+				MemoryContextSwitchTo(old_cxt);
+				return false;
+			}
+
+			tup = get_next_change(dstate, &kind, &transient);
+			if (tup == NULL)
+				break;
+
+			/* All the tuples are needed until the end. */
+			if (transient)
+				tup = heap_copytuple(tup);
+
+			if (kind == PG_SQUEEZE_CHANGE_UPDATE_OLD)
+			{
+				Assert(tup_old == NULL);
+				tup_old = tup;
+				continue;
+			}
+
+			if (kind == PG_SQUEEZE_CHANGE_UPDATE_NEW && tup_old != NULL &&
+				!identity_keys_equal(iistate, relation, tup_old, tup))
+			{
+				add_keyed_change(batch->changes, &batch->nchanges,
+								 PG_SQUEEZE_CHANGE_DELETE, tup_old, tup_old,
+								 iistate, relation);
+				add_keyed_change(batch->changes, &batch->nchanges,
+								 PG_SQUEEZE_CHANGE_INSERT, tup, tup, iistate,
+								 relation);
+			}
+			else if (kind == PG_SQUEEZE_CHANGE_UPDATE_NEW)
+				add_keyed_change(batch->changes, &batch->nchanges, kind, tup,
+								 tup_old != NULL ? tup_old : tup, iistate,
+								 relation);
+			else if (kind == PG_SQUEEZE_CHANGE_INSERT ||
+					 kind == PG_SQUEEZE_CHANGE_DELETE)
+			{
+				Assert(tup_old == NULL);
+				add_keyed_change(batch->changes, &batch->nchanges, kind, tup,
+								 tup, iistate, relation);
+			}
+			else
+				elog(ERROR, "Unrecognized kind of change: %d", kind);
+
+			tup_old = NULL;
+		}
+		Assert(tup_old == NULL);
+
+		/*
+		 * Sort the changes by the hash value, and by position within the
+		 * same hash value, so that changes of the same row are adjacent and
+		 * in the original order.
+		 */
+		qsort(batch->changes, batch->nchanges, sizeof(KeyedChange),
+			  keyed_change_cmp);
+
+		batch->net = (KeyedChange *) palloc(batch->nchanges *
+											sizeof(KeyedChange));
+		batch->grouped = (bool *) palloc0(batch->nchanges * sizeof(bool));
+		batch->phase = COALESCE_GROUP;
+	}
+
+	if (batch->phase == COALESCE_GROUP)
+	{
+		KeyedChange	*changes = batch->changes;
+		KeyedChange	*net = batch->net;
+		int	nchanges = batch->nchanges;
+
+		/*
+		 * Reduce each group of changes having equal keys to the net change.
+		 * Different keys can have the same hash value, so we still need to
+		 * compare the keys within a run of equal hash values.
+		 */
+		for (; batch->next_group < nchanges; batch->next_group++)
+		{
+			KeyedChange	*first, *last;
+			bool	existed;
+
+			if (processing_time_elapsed(must_complete))
+			{
+				MemoryContextSwitchTo(old_cxt);
+				return false;
+			}
+
+			i = batch->next_group;
+			if (batch->grouped[i])
+				continue;
+
+			first = last = &changes[i];
+			for (j = i + 1; j < nchanges && changes[j].hash == first->hash;
+				 j++)
+			{
+				if (batch->grouped[j])
+					continue;
+
+				if (identity_keys_equal(iistate, relation, first->tup_key,
+										changes[j].tup_key))
+				{
+					last = &changes[j];
+					batch->grouped[j] = true;
+				}
+			}
+
+			/*
+			 * Only INSERT can be the first change of a row that did not
+			 * exist.
+			 */
+			existed = first->kind != PG_SQUEEZE_CHANGE_INSERT;
+			if (last->kind == PG_SQUEEZE_CHANGE_DELETE)
+			{
+				if (!existed)
+					/* INSERT followed by DELETE, nothing to do. */
+					continue;
+				net[batch->nnet].kind = PG_SQUEEZE_CHANGE_DELETE;
+			}
+			else if (existed)
+				net[batch->nnet].kind = PG_SQUEEZE_CHANGE_UPDATE_NEW;
+			else
+				net[batch->nnet].kind = PG_SQUEEZE_CHANGE_INSERT;
+
+			/*
+			 * The row that existed before the batch can only be found this
+			 * way.
+			 */
+			net[batch->nnet].tup_key = first->tup_key;
+			/* The final image of the row. */
+			net[batch->nnet].tup = last->tup;
+			batch->nnet++;
+		}
+
+		/* The original changes are not needed anymore. */
+		pfree(batch->grouped);
+		batch->grouped = NULL;
+		pfree(batch->changes);
+		batch->changes = NULL;
+
+		/*
+		 * All the rows to be updated or deleted existed before the batch, so
+		 * we can find them all before changing anything. Look up the keys in
+		 * the index order, so that the index pages are accessed more or less
+		 * sequentially rather than at random places.
+		 */
+		batch->lookups = (KeyedChange **) palloc(batch->nnet *
+												 sizeof(KeyedChange *));
+		for (i = 0; i < batch->nnet; i++)
+		{
+			if (net[i].kind != PG_SQUEEZE_CHANGE_INSERT)
+				batch->lookups[batch->nlookups++] = &net[i];
+		}
+		if (batch->nlookups > 1)
+		{
+			IndexOrderArg	cmp_arg;
+
+			cmp_arg.iistate = iistate;
+			cmp_arg.relation = relation;
+			qsort_arg(batch->lookups, batch->nlookups,
+					  sizeof(KeyedChange *), keyed_change_index_cmp,
+					  &cmp_arg);
+		}
+		batch->phase = COALESCE_LOOKUP;
+	}
+
+	if (batch->phase == COALESCE_LOOKUP)
+	{
+		while (batch->next_lookup < batch->nlookups)
+		{
+			int	nleft, n;
+
+			if (processing_time_elapsed(must_complete))
+			{
+				MemoryContextSwitchTo(old_cxt);
+				return false;
+			}
+
+			nleft = batch->nlookups - batch->next_lookup;
+			if (squeeze_max_parallel_lookup_workers > 0 &&
+				nleft >= PARALLEL_LOOKUP_MIN_TUPLES)
+				n = Min(nleft, PARALLEL_LOOKUP_STEP_SIZE);
+			else
+				n = Min(nleft, LOOKUP_STEP_SIZE);
+
+			find_tuples_by_key(relation, iistate, key, nkeys,
+							   batch->lookups + batch->next_lookup, n,
+							   ind_slot);
+			batch->next_lookup += n;
+		}
+		pfree(batch->lookups);
+		batch->lookups = NULL;
+
+		/*
+		 * DELETEs first, then UPDATEs, then INSERTs. Applying DELETE (of an
+		 * old key) before INSERT (of the new key) helps to keep the indexes
+		 * small. DELETEs and UPDATEs are processed in the order of their
+		 * TIDs, so that the heap is accessed more or less sequentially.
+		 */
+		qsort(batch->net, batch->nnet, sizeof(KeyedChange),
+			  keyed_change_apply_cmp);
+		batch->phase = COALESCE_APPLY;
+	}
+
+	MemoryContextSwitchTo(old_cxt);
+
+	return true;
+}
+
+/*
+ * Prepare for reading the changes from the beginning.
+ */
+static void
+start_reading_changes(DecodingOutputState *dstate)
+{
+	dstate->read_seg = dstate->seg_first;
+	dstate->read_off = 0;
+
+	if (dstate->spill_file != NULL &&
+		BufFileSeek(dstate->spill_file, 0, 0, SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in pg_squeeze temporary file: %m")));
+}
+
+/*
+ * Return the tuple of the next change, or NULL if there are no more
+ * changes. The kind of the change is stored in *kind.
+ *
+ * The tuple is not copied, so the caller may only modify it in place. If
+ * *transient is set to true, the tuple was read from the spill file and it's
+ * only valid until the next call.
+ */
+static HeapTuple
+get_next_change(DecodingOutputState *dstate, ConcurrentChangeKind *kind,
+				bool *transient)
+{
+	ConcurrentChange	*change;
+	ConcurrentChange	hdr;
+	Size	size, nread;
+
+	/* Changes in memory come first. */
+	while (dstate->read_seg != NULL)
+	{
+		ChangeSegment	*seg = dstate->read_seg;
+
+		if (dstate->read_off < seg->used)
+		{
+			change = (ConcurrentChange *)
+				(ChangeSegmentData(seg) + dstate->read_off);
+			dstate->read_off += ConcurrentChangeSize(change->tup_data.t_len);
+			change->tup_data.t_data = (HeapTupleHeader)
+				((char *) change + MAXALIGN(sizeof(ConcurrentChange)));
+
+			*kind = change->kind;
+			*transient = false;
+			return &change->tup_data;
+		}
+
+		dstate->read_seg = seg->next;
+		dstate->read_off = 0;
+	}
+
+	if (dstate->spill_file == NULL)
+		return NULL;
+
+	nread = BufFileRead(dstate->spill_file, &hdr, sizeof(ConcurrentChange));
+	if (nread == 0)
+		return NULL;
+	if (nread != sizeof(ConcurrentChange))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from pg_squeeze temporary file: %m")));
+
+	size = ConcurrentChangeSize(hdr.tup_data.t_len);
+	if (size > dstate->read_buf_size)
+	{
+		if (dstate->read_buf != NULL)
+			pfree(dstate->read_buf);
+		dstate->read_buf = MemoryContextAlloc(dstate->change_cxt, size);
+		dstate->read_buf_size = size;
+	}
+	change = (ConcurrentChange *) dstate->read_buf;
+	memcpy(change, &hdr, sizeof(ConcurrentChange));
+	change->tup_data.t_data = (HeapTupleHeader)
+		((char *) change + MAXALIGN(sizeof(ConcurrentChange)));
+
+	nread = BufFileRead(dstate->spill_file, change->tup_data.t_data,
+						change->tup_data.t_len);
+	if (nread != change->tup_data.t_len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from pg_squeeze temporary file: %m")));
+
+	*kind = change->kind;
+	*transient = true;
+	return &change->tup_data;
+}
+
+/*
+ * Discard all the changes stored so far.
+ */
+static void
+reset_change_buffer(DecodingOutputState *dstate)
+{
+	if (dstate->spill_file != NULL)
+	{
+		BufFileClose(dstate->spill_file);
+		dstate->spill_file = NULL;
+	}
+
+	MemoryContextReset(dstate->change_cxt);
+	dstate->seg_first = NULL;
+	dstate->seg_last = NULL;
+	dstate->read_seg = NULL;
+	dstate->read_off = 0;
+	dstate->read_buf = NULL;
+	dstate->read_buf_size = 0;
+
+	/* The batch was allocated in change_cxt. */
+	dstate->coalesced_batch = NULL;
+	dstate->apply_in_progress = false;
+
+	dstate->nchanges = 0;
+	dstate->data_size = 0;
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_CHANGES_PENDING, 0);
+}
+
+/*
+ * Find the existing rows for lookups[], which are changes of kind
+ * UPDATE_NEW and DELETE sorted in the index order, and store their TIDs in
+ * the ctid field.
+ *
+ * If the key consists of a single column, all the rows are retrieved by a
+ * single scan. If there are many rows, let parallel workers help. Since the
+ * keys are sorted, each participant actually processes a range of keys.
+ */
+static void
+find_tuples_by_key(Relation relation, IndexInsertState *iistate,
+				   ScanKey key, int nkeys, KeyedChange **lookups,
+				   int nlookups, TupleTableSlot *ind_slot)
+{
+	int	i;
+
+	if (squeeze_max_parallel_lookup_workers > 0 &&
+		nlookups >= PARALLEL_LOOKUP_MIN_TUPLES)
+	{
+		HeapTuple	*tuples;
+		ItemPointer	tids;
+
+		tuples = (HeapTuple *) palloc(nlookups * sizeof(HeapTuple));
+		for (i = 0; i < nlookups; i++)
+			tuples[i] = lookups[i]->tup_key;
+
+		tids = (ItemPointer) palloc(nlookups * sizeof(ItemPointerData));
+		find_tuples_parallel(relation, iistate->ident_index, tuples,
+							 nlookups, tids,
+							 squeeze_max_parallel_lookup_workers);
+
+		for (i = 0; i < nlookups; i++)
+			lookups[i]->ctid = tids[i];
+		pfree(tids);
+		pfree(tuples);
+	}
+	else if (nkeys == 1)
+		find_tuples_by_key_array(relation, iistate, key, lookups, nlookups,
+								 ind_slot);
+	else
+	{
+		IndexScanDesc	scan;
+
+		scan = index_beginscan(relation, iistate->ident_index,
+							   GetActiveSnapshot(), nkeys, 0);
+		for (i = 0; i < nlookups; i++)
+			find_tuple_by_key(relation, scan, key, nkeys, lookups[i]->tup_key,
+							  ind_slot, &lookups[i]->ctid);
+		index_endscan(scan);
+	}
+}
+
+/*
+ * Find the rows for lookups[], which are sorted in the index order, using a
+ * single scan with an array of keys. Only possible if the identity key
+ * consists of a single column.
+ *
+ * The index returns the rows in the order of the keys too, so we only need
+ * to check that each row returned matches the next lookup.
+ */
+static void
+find_tuples_by_key_array(Relation relation, IndexInsertState *iistate,
+						 ScanKey key, KeyedChange **lookups, int nlookups,
+						 TupleTableSlot *ind_slot)
+{
+	AttrNumber	attno;
+	Form_pg_attribute	att;
+	Datum	*values;
+	ArrayType	*array;
+	ScanKeyData	array_key;
+	IndexScanDesc	scan;
+	int	i;
+
+	Assert(iistate->ident_key_natts == 1);
+
+	attno = iistate->ident_key_attnos[0];
+	att = TupleDescAttr(relation->rd_att, attno - 1);
+	values = (Datum *) palloc(nlookups * sizeof(Datum));
+	for (i = 0; i < nlookups; i++)
+	{
+		bool	isnull;
+
+		values[i] = heap_getattr(lookups[i]->tup_key, attno,
+								 relation->rd_att, &isnull);
+		Assert(!isnull);
+	}
+	array = construct_array(values, nlookups, att->atttypid, att->attlen,
+							att->attbyval, att->attalign);
+
+	memcpy(&array_key, key, sizeof(ScanKeyData));
+	array_key.sk_flags |= SK_SEARCHARRAY;
+	array_key.sk_argument = PointerGetDatum(array);
+
+	scan = index_beginscan(relation, iistate->ident_index,
+						   GetActiveSnapshot(), 1, 0);
+	index_rescan(scan, &array_key, 1, NULL, 0);
+	for (i = 0; i < nlookups; i++)
+	{
+		HeapTuple	tup_exist;
+
+#if PG_VERSION_NUM >= 120000
+		if (index_getnext_slot(scan, ForwardScanDirection, ind_slot))
+		{
+			bool	shouldFreeInd;
+
+			tup_exist = ExecFetchSlotHeapTuple(ind_slot, false,
+											   &shouldFreeInd);
+			Assert(!shouldFreeInd);
+		}
+		else
+			tup_exist = NULL;
+#else
+		tup_exist = index_getnext(scan, ForwardScanDirection);
+#endif
+		if (tup_exist == NULL ||
+			!identity_keys_equal(iistate, relation, tup_exist,
+								 lookups[i]->tup_key))
+			elog(ERROR, "Failed to find target tuple");
+		ItemPointerCopy(&tup_exist->t_self, &lookups[i]->ctid);
+	}
+	index_endscan(scan);
+
+	pfree(array);
+	pfree(values);
+}
+
+/*
+ * Use the identity index to find the tuple whose key is equal to that of
+ * tup_key, and store its TID in *ctid.
+ *
+ * The caller passes a scan on the identity index, so the scan descriptor can
+ * be reused for multiple lookups. Likewise, scan key is passed by caller, so
+ * it does not have to be constructed multiple times. Key entries have all
+ * fields initialized, except for sk_argument.
+ *
+ * XXX As no other transactions are engaged, SnapshotSelf might seem to
+ * prevent us from wasting values of the command counter (as we do not update
+ * catalog here, cache invalidation is not the reason to increment the
+ * counter). However, heap_update() does require CommandCounterIncrement().
+ *
+ * ind_slot is only used by PG >= 12.
+ */
+void
+find_tuple_by_key(Relation relation, IndexScanDesc scan,
+				  ScanKey key, int nkeys, HeapTuple tup_key,
+				  TupleTableSlot *ind_slot, ItemPointer ctid)
+{
+	int2vector	*ident_indkey;
+	HeapTuple	tup_exist;
+	int i;
+
+	/* Info needed to retrieve key values from heap tuple. */
+	ident_indkey = &scan->indexRelation->rd_index->indkey;
+
+	index_rescan(scan, key, nkeys, NULL, 0);
+
+	/* Use the incoming tuple to finalize the scan key. */
+	for (i = 0; i < scan->numberOfKeys; i++)
+	{
+		ScanKey	entry;
+		bool	isnull;
+		int16	attno_heap;
+
+		entry = &scan->keyData[i];
+		attno_heap = ident_indkey->values[i];
+		entry->sk_argument = heap_getattr(tup_key,
+										  attno_heap,
+										  relation->rd_att,
+										  &isnull);
+		Assert(!isnull);
+	}
+#if PG_VERSION_NUM >= 120000
+	if (index_getnext_slot(scan, ForwardScanDirection, ind_slot))
+	{
+		bool	shouldFreeInd;
+
+		tup_exist = ExecFetchSlotHeapTuple(ind_slot, false,
+										   &shouldFreeInd);
+		/* TTSOpsBufferHeapTuple has .get_heap_tuple != NULL. */
+		Assert(!shouldFreeInd);
+	}
+	else
+		tup_exist = NULL;
+#else
+	tup_exist = index_getnext(scan, ForwardScanDirection);
+#endif
+	if (tup_exist == NULL)
+		elog(ERROR, "Failed to find target tuple");
+	ItemPointerCopy(&tup_exist->t_self, ctid);
+}
+
+/*
+ * Insert index entries for a tuple that has been inserted into the heap.
+ *
+ * Unlike ExecInsertIndexTuples(), do not check uniqueness or exclusion
+ * constraints, see apply_changes_coalesced() for the reason.
+ */
+static void
+insert_index_tuples_nocheck(IndexInsertState *iistate, Relation relation,
+							TupleTableSlot *slot, HeapTuple tup)
+{
+	ResultRelInfo	*rri = iistate->rri;
+	int	i;
+
+#if PG_VERSION_NUM >= 120000
+	ExecStoreHeapTuple(tup, slot, false);
+#else
+	ExecStoreTuple(tup, slot, InvalidBuffer, false);
+#endif
+
+	for (i = 0; i < rri->ri_NumIndices; i++)
+	{
+		Relation	index = rri->ri_IndexRelationDescs[i];
+		IndexInfo	*index_info = rri->ri_IndexRelationInfo[i];
+		Datum	values[INDEX_MAX_KEYS];
+		bool	isnull[INDEX_MAX_KEYS];
+
+		if (index_info->ii_Predicate != NIL)
+		{
+			if (index_info->ii_PredicateState == NULL)
+				index_info->ii_PredicateState =
+					ExecPrepareQual(index_info->ii_Predicate,
+									iistate->estate);
+
+			if (!ExecQual(index_info->ii_PredicateState, iistate->econtext))
+				continue;
+		}
+
+		FormIndexDatum(index_info, slot, iistate->estate, values, isnull);
+		index_insert(index, values, isnull, &tup->t_self, relation,
+					 UNIQUE_CHECK_NO, index_info);
+	}
+
+	ResetExprContext(iistate->econtext);
+}
+
+/*
+ * Add a change to the array that apply_changes_coalesced() sorts.
+ */
+static void
+add_keyed_change(KeyedChange *changes, int *nchanges,
+				 ConcurrentChangeKind kind, HeapTuple tup, HeapTuple tup_key,
+				 IndexInsertState *iistate, Relation relation)
+{
+	KeyedChange	*change = &changes[*nchanges];
+
+	change->kind = kind;
+	change->tup = tup;
+	change->tup_key = tup_key;
+	change->hash = identity_key_hash(iistate, relation, tup_key);
+	change->pos = *nchanges;
+	(*nchanges)++;
+}
+
+static int
+keyed_change_cmp(const void *arg1, const void *arg2)
+{
+	const KeyedChange	*change1 = (const KeyedChange *) arg1;
+	const KeyedChange	*change2 = (const KeyedChange *) arg2;
+
+	if (change1->hash < change2->hash)
+		return -1;
+	else if (change1->hash > change2->hash)
+		return 1;
+
+	if (change1->pos < change2->pos)
+		return -1;
+	else if (change1->pos > change2->pos)
+		return 1;
+	return 0;
+}
+
+/*
+ * Compare the identity keys of two changes the way the identity index does.
+ *
+ * The order of DESC columns must be reversed: btree sorts the array of keys
+ * (see find_tuples_by_key_array()) according to the column options and
+ * returns the rows in that order.
+ */
+static int
+keyed_change_index_cmp(const void *arg1, const void *arg2, void *arg)
+{
+	KeyedChange	*change1 = *(KeyedChange **) arg1;
+	KeyedChange	*change2 = *(KeyedChange **) arg2;
+	IndexOrderArg	*cmp_arg = (IndexOrderArg *) arg;
+	IndexInsertState	*iistate = cmp_arg->iistate;
+	TupleDesc	desc = cmp_arg->relation->rd_att;
+	int	i;
+
+	for (i = 0; i < iistate->ident_key_natts; i++)
+	{
+		AttrNumber	attno = iistate->ident_key_attnos[i];
+		Datum	value1, value2;
+		bool	isnull1, isnull2;
+		int32	result;
+
+		value1 = heap_getattr(change1->tup_key, attno, desc, &isnull1);
+		value2 = heap_getattr(change2->tup_key, attno, desc, &isnull2);
+		Assert(!isnull1 && !isnull2);
+
+		result = DatumGetInt32(FunctionCall2Coll(&iistate->ident_key_cmp_funcs[i],
+												 iistate->ident_key_collations[i],
+												 value1, value2));
+		if (result != 0)
+		{
+			result = result < 0 ? -1 : 1;
+			if (iistate->ident_key_options[i] & INDOPTION_DESC)
+				result = -result;
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Sort the net changes in the order they should be applied: DELETEs, UPDATEs
+ * and INSERTs, the existing rows in the order of their TIDs.
+ */
+static int
+keyed_change_apply_cmp(const void *arg1, const void *arg2)
+{
+	const KeyedChange	*change1 = (const KeyedChange *) arg1;
+	const KeyedChange	*change2 = (const KeyedChange *) arg2;
+	int	rank1, rank2;
+
+	rank1 = change1->kind == PG_SQUEEZE_CHANGE_DELETE ? 0 :
+		(change1->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW ? 1 : 2);
+	rank2 = change2->kind == PG_SQUEEZE_CHANGE_DELETE ? 0 :
+		(change2->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW ? 1 : 2);
+	if (rank1 != rank2)
+		return rank1 - rank2;
+
+	/* INSERTs have no existing row. */
+	if (change1->kind == PG_SQUEEZE_CHANGE_INSERT)
+		return 0;
+
+	return ItemPointerCompare((ItemPointer) &change1->ctid,
+							  (ItemPointer) &change2->ctid);
+}
+
+/*
+ * Compute hash value of the identity key of a tuple.
+ */
+static uint32
+identity_key_hash(IndexInsertState *iistate, Relation relation,
+				  HeapTuple tup)
+{
+	uint32	result = 0;
+	int	i;
+
+	for (i = 0; i < iistate->ident_key_natts; i++)
+	{
+		Datum	value;
+		bool	isnull;
+		uint32	hash;
+
+		value = heap_getattr(tup, iistate->ident_key_attnos[i],
+							 relation->rd_att, &isnull);
+		Assert(!isnull);
+
+		hash = DatumGetUInt32(FunctionCall1Coll(&iistate->ident_key_hash_funcs[i],
+												iistate->ident_key_collations[i],
+												value));
+
+		/* Rotate the result and combine it with the column hash. */
+		result = (result << 1) | ((result & 0x80000000) ? 1 : 0);
+		result ^= hash;
+	}
+
+	return result;
+}
+
+/*
+ * Do the tuples have equal identity keys?
+ */
+static bool
+identity_keys_equal(IndexInsertState *iistate, Relation relation,
+					HeapTuple tup1, HeapTuple tup2)
+{
+	int	i;
+
+	for (i = 0; i < iistate->ident_key_natts; i++)
+	{
+		AttrNumber	attno = iistate->ident_key_attnos[i];
+		Datum	value1, value2;
+		bool	isnull1, isnull2;
+
+		value1 = heap_getattr(tup1, attno, relation->rd_att, &isnull1);
+		value2 = heap_getattr(tup2, attno, relation->rd_att, &isnull2);
+		Assert(!isnull1 && !isnull2);
+
+		if (!DatumGetBool(FunctionCall2Coll(&iistate->ident_key_eq_funcs[i],
+											iistate->ident_key_collations[i],
+											value1, value2)))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+processing_time_elapsed(struct timeval *utmost)
+{
+	struct timeval	now;
+
+	if (utmost == NULL)
+		return false;
+
+	gettimeofday(&now, NULL);
+
+	if (now.tv_sec < utmost->tv_sec)
+		return false;
+
+	if (now.tv_sec > utmost->tv_sec)
+		return true;
+
+	return now.tv_usec >= utmost->tv_usec;
+}
+
+IndexInsertState *
+get_index_insert_state(Relation	relation, Oid ident_index_id)
+{
+	EState	*estate;
+	int	i;
+	IndexInsertState	*result;
+
+	result = (IndexInsertState *) palloc0(sizeof(IndexInsertState));
+	estate = CreateExecutorState();
+	result->econtext = GetPerTupleExprContext(estate);
+
+	result->rri = (ResultRelInfo *) palloc(sizeof(ResultRelInfo));
+	InitResultRelInfo(result->rri, relation,  0, 0, 0);
+	ExecOpenIndices(result->rri, false);
+
+	/*
+	 * Find the relcache entry of the identity index so that we spend no extra
+	 * effort to open / close it.
+	 */
+	for (i = 0; i < result->rri->ri_NumIndices; i++)
+	{
+		Relation	ind_rel;
 
 		ind_rel = result->rri->ri_IndexRelationDescs[i];
 		if (ind_rel->rd_id == ident_index_id)
@@ -502,6 +1923,60 @@ get_index_insert_state(Relation	relation, Oid ident_index_id)
 	if (result->ident_index == NULL)
 		elog(ERROR, "Failed to open identity index");
 
+	/* Functions to hash and compare the identity key. */
+	result->ident_key_natts = result->ident_index->rd_index->indnatts;
+	result->ident_key_attnos = (AttrNumber *)
+		palloc(result->ident_key_natts * sizeof(AttrNumber));
+	result->ident_key_hash_funcs = (FmgrInfo *)
+		palloc(result->ident_key_natts * sizeof(FmgrInfo));
+	result->ident_key_eq_funcs = (FmgrInfo *)
+		palloc(result->ident_key_natts * sizeof(FmgrInfo));
+	result->ident_key_cmp_funcs = (FmgrInfo *)
+		palloc(result->ident_key_natts * sizeof(FmgrInfo));
+	result->ident_key_options = (int16 *)
+		palloc(result->ident_key_natts * sizeof(int16));
+	result->ident_key_collations = (Oid *)
+		palloc(result->ident_key_natts * sizeof(Oid));
+	result->ident_key_hashable = true;
+	for (i = 0; i < result->ident_key_natts; i++)
+	{
+		AttrNumber	attno;
+		Form_pg_attribute	att;
+		TypeCacheEntry	*typentry;
+
+		attno = result->ident_index->rd_index->indkey.values[i];
+		/* System column (OID), not worth special handling. */
+		if (attno < 1)
+		{
+			result->ident_key_hashable = false;
+			break;
+		}
+		att = TupleDescAttr(relation->rd_att, attno - 1);
+		typentry = lookup_type_cache(att->atttypid,
+									 TYPECACHE_HASH_PROC_FINFO |
+									 TYPECACHE_EQ_OPR_FINFO);
+		if (!OidIsValid(typentry->hash_proc_finfo.fn_oid) ||
+			!OidIsValid(typentry->eq_opr_finfo.fn_oid))
+		{
+			result->ident_key_hashable = false;
+			break;
+		}
+
+		result->ident_key_attnos[i] = attno;
+		fmgr_info_copy(&result->ident_key_hash_funcs[i],
+					   &typentry->hash_proc_finfo, CurrentMemoryContext);
+		fmgr_info_copy(&result->ident_key_eq_funcs[i],
+					   &typentry->eq_opr_finfo, CurrentMemoryContext);
+		/* build_identity_key() also assumes the index is btree. */
+		fmgr_info_copy(&result->ident_key_cmp_funcs[i],
+					   index_getprocinfo(result->ident_index, i + 1,
+										 BTORDER_PROC),
+					   CurrentMemoryContext);
+		result->ident_key_options[i] = result->ident_index->rd_indoption[i];
+		result->ident_key_collations[i] =
+			result->ident_index->rd_indcollation[i];
+	}
+
 	/* Only initialize fields needed by ExecInsertIndexTuples(). */
 	estate->es_result_relations = estate->es_result_relation_info =
 		result->rri;
@@ -517,6 +1992,12 @@ free_index_insert_state(IndexInsertState *iistate)
 	ExecCloseIndices(iistate->rri);
 	FreeExecutorState(iistate->estate);
 	pfree(iistate->rri);
+	pfree(iistate->ident_key_attnos);
+	pfree(iistate->ident_key_hash_funcs);
+	pfree(iistate->ident_key_eq_funcs);
+	pfree(iistate->ident_key_cmp_funcs);
+	pfree(iistate->ident_key_options);
+	pfree(iistate->ident_key_collations);
 	pfree(iistate);
 }
 
@@ -656,14 +2137,8 @@ store_change(LogicalDecodingContext *ctx, ConcurrentChangeKind kind,
 			 HeapTuple tuple)
 {
 	DecodingOutputState	*dstate;
-	char	*change_raw;
-	ConcurrentChange	*change;
-	MemoryContext	oldcontext;
 	bool	flattened = false;
 	Size	size;
-	Datum	values[1];
-	bool	isnull[1];
-	char	*dst;
 
 	dstate = (DecodingOutputState *) ctx->output_writer_private;
 
@@ -683,70 +2158,105 @@ store_change(LogicalDecodingContext *ctx, ConcurrentChangeKind kind,
 		flattened = true;
 	}
 
-	size = MAXALIGN(VARHDRSZ) + sizeof(ConcurrentChange) + tuple->t_len;
-	/* XXX Isn't there any function / macro to do this? */
-	if (size >= 0x3FFFFFFF)
+	size = ConcurrentChangeSize(tuple->t_len);
+	if (!AllocSizeIsValid(size))
 		elog(ERROR, "Change is too big.");
 
-	oldcontext = MemoryContextSwitchTo(ctx->context);
-	change_raw = (char *) palloc(size);
-	MemoryContextSwitchTo(oldcontext);
-
-	SET_VARSIZE(change_raw, size);
-	change = (ConcurrentChange *) VARDATA(change_raw);
-
 	/*
-	 * Copy the tuple.
-	 *
-	 * CAUTION: change->tup_data.t_data must be fixed on retrieval!
+	 * Once the changes do not fit into memory, write this and all the
+	 * subsequent changes of the batch to disk, so that the order is
+	 * preserved.
 	 */
-	memcpy(&change->tup_data, tuple, sizeof(HeapTupleData));
-	dst = (char *) change + sizeof(ConcurrentChange);
-	memcpy(dst, tuple->t_data, tuple->t_len);
+	if (dstate->spill_file == NULL &&
+		dstate->data_size + size > (Size) maintenance_work_mem * 1024L)
+	{
+		MemoryContext	oldcontext;
 
-	/* The other field. */
-	change->kind = kind;
+		/*
+		 * The file is closed by reset_change_buffer(), but the current memory
+		 * context is not guaranteed to live that long.
+		 */
+		oldcontext = MemoryContextSwitchTo(dstate->change_cxt);
+		dstate->spill_file = BufFileCreateTemp(false);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	if (dstate->spill_file != NULL)
+	{
+		ConcurrentChange	hdr;
+
+		hdr.kind = kind;
+		memcpy(&hdr.tup_data, tuple, sizeof(HeapTupleData));
+		write_spill_file(dstate->spill_file, &hdr, sizeof(ConcurrentChange));
+		write_spill_file(dstate->spill_file, tuple->t_data, tuple->t_len);
+	}
+	else
+	{
+		ConcurrentChange	*change;
+
+		change = (ConcurrentChange *) alloc_change_space(dstate, size);
+		change->kind = kind;
+
+		/*
+		 * Copy the tuple.
+		 *
+		 * CAUTION: change->tup_data.t_data must be fixed on retrieval!
+		 */
+		memcpy(&change->tup_data, tuple, sizeof(HeapTupleData));
+		memcpy((char *) change + MAXALIGN(sizeof(ConcurrentChange)),
+			   tuple->t_data, tuple->t_len);
+	}
 
 	/* The data has been copied. */
 	if (flattened)
 		pfree(tuple);
 
-	/* Store as tuple of 1 bytea column. */
-	values[0] = PointerGetDatum(change_raw);
-	isnull[0] = false;
-	tuplestore_putvalues(dstate->tstore, dstate->tupdesc_change,
-						 values, isnull);
-
 	/* Accounting. */
 	dstate->nchanges++;
 	dstate->data_size += size;
-
-	/* Cleanup. */
-	pfree(change_raw);
 }
 
 /*
- * Retrieve tuple from a change structure. As for the change, no alignment is
- * assumed.
+ * Allocate space for a change at the end of the last memory segment, or in a
+ * new segment if there's not enough space.
  */
-static HeapTuple
-get_changed_tuple(ConcurrentChange *change)
+static char *
+alloc_change_space(DecodingOutputState *dstate, Size size)
 {
-	HeapTupleData	tup_data;
-	HeapTuple	result;
-	char	*src;
+	ChangeSegment	*seg = dstate->seg_last;
+	char	*result;
 
-	/*
-	 * Ensure alignment before accessing the fields. (This is why we can't use
-	 * heap_copytuple() instead of this function.)
-	 */
-	memcpy(&tup_data, &change->tup_data, sizeof(HeapTupleData));
+	if (seg == NULL || seg->size - seg->used < size)
+	{
+		Size	seg_size;
+
+		seg_size = Max(CHANGE_SEGMENT_SIZE - MAXALIGN(sizeof(ChangeSegment)),
+					   size);
+		seg = (ChangeSegment *)
+			MemoryContextAllocHuge(dstate->change_cxt,
+								   MAXALIGN(sizeof(ChangeSegment)) + seg_size);
+		seg->next = NULL;
+		seg->size = seg_size;
+		seg->used = 0;
+
+		if (dstate->seg_last != NULL)
+			dstate->seg_last->next = seg;
+		else
+			dstate->seg_first = seg;
+		dstate->seg_last = seg;
+	}
 
-	result = (HeapTuple) palloc(HEAPTUPLESIZE + tup_data.t_len);
-	memcpy(result, &tup_data, sizeof(HeapTupleData));
-	result->t_data = (HeapTupleHeader) ((char *) result + HEAPTUPLESIZE);
-	src = (char *) change + sizeof(ConcurrentChange);
-	memcpy(result->t_data, src, result->t_len);
+	result = ChangeSegmentData(seg) + seg->used;
+	seg->used += size;
 
 	return result;
 }
+
+static void
+write_spill_file(BufFile *file, void *data, Size size)
+{
+	if (BufFileWrite(file, data, size) != size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to pg_squeeze temporary file: %m")));
+}
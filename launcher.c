@@ -0,0 +1,639 @@
+/*---------------------------------------------------------
+ *
+ * launcher.c
+ *     Background worker that starts squeeze workers for all databases
+ *     of the cluster.
+ *
+ * Copyright (c) 2016-2018, Cybertec Schönig & Schönig GmbH
+ *
+ *---------------------------------------------------------
+ */
+#include "pg_squeeze.h"
+
+#include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/tableam.h"
+#endif
+#include "catalog/pg_database.h"
+#include "libpq/pqsignal.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "replication/slot.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/acl.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+/*
+ * The maximum number of databases the launcher can serve. Databases beyond
+ * this limit are ignored.
+ */
+#define	SQUEEZE_MAX_DATABASES	1024
+
+/*
+ * What the launcher knows about a database.
+ */
+typedef struct SqueezeDatabaseInfo
+{
+	Oid	dbid;
+
+	/*
+	 * The number of tasks that no worker was processing when a worker
+	 * checked last time, -1 if no worker checked the database yet.
+	 */
+	int64	ntasks;
+
+	/* When did the last worker report ntasks? */
+	TimestampTz	last_checked;
+} SqueezeDatabaseInfo;
+
+typedef struct SqueezeLauncherShared
+{
+	slock_t	mutex;
+
+	/* The latch to wake up the launcher, NULL if it's not running. */
+	Latch	*launcher_latch;
+
+	/*
+	 * I/O budget shared by all backends running squeeze_table(), see
+	 * squeeze_throttle_io(). Negative value means that the budget has been
+	 * exceeded and the next caller needs to wait.
+	 */
+	double	io_tokens;
+	TimestampTz	io_last_refill;
+
+	int	ndatabases;
+	SqueezeDatabaseInfo	databases[SQUEEZE_MAX_DATABASES];
+} SqueezeLauncherShared;
+
+/* NULL if the library was not loaded via shared_preload_libraries. */
+static SqueezeLauncherShared *launcher_shared = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/*
+ * The cluster-wide limit on the number of squeeze workers. Zero means that
+ * the launcher is not used.
+ */
+int squeeze_max_workers = 0;
+
+/*
+ * The maximum number of replication slots the workers may use at a time,
+ * zero if only the free slots should be checked.
+ */
+int squeeze_max_replication_slots = 0;
+
+/*
+ * The maximum rate at which all backends together copy data during the
+ * initial load, in MB/s. Zero means no limit.
+ */
+int squeeze_max_io_rate = 0;
+
+/*
+ * Worker started by the launcher and the database it's serving.
+ */
+typedef struct LaunchedWorker
+{
+	Oid	dbid;
+	BackgroundWorkerHandle	*handle;
+} LaunchedWorker;
+
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t got_sigterm = false;
+
+static void launcher_shmem_startup(void);
+static void squeeze_launcher_sighup(SIGNAL_ARGS);
+static void squeeze_launcher_sigterm(SIGNAL_ARGS);
+static List *get_database_list(void);
+static SqueezeDatabaseInfo *find_database_info(Oid dbid, bool create);
+static int count_free_replication_slots(void);
+static bool launch_worker(Oid dbid, Oid roleid, LaunchedWorker *worker);
+static int launcher_db_cmp(const void *arg1, const void *arg2);
+
+/*
+ * Request shared memory for the launcher and register the launcher itself
+ * if squeeze.max_workers is set. To be called from _PG_init().
+ */
+void
+squeeze_launcher_init(void)
+{
+	BackgroundWorker	worker;
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(SqueezeLauncherShared)));
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = launcher_shmem_startup;
+
+	if (squeeze_max_workers == 0)
+		return;
+
+	if (squeeze_worker_role == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_ZERO_LENGTH_CHARACTER_STRING),
+				 (errmsg("\"squeeze.worker_role\" parameter is invalid or not set"))));
+
+	memset(&worker, 0, sizeof(BackgroundWorker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	sprintf(worker.bgw_library_name, "pg_squeeze");
+	sprintf(worker.bgw_function_name, "squeeze_launcher_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "squeeze launcher");
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "squeeze launcher");
+#endif
+	RegisterBackgroundWorker(&worker);
+}
+
+static void
+launcher_shmem_startup(void)
+{
+	bool	found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	launcher_shared = ShmemInitStruct("pg_squeeze launcher",
+									  sizeof(SqueezeLauncherShared),
+									  &found);
+	if (!found)
+	{
+		SpinLockInit(&launcher_shared->mutex);
+		launcher_shared->launcher_latch = NULL;
+		launcher_shared->io_tokens = 0;
+		launcher_shared->io_last_refill = 0;
+		launcher_shared->ndatabases = 0;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Is the launcher responsible for starting the workers?
+ */
+bool
+squeeze_launcher_enabled(void)
+{
+	return launcher_shared != NULL && squeeze_max_workers > 0;
+}
+
+/*
+ * Tell the launcher how many tasks are waiting in the current database, and
+ * wake it up so it can start more workers if appropriate.
+ */
+void
+squeeze_launcher_report_tasks(int64 ntasks)
+{
+	SqueezeDatabaseInfo	*info;
+	Latch	*latch = NULL;
+
+	if (launcher_shared == NULL)
+		return;
+
+	SpinLockAcquire(&launcher_shared->mutex);
+	info = find_database_info(MyDatabaseId, true);
+	if (info != NULL)
+	{
+		info->ntasks = ntasks;
+		info->last_checked = GetCurrentTimestamp();
+	}
+	latch = launcher_shared->launcher_latch;
+	SpinLockRelease(&launcher_shared->mutex);
+
+	if (latch != NULL && ntasks > 0)
+		SetLatch(latch);
+}
+
+/*
+ * Make the launcher check the current database as soon as possible.
+ */
+void
+squeeze_launcher_wakeup(void)
+{
+	SqueezeDatabaseInfo	*info;
+	Latch	*latch;
+
+	Assert(launcher_shared != NULL);
+
+	SpinLockAcquire(&launcher_shared->mutex);
+	info = find_database_info(MyDatabaseId, true);
+	if (info != NULL)
+	{
+		info->ntasks = -1;
+		info->last_checked = 0;
+	}
+	latch = launcher_shared->launcher_latch;
+	SpinLockRelease(&launcher_shared->mutex);
+
+	if (latch != NULL)
+		SetLatch(latch);
+}
+
+/*
+ * Return the PID of the launcher, or 0 if it's not running.
+ */
+int
+squeeze_launcher_pid(void)
+{
+	int	result = 0;
+
+	SpinLockAcquire(&launcher_shared->mutex);
+	if (launcher_shared->launcher_latch != NULL)
+		result = launcher_shared->launcher_latch->owner_pid;
+	SpinLockRelease(&launcher_shared->mutex);
+
+	return result;
+}
+
+/*
+ * Wait as long as needed to keep the rate at which all backends together
+ * copy data below squeeze_max_io_rate.
+ *
+ * The budget is a token bucket that can hold the amount of data allowed per
+ * second. The caller consumes the tokens first and then waits until the
+ * bucket is no longer in debt, so the waiting time is proportional to the
+ * amount of data processed.
+ */
+void
+squeeze_throttle_io(int64 bytes)
+{
+	double	rate, tokens;
+	TimestampTz	now;
+	long	delay_ms;
+
+	if (launcher_shared == NULL || squeeze_max_io_rate <= 0 || bytes <= 0)
+		return;
+
+	rate = squeeze_max_io_rate * 1024.0 * 1024.0;
+	now = GetCurrentTimestamp();
+
+	SpinLockAcquire(&launcher_shared->mutex);
+	if (launcher_shared->io_last_refill == 0)
+		launcher_shared->io_tokens = rate;
+	else
+		launcher_shared->io_tokens +=
+			rate * (now - launcher_shared->io_last_refill) / USECS_PER_SEC;
+	launcher_shared->io_tokens = Min(launcher_shared->io_tokens, rate);
+	launcher_shared->io_last_refill = now;
+	launcher_shared->io_tokens -= bytes;
+	tokens = launcher_shared->io_tokens;
+	SpinLockRelease(&launcher_shared->mutex);
+
+	if (tokens >= 0)
+		return;
+
+	delay_ms = (long) (-tokens * 1000.0 / rate);
+	if (delay_ms > 0)
+		squeeze_throttle_sleep(delay_ms);
+}
+
+void
+squeeze_launcher_main(Datum main_arg)
+{
+	LaunchedWorker	*workers;
+	int	nworkers = 0;
+	Oid	roleid;
+
+	pqsignal(SIGHUP, squeeze_launcher_sighup);
+	pqsignal(SIGTERM, squeeze_launcher_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	Assert(launcher_shared != NULL);
+
+	/* Only the shared catalogs are needed. */
+	BackgroundWorkerInitializeConnection(NULL, NULL
+#if PG_VERSION_NUM >= 110000
+										 , 0 /* flags */
+#endif
+		);
+
+	SpinLockAcquire(&launcher_shared->mutex);
+	launcher_shared->launcher_latch = MyLatch;
+	SpinLockRelease(&launcher_shared->mutex);
+
+	StartTransactionCommand();
+	roleid = get_role_oid(squeeze_worker_role, false);
+	CommitTransactionCommand();
+
+	workers = (LaunchedWorker *) MemoryContextAlloc(TopMemoryContext,
+													squeeze_max_workers *
+													sizeof(LaunchedWorker));
+
+	while (!got_sigterm)
+	{
+		List	*dbids;
+		ListCell	*lc;
+		SqueezeDatabaseInfo	*candidates;
+		int	ncandidates, nslots_free, i;
+		TimestampTz	now;
+		int	rc;
+
+		/* Forget the workers that have exited. */
+		for (i = 0; i < nworkers;)
+		{
+			pid_t	pid;
+
+			if (GetBackgroundWorkerPid(workers[i].handle, &pid) ==
+				BGWH_STOPPED)
+			{
+				pfree(workers[i].handle);
+				workers[i] = workers[--nworkers];
+			}
+			else
+				i++;
+		}
+
+		/*
+		 * Find out which databases should be checked or have tasks
+		 * waiting.
+		 */
+		dbids = get_database_list();
+		candidates = (SqueezeDatabaseInfo *)
+			palloc(list_length(dbids) * sizeof(SqueezeDatabaseInfo));
+		ncandidates = 0;
+		now = GetCurrentTimestamp();
+		foreach(lc, dbids)
+		{
+			Oid	dbid = lfirst_oid(lc);
+			SqueezeDatabaseInfo	*info;
+			int	nrunning = 0;
+			bool	due;
+
+			for (i = 0; i < nworkers; i++)
+				if (workers[i].dbid == dbid)
+					nrunning++;
+			if (nrunning >= squeeze_workers_per_database)
+				continue;
+
+			SpinLockAcquire(&launcher_shared->mutex);
+			info = find_database_info(dbid, true);
+			if (info == NULL)
+			{
+				SpinLockRelease(&launcher_shared->mutex);
+				continue;
+			}
+
+			/*
+			 * Do not start more workers than the number of tasks waiting,
+			 * and check idle databases only once per naptime.
+			 */
+			if (info->ntasks > 0)
+				due = nrunning < info->ntasks;
+			else
+				due = nrunning == 0 &&
+					TimestampDifferenceExceeds(info->last_checked, now,
+											   squeeze_worker_naptime * 1000);
+			if (due)
+				candidates[ncandidates++] = *info;
+			SpinLockRelease(&launcher_shared->mutex);
+		}
+		list_free(dbids);
+
+		/* Databases with the most work first. */
+		qsort(candidates, ncandidates, sizeof(SqueezeDatabaseInfo),
+			  launcher_db_cmp);
+
+		nslots_free = count_free_replication_slots();
+		for (i = 0; i < ncandidates; i++)
+		{
+			if (nworkers >= squeeze_max_workers)
+				break;
+			if (squeeze_max_replication_slots > 0 &&
+				nworkers >= squeeze_max_replication_slots)
+				break;
+			if (nslots_free <= 0)
+				break;
+
+			if (!launch_worker(candidates[i].dbid, roleid, &workers[nworkers]))
+				break;
+			nworkers++;
+			nslots_free--;
+
+			/* Do not check the database again until the worker reports. */
+			SpinLockAcquire(&launcher_shared->mutex);
+			find_database_info(candidates[i].dbid, true)->last_checked = now;
+			SpinLockRelease(&launcher_shared->mutex);
+		}
+		pfree(candidates);
+
+		/*
+		 * The workers have bgw_notify_pid set to our PID, so the latch is
+		 * also set when any of them exits.
+		 */
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   squeeze_worker_naptime * 1000L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+
+	SpinLockAcquire(&launcher_shared->mutex);
+	launcher_shared->launcher_latch = NULL;
+	SpinLockRelease(&launcher_shared->mutex);
+
+	proc_exit(0);
+}
+
+static void
+squeeze_launcher_sighup(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+static void
+squeeze_launcher_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Return OIDs of the databases the workers can connect to.
+ *
+ * Derived from get_database_list() in autovacuum.c.
+ */
+static List *
+get_database_list(void)
+{
+	List	*result = NIL;
+	Relation	rel;
+#if PG_VERSION_NUM >= 120000
+	TableScanDesc	scan;
+#else
+	HeapScanDesc	scan;
+#endif
+	HeapTuple	tup;
+	MemoryContext	resultcxt = CurrentMemoryContext;
+
+	StartTransactionCommand();
+	(void) GetTransactionSnapshot();
+
+	rel = heap_open(DatabaseRelationId, AccessShareLock);
+#if PG_VERSION_NUM >= 120000
+	scan = table_beginscan_catalog(rel, 0, NULL);
+#else
+	scan = heap_beginscan_catalog(rel, 0, NULL);
+#endif
+
+	while (HeapTupleIsValid(tup = heap_getnext(scan, ForwardScanDirection)))
+	{
+		Form_pg_database	pgdatabase = (Form_pg_database) GETSTRUCT(tup);
+		MemoryContext	oldcxt;
+		Oid	dbid;
+
+		if (!pgdatabase->datallowconn || pgdatabase->datistemplate)
+			continue;
+
+#if PG_VERSION_NUM >= 120000
+		dbid = pgdatabase->oid;
+#else
+		dbid = HeapTupleGetOid(tup);
+#endif
+
+		/* The list must survive the transaction. */
+		oldcxt = MemoryContextSwitchTo(resultcxt);
+		result = lappend_oid(result, dbid);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+#if PG_VERSION_NUM >= 120000
+	table_endscan(scan);
+#else
+	heap_endscan(scan);
+#endif
+	heap_close(rel, AccessShareLock);
+
+	CommitTransactionCommand();
+
+	return result;
+}
+
+/*
+ * Find the entry for the given database. If create is true and the entry
+ * does not exist, create it, unless the array is full.
+ *
+ * Caller must hold the mutex.
+ */
+static SqueezeDatabaseInfo *
+find_database_info(Oid dbid, bool create)
+{
+	SqueezeDatabaseInfo	*info;
+	int	i;
+
+	for (i = 0; i < launcher_shared->ndatabases; i++)
+	{
+		info = &launcher_shared->databases[i];
+		if (info->dbid == dbid)
+			return info;
+	}
+
+	if (!create || launcher_shared->ndatabases >= SQUEEZE_MAX_DATABASES)
+		return NULL;
+
+	info = &launcher_shared->databases[launcher_shared->ndatabases++];
+	info->dbid = dbid;
+	info->ntasks = -1;
+	info->last_checked = 0;
+	return info;
+}
+
+/*
+ * Each squeeze worker creates a replication slot while it's processing a
+ * table, so do not start it if no slot is available.
+ */
+static int
+count_free_replication_slots(void)
+{
+	int	i, result = 0;
+
+	LWLockAcquire(ReplicationSlotControlLock, LW_SHARED);
+	for (i = 0; i < max_replication_slots; i++)
+	{
+		if (!ReplicationSlotCtl->replication_slots[i].in_use)
+			result++;
+	}
+	LWLockRelease(ReplicationSlotControlLock);
+
+	return result;
+}
+
+/*
+ * Start a worker for the given database. Return false if the worker could
+ * not be registered, e.g. because max_worker_processes was reached.
+ */
+static bool
+launch_worker(Oid dbid, Oid roleid, LaunchedWorker *worker)
+{
+	WorkerConInteractive	con;
+	BackgroundWorker	bgw;
+	bool	result;
+
+	con.dbid = dbid;
+	con.roleid = roleid;
+	con.launched = true;
+
+	/* squeeze_initialize_bgworker() needs catalog access. */
+	StartTransactionCommand();
+	squeeze_initialize_bgworker(&bgw, NULL, &con, MyProcPid);
+	CommitTransactionCommand();
+
+	worker->dbid = dbid;
+	result = RegisterDynamicBackgroundWorker(&bgw, &worker->handle);
+	if (!result)
+		ereport(LOG,
+				(errmsg("could not register squeeze worker for database %u",
+						dbid),
+				 errhint("Consider increasing max_worker_processes.")));
+
+	return result;
+}
+
+/*
+ * Sort the databases so that those with the most tasks waiting come first,
+ * and those checked least recently come first among the others.
+ */
+static int
+launcher_db_cmp(const void *arg1, const void *arg2)
+{
+	SqueezeDatabaseInfo	*info1 = (SqueezeDatabaseInfo *) arg1;
+	SqueezeDatabaseInfo	*info2 = (SqueezeDatabaseInfo *) arg2;
+
+	if (info1->ntasks > info2->ntasks)
+		return -1;
+	else if (info1->ntasks < info2->ntasks)
+		return 1;
+
+	if (info1->last_checked < info2->last_checked)
+		return -1;
+	else if (info1->last_checked > info2->last_checked)
+		return 1;
+
+	return 0;
+}
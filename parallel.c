@@ -0,0 +1,946 @@
+/*-----------------------------------------------------
+ *
+ * parallel.c
+ *     Parallel workers to speed up particular stages of the processing.
+ *
+ * Copyright (c) 2016-2018, Cybertec Schönig & Schönig GmbH
+ *
+ *-----------------------------------------------------
+ */
+#include "pg_squeeze.h"
+
+#include "access/parallel.h"
+#include "catalog/index.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_index.h"
+#if PG_VERSION_NUM >= 120000
+#include "nodes/pathnodes.h"
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/clauses.h"
+#endif
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_toc.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+
+/* Keys of the shared memory table of contents. */
+#define PARALLEL_KEY_LOAD_SHARED		UINT64CONST(0xD5E1000000000001)
+#define PARALLEL_KEY_LOAD_SCAN			UINT64CONST(0xD5E1000000000002)
+#define PARALLEL_KEY_LOAD_QUEUES		UINT64CONST(0xD5E1000000000003)
+#define PARALLEL_KEY_INDEX_SHARED		UINT64CONST(0xD5E1000000000004)
+#define PARALLEL_KEY_LOOKUP_SHARED		UINT64CONST(0xD5E1000000000005)
+#define PARALLEL_KEY_LOOKUP_TIDS		UINT64CONST(0xD5E1000000000006)
+#define PARALLEL_KEY_LOOKUP_OFFSETS		UINT64CONST(0xD5E1000000000007)
+#define PARALLEL_KEY_LOOKUP_TUPLES		UINT64CONST(0xD5E1000000000008)
+
+/*
+ * Size of the queue each worker uses to send tuples to the leader. Bigger
+ * queue means fewer context switches, but tuple larger than the queue can
+ * still be sent.
+ */
+#define PARALLEL_LOAD_QUEUE_SIZE		(256 * 1024)
+
+/* The number of tuples a participant of the lookup claims at a time. */
+#define PARALLEL_LOOKUP_CHUNK_SIZE		256
+
+/* Information the initial load workers need to find in shared memory. */
+typedef struct ParallelLoadShared
+{
+	/* The relation to be scanned. */
+	Oid		relid;
+} ParallelLoadShared;
+
+/*
+ * The result of the build of a single index, for the leader to update the
+ * catalog.
+ */
+typedef struct ParallelIndexBuildResult
+{
+	double	heap_tuples;
+	double	index_tuples;
+	bool	broken_hot_chain;
+} ParallelIndexBuildResult;
+
+/*
+ * Information the index build workers need to find in shared memory. The
+ * array of results follows the array of indexes.
+ */
+typedef struct ParallelIndexBuildShared
+{
+	/* The relation to be indexed. */
+	Oid		heaprelid;
+
+	/* The next index to be built, i.e. position in the indexes array. */
+	pg_atomic_uint32	next;
+
+	int		nindexes;
+	Oid		indexes[FLEXIBLE_ARRAY_MEMBER];
+} ParallelIndexBuildShared;
+
+#define IndexBuildSharedResults(shared) \
+	((ParallelIndexBuildResult *) \
+	 ((char *) (shared) + \
+	  MAXALIGN(offsetof(ParallelIndexBuildShared, indexes) + \
+			   (shared)->nindexes * sizeof(Oid))))
+
+/*
+ * Information the tuple lookup workers need to find in shared memory. The
+ * arrays of TIDs, tuple offsets and the tuples themselves are stored under
+ * separate keys.
+ */
+typedef struct ParallelLookupShared
+{
+	/* The relation to be searched and its identity index. */
+	Oid		relid;
+	Oid		indexid;
+
+	/* The next tuple to be looked up. */
+	pg_atomic_uint32	next;
+
+	int		ntuples;
+} ParallelLookupShared;
+
+static void build_indexes(ParallelIndexBuildShared *shared);
+static void build_index(Relation heap, Oid indexid,
+						ParallelIndexBuildResult *result);
+static void update_index_stats(Relation heap, Oid indexid,
+							   ParallelIndexBuildResult *result);
+static void lookup_tuples(ParallelLookupShared *shared, ItemPointer tids,
+						  Size *offsets, char *tuples, Relation rel,
+						  Relation ident_index);
+
+/*
+ * Set up the parallel scan of rel. Each worker receives a range of blocks
+ * from the shared scan descriptor and sends the visible tuples to the
+ * leader.
+ *
+ * Parallel workers cannot insert tuples, so the leader inserts everything
+ * into the transient relation. The gain is that the workers perform the heap
+ * access, the visibility checks and the (possibly expensive) retrieval of
+ * TOAST values.
+ *
+ * The leader inserts the tuples while in parallel mode. That relies on PG 11,
+ * which only rejects heap_insert() in parallel workers (PG 10 rejects it
+ * whenever IsInParallelMode() is true), so the caller must not use the
+ * parallel load on PG 10.
+ *
+ * If no worker could be launched, the leader scans the table itself using the
+ * same (parallel) scan descriptor.
+ */
+ParallelLoadState *
+begin_parallel_load(Relation rel, Snapshot snapshot, int nworkers)
+{
+	ParallelLoadState	*state;
+	ParallelContext *pcxt;
+	ParallelLoadShared	*shared;
+	Size	scan_size;
+#if PG_VERSION_NUM >= 120000
+	ParallelTableScanDesc	pscan;
+#else
+	ParallelHeapScanDesc	pscan;
+#endif
+	char	*queue_space;
+	int	i;
+
+	Assert(nworkers > 0);
+
+	state = (ParallelLoadState *) palloc0(sizeof(ParallelLoadState));
+	state->rel = rel;
+
+	EnterParallelMode();
+	pcxt = CreateParallelContext("pg_squeeze", "squeeze_parallel_load_main",
+								 nworkers
+#if PG_VERSION_NUM >= 110000 && PG_VERSION_NUM < 120000
+								 , true
+#endif
+		);
+	state->pcxt = pcxt;
+
+#if PG_VERSION_NUM >= 120000
+	scan_size = table_parallelscan_estimate(rel, snapshot);
+#else
+	scan_size = heap_parallelscan_estimate(snapshot);
+#endif
+
+	shm_toc_estimate_chunk(&pcxt->estimator, sizeof(ParallelLoadShared));
+	shm_toc_estimate_chunk(&pcxt->estimator, scan_size);
+	shm_toc_estimate_chunk(&pcxt->estimator,
+						   mul_size(PARALLEL_LOAD_QUEUE_SIZE,
+									pcxt->nworkers));
+	shm_toc_estimate_keys(&pcxt->estimator, 3);
+
+	InitializeParallelDSM(pcxt);
+
+	shared = (ParallelLoadShared *) shm_toc_allocate(pcxt->toc,
+													 sizeof(ParallelLoadShared));
+	shared->relid = RelationGetRelid(rel);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_LOAD_SHARED, shared);
+
+#if PG_VERSION_NUM >= 120000
+	pscan = (ParallelTableScanDesc) shm_toc_allocate(pcxt->toc, scan_size);
+	table_parallelscan_initialize(rel, pscan, snapshot);
+#else
+	pscan = (ParallelHeapScanDesc) shm_toc_allocate(pcxt->toc, scan_size);
+	heap_parallelscan_initialize(pscan, rel, snapshot);
+#endif
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_LOAD_SCAN, pscan);
+
+	/* The queues must exist before the workers try to attach to them. */
+	queue_space = shm_toc_allocate(pcxt->toc,
+								   mul_size(PARALLEL_LOAD_QUEUE_SIZE,
+											pcxt->nworkers));
+	for (i = 0; i < pcxt->nworkers; i++)
+	{
+		shm_mq	*mq;
+
+		mq = shm_mq_create(queue_space + i * PARALLEL_LOAD_QUEUE_SIZE,
+						   PARALLEL_LOAD_QUEUE_SIZE);
+		shm_mq_set_receiver(mq, MyProc);
+	}
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_LOAD_QUEUES, queue_space);
+
+	LaunchParallelWorkers(pcxt);
+
+	state->nqueues = pcxt->nworkers_launched;
+	if (state->nqueues > 0)
+	{
+		state->queues = (shm_mq_handle **)
+			palloc(state->nqueues * sizeof(shm_mq_handle *));
+		for (i = 0; i < state->nqueues; i++)
+		{
+			shm_mq	*mq;
+
+			mq = (shm_mq *) (queue_space + i * PARALLEL_LOAD_QUEUE_SIZE);
+			state->queues[i] = shm_mq_attach(mq, pcxt->seg,
+											 pcxt->worker[i].bgwhandle);
+		}
+		state->nactive = state->nqueues;
+		elog(DEBUG1, "pg_squeeze: %d workers launched for the initial load",
+			 state->nqueues);
+	}
+	else
+	{
+		/* No luck, do the work alone. */
+#if PG_VERSION_NUM >= 120000
+		state->scan = table_beginscan_parallel(rel, pscan);
+		state->slot = table_slot_create(rel, NULL);
+#else
+		state->scan = heap_beginscan_parallel(rel, pscan);
+#endif
+	}
+
+	return state;
+}
+
+/*
+ * Return the next tuple of the initial load, or NULL if there are no more.
+ *
+ * The tuple contains no external TOAST pointers, and it is only valid until
+ * the next call.
+ */
+HeapTuple
+parallel_load_next_tuple(ParallelLoadState *state)
+{
+	if (state->flattened != NULL)
+	{
+		heap_freetuple(state->flattened);
+		state->flattened = NULL;
+	}
+
+	/* If there are no workers, the leader does the scan. */
+	if (state->scan != NULL)
+	{
+		HeapTuple	tup;
+
+#if PG_VERSION_NUM >= 120000
+		if (table_scan_getnextslot(state->scan, ForwardScanDirection,
+								   state->slot))
+		{
+			bool	shouldFree;
+
+			tup = ExecFetchSlotHeapTuple(state->slot, false, &shouldFree);
+			Assert(!shouldFree);
+		}
+		else
+			tup = NULL;
+#else
+		tup = heap_getnext(state->scan, ForwardScanDirection);
+#endif
+		if (tup != NULL && HeapTupleHasExternal(tup))
+		{
+			tup = toast_flatten_tuple(tup, RelationGetDescr(state->rel));
+			state->flattened = tup;
+		}
+		return tup;
+	}
+
+	/*
+	 * Read the queues in a round-robin fashion and only sleep if none of them
+	 * has a tuple ready.
+	 */
+	while (state->nactive > 0)
+	{
+		int	i;
+		int	rc;
+
+		for (i = 0; i < state->nqueues; i++)
+		{
+			int	idx;
+			shm_mq_handle	*mqh;
+			shm_mq_result	res;
+			Size	nbytes;
+			void	*data;
+
+			idx = state->next;
+			state->next = (state->next + 1) % state->nqueues;
+
+			/* Worker that has already finished? */
+			mqh = state->queues[idx];
+			if (mqh == NULL)
+				continue;
+
+			CHECK_FOR_INTERRUPTS();
+
+			res = shm_mq_receive(mqh, &nbytes, &data, true);
+			if (res == SHM_MQ_SUCCESS)
+			{
+				state->tuple.t_len = nbytes;
+				ItemPointerSetInvalid(&state->tuple.t_self);
+				state->tuple.t_tableOid = RelationGetRelid(state->rel);
+				state->tuple.t_data = (HeapTupleHeader) data;
+				return &state->tuple;
+			}
+			else if (res == SHM_MQ_DETACHED)
+			{
+				/*
+				 * The worker has sent everything. (If it failed, the error
+				 * will be received as soon as we check for interrupts.)
+				 */
+				state->queues[idx] = NULL;
+				state->nactive--;
+			}
+			else
+				Assert(res == SHM_MQ_WOULD_BLOCK);
+		}
+
+		if (state->nactive == 0)
+			break;
+
+		/* Nothing is ready now, so wait for the workers. */
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0L,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	/*
+	 * Make sure that the errors the workers might have raised during the
+	 * cleanup do not get lost.
+	 */
+	WaitForParallelWorkersToFinish(state->pcxt);
+
+	return NULL;
+}
+
+/*
+ * Release the parallel context and leave the parallel mode.
+ */
+void
+end_parallel_load(ParallelLoadState *state)
+{
+	if (state->scan != NULL)
+	{
+#if PG_VERSION_NUM >= 120000
+		table_endscan(state->scan);
+		ExecDropSingleTupleTableSlot(state->slot);
+#else
+		heap_endscan(state->scan);
+#endif
+	}
+	if (state->flattened != NULL)
+		heap_freetuple(state->flattened);
+
+	/*
+	 * The workers might still be running if the load did not complete,
+	 * e.g. due to ERROR. Normally this has no effect.
+	 */
+	WaitForParallelWorkersToFinish(state->pcxt);
+	DestroyParallelContext(state->pcxt);
+	ExitParallelMode();
+
+	if (state->queues != NULL)
+		pfree(state->queues);
+	pfree(state);
+}
+
+/*
+ * Entry point of the initial load worker.
+ */
+void
+squeeze_parallel_load_main(dsm_segment *seg, shm_toc *toc)
+{
+	ParallelLoadShared	*shared;
+	char	*queue_space;
+	shm_mq	*mq;
+	shm_mq_handle	*mqh;
+	Relation	rel;
+	TupleDesc	tupdesc;
+#if PG_VERSION_NUM >= 120000
+	ParallelTableScanDesc	pscan;
+	TableScanDesc	scan;
+	TupleTableSlot	*slot;
+#else
+	ParallelHeapScanDesc	pscan;
+	HeapScanDesc	scan;
+#endif
+
+	shared = (ParallelLoadShared *) shm_toc_lookup(toc,
+												   PARALLEL_KEY_LOAD_SHARED,
+												   false);
+	queue_space = shm_toc_lookup(toc, PARALLEL_KEY_LOAD_QUEUES, false);
+	mq = (shm_mq *) (queue_space +
+					 ParallelWorkerNumber * PARALLEL_LOAD_QUEUE_SIZE);
+	shm_mq_set_sender(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	/* The leader holds a lock too, so this should not block. */
+	rel = heap_open(shared->relid, AccessShareLock);
+	tupdesc = RelationGetDescr(rel);
+
+#if PG_VERSION_NUM >= 120000
+	pscan = (ParallelTableScanDesc) shm_toc_lookup(toc,
+												   PARALLEL_KEY_LOAD_SCAN,
+												   false);
+	scan = table_beginscan_parallel(rel, pscan);
+	slot = table_slot_create(rel, NULL);
+#else
+	pscan = (ParallelHeapScanDesc) shm_toc_lookup(toc,
+												  PARALLEL_KEY_LOAD_SCAN,
+												  false);
+	scan = heap_beginscan_parallel(rel, pscan);
+#endif
+
+	while (true)
+	{
+		HeapTuple	tup;
+		bool	flattened = false;
+		shm_mq_result	res;
+
+		CHECK_FOR_INTERRUPTS();
+
+#if PG_VERSION_NUM >= 120000
+		if (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+		{
+			bool	shouldFree;
+
+			tup = ExecFetchSlotHeapTuple(slot, false, &shouldFree);
+			Assert(!shouldFree);
+		}
+		else
+			tup = NULL;
+#else
+		tup = heap_getnext(scan, ForwardScanDirection);
+#endif
+		if (tup == NULL)
+			break;
+
+		/*
+		 * The leader would have to retrieve the TOAST values using the
+		 * historic snapshot otherwise. Do it here while the snapshot is
+		 * active.
+		 */
+		if (HeapTupleHasExternal(tup))
+		{
+			tup = toast_flatten_tuple(tup, tupdesc);
+			flattened = true;
+		}
+
+		res = shm_mq_send(mqh, tup->t_len, tup->t_data, false);
+
+		if (flattened)
+			heap_freetuple(tup);
+
+		/* The leader is no longer interested in the data? */
+		if (res == SHM_MQ_DETACHED)
+			break;
+	}
+
+#if PG_VERSION_NUM >= 120000
+	ExecDropSingleTupleTableSlot(slot);
+	table_endscan(scan);
+#else
+	heap_endscan(scan);
+#endif
+	heap_close(rel, AccessShareLock);
+
+	/* Tell the leader that we're done. */
+	shm_mq_detach(mqh);
+}
+
+/*
+ * Fill indexes that have been created with the "skip build" option.
+ *
+ * Each participant (workers as well as the leader) takes the next index that
+ * nobody has started to build yet and builds it alone. Thus the time needed
+ * should approach that of the biggest index rather than the sum.
+ *
+ * Catalog cannot be updated in parallel mode, so the leader updates the
+ * statistics and the pg_index(indcheckxmin) flag like index_build() does
+ * when the parallel build is done.
+ *
+ * Caller must have made the catalog entries of the indexes visible, and
+ * checked that the indexes can be built in parallel, see
+ * index_build_is_parallel_safe().
+ */
+void
+build_indexes_parallel(Relation heap, Oid *indexes, int nindexes,
+					   int nworkers)
+{
+	ParallelContext *pcxt;
+	ParallelIndexBuildShared	*shared;
+	ParallelIndexBuildResult	*results;
+	Size	shared_size;
+	int	i;
+
+	Assert(nworkers > 0 && nindexes > 0);
+
+	EnterParallelMode();
+	pcxt = CreateParallelContext("pg_squeeze", "squeeze_index_build_main",
+								 nworkers
+#if PG_VERSION_NUM >= 110000 && PG_VERSION_NUM < 120000
+								 , true
+#endif
+		);
+
+	shared_size = add_size(offsetof(ParallelIndexBuildShared, indexes),
+						   mul_size(nindexes, sizeof(Oid)));
+	shared_size = add_size(MAXALIGN(shared_size),
+						   mul_size(nindexes,
+									sizeof(ParallelIndexBuildResult)));
+	shm_toc_estimate_chunk(&pcxt->estimator, shared_size);
+	shm_toc_estimate_keys(&pcxt->estimator, 1);
+
+	InitializeParallelDSM(pcxt);
+
+	shared = (ParallelIndexBuildShared *) shm_toc_allocate(pcxt->toc,
+														   shared_size);
+	shared->heaprelid = RelationGetRelid(heap);
+	pg_atomic_init_u32(&shared->next, 0);
+	shared->nindexes = nindexes;
+	memcpy(shared->indexes, indexes, nindexes * sizeof(Oid));
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_INDEX_SHARED, shared);
+
+	LaunchParallelWorkers(pcxt);
+	elog(DEBUG1, "pg_squeeze: %d workers launched to build %d indexes",
+		 pcxt->nworkers_launched, nindexes);
+
+	/* Participate, and also make sure the work gets done w/o workers. */
+	build_indexes(shared);
+
+	WaitForParallelWorkersToFinish(pcxt);
+
+	/* Copy the results before the shared memory goes away. */
+	results = (ParallelIndexBuildResult *)
+		palloc(nindexes * sizeof(ParallelIndexBuildResult));
+	memcpy(results, IndexBuildSharedResults(shared),
+		   nindexes * sizeof(ParallelIndexBuildResult));
+
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	for (i = 0; i < nindexes; i++)
+		update_index_stats(heap, indexes[i], &results[i]);
+	pfree(results);
+}
+
+/*
+ * Check if the expressions and predicates of the indexes can be evaluated
+ * by parallel workers.
+ */
+bool
+index_build_is_parallel_safe(Oid *indexes, int nindexes)
+{
+	Query	*query;
+	PlannerGlobal	*glob;
+	PlannerInfo	*root;
+	int	i;
+
+	/*
+	 * is_parallel_safe() needs a planner state, set up a dummy one like
+	 * plan_create_index_workers() in PG core does.
+	 */
+	query = makeNode(Query);
+	query->commandType = CMD_SELECT;
+	glob = makeNode(PlannerGlobal);
+	root = makeNode(PlannerInfo);
+	root->parse = query;
+	root->glob = glob;
+	root->query_level = 1;
+	root->planner_cxt = CurrentMemoryContext;
+	root->wt_param_id = -1;
+
+	for (i = 0; i < nindexes; i++)
+	{
+		Relation	index;
+		bool	safe;
+
+		index = index_open(indexes[i], AccessShareLock);
+		safe = is_parallel_safe(root,
+								(Node *) RelationGetIndexExpressions(index)) &&
+			is_parallel_safe(root,
+							 (Node *) RelationGetIndexPredicate(index));
+		index_close(index, AccessShareLock);
+
+		if (!safe)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Entry point of the index build worker.
+ */
+void
+squeeze_index_build_main(dsm_segment *seg, shm_toc *toc)
+{
+	ParallelIndexBuildShared	*shared;
+
+	shared = (ParallelIndexBuildShared *) shm_toc_lookup(toc,
+														 PARALLEL_KEY_INDEX_SHARED,
+														 false);
+	build_indexes(shared);
+}
+
+/*
+ * Build indexes until there's none left.
+ */
+static void
+build_indexes(ParallelIndexBuildShared *shared)
+{
+	Relation	heap;
+
+	/*
+	 * The leader holds stronger lock, but members of a lock group do not
+	 * conflict.
+	 */
+	heap = heap_open(shared->heaprelid, ShareLock);
+
+	while (true)
+	{
+		uint32	i;
+
+		i = pg_atomic_fetch_add_u32(&shared->next, 1);
+		if (i >= (uint32) shared->nindexes)
+			break;
+
+		build_index(heap, shared->indexes[i],
+					&IndexBuildSharedResults(shared)[i]);
+	}
+
+	heap_close(heap, NoLock);
+}
+
+/*
+ * Call the ambuild function of the index access method and store the
+ * information needed to update the catalog in *result.
+ *
+ * This is a subset of index_build(): catalog updates are not allowed in
+ * parallel mode, so update_index_stats() does them later. Exclusion
+ * constraints are not verified because they hold for the data we copy from
+ * the source table.
+ */
+static void
+build_index(Relation heap, Oid indexid, ParallelIndexBuildResult *result)
+{
+	Relation	index;
+	IndexInfo	*indexInfo;
+	IndexBuildResult	*stats;
+	Oid		save_userid;
+	int		save_sec_context;
+
+	index = index_open(indexid, AccessExclusiveLock);
+	indexInfo = BuildIndexInfo(index);
+
+	/*
+	 * Run the index functions as the table owner and lock down
+	 * security-restricted operations, like index_build() does.
+	 */
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(heap->rd_rel->relowner,
+						   save_sec_context | SECURITY_RESTRICTED_OPERATION);
+
+#if PG_VERSION_NUM >= 120000
+	stats = index->rd_indam->ambuild(heap, index, indexInfo);
+#else
+	stats = index->rd_amroutine->ambuild(heap, index, indexInfo);
+#endif
+	Assert(PointerIsValid(stats));
+	elog(DEBUG1, "pg_squeeze: index %u built, %.0f index tuples", indexid,
+		 stats->index_tuples);
+	result->heap_tuples = stats->heap_tuples;
+	result->index_tuples = stats->index_tuples;
+	result->broken_hot_chain = indexInfo->ii_BrokenHotChain;
+	pfree(stats);
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	index_close(index, NoLock);
+}
+
+/*
+ * Update pg_class(relpages, reltuples) of the index and of the heap, and set
+ * pg_index(indcheckxmin) if the build found a broken HOT chain. Derived from
+ * index_build() and index_update_stats() in PG core, which are not usable
+ * here: the index has already been built, and the catalog entries of the
+ * transient relations are ours, so transactional update is fine.
+ */
+static void
+update_index_stats(Relation heap, Oid indexid,
+				   ParallelIndexBuildResult *result)
+{
+	Relation	pg_class;
+	Relation	index;
+	Oid	relids[2];
+	BlockNumber	relpages[2];
+	double	reltuples[2];
+	int	i;
+
+	/* The leader created the index, so it holds AccessExclusiveLock. */
+	index = index_open(indexid, NoLock);
+
+	relids[0] = indexid;
+	relpages[0] = RelationGetNumberOfBlocks(index);
+	reltuples[0] = result->index_tuples;
+	relids[1] = RelationGetRelid(heap);
+	relpages[1] = RelationGetNumberOfBlocks(heap);
+	reltuples[1] = result->heap_tuples;
+
+	pg_class = heap_open(RelationRelationId, RowExclusiveLock);
+	for (i = 0; i < 2; i++)
+	{
+		HeapTuple	tuple;
+		Form_pg_class	form;
+
+		tuple = SearchSysCacheCopy1(RELOID, ObjectIdGetDatum(relids[i]));
+		if (!HeapTupleIsValid(tuple))
+			elog(ERROR, "cache lookup failed for relation %u", relids[i]);
+		form = (Form_pg_class) GETSTRUCT(tuple);
+		form->relpages = (int32) relpages[i];
+		form->reltuples = (float4) reltuples[i];
+		CatalogTupleUpdate(pg_class, &tuple->t_self, tuple);
+		heap_freetuple(tuple);
+	}
+	heap_close(pg_class, RowExclusiveLock);
+
+	/* See index_build(). */
+	if (result->broken_hot_chain)
+	{
+		Relation	pg_index;
+		HeapTuple	tuple;
+		Form_pg_index	form;
+
+		pg_index = heap_open(IndexRelationId, RowExclusiveLock);
+		tuple = SearchSysCacheCopy1(INDEXRELID, ObjectIdGetDatum(indexid));
+		if (!HeapTupleIsValid(tuple))
+			elog(ERROR, "cache lookup failed for index %u", indexid);
+		form = (Form_pg_index) GETSTRUCT(tuple);
+		if (!form->indcheckxmin)
+		{
+			form->indcheckxmin = true;
+			CatalogTupleUpdate(pg_index, &tuple->t_self, tuple);
+		}
+		heap_freetuple(tuple);
+		heap_close(pg_index, RowExclusiveLock);
+	}
+
+	index_close(index, NoLock);
+
+	/* Each index updates the heap's entry. */
+	CommandCounterIncrement();
+}
+
+/*
+ * Find TIDs of the tuples of rel whose identity keys are equal to those of
+ * tuples[], and store them in tids[].
+ *
+ * Neither the workers nor the leader in parallel mode can update or delete
+ * tuples, so only the index lookups are performed in parallel. All the
+ * lookups use the active snapshot, so the caller must not rely on seeing the
+ * results of any changes performed by the current command.
+ *
+ * Each participant claims PARALLEL_LOOKUP_CHUNK_SIZE consecutive tuples at a
+ * time. If the caller sorts the tuples in the index order, each participant
+ * processes a range of keys.
+ */
+void
+find_tuples_parallel(Relation rel, Relation ident_index, HeapTuple *tuples,
+					 int ntuples, ItemPointer tids, int nworkers)
+{
+	ParallelContext *pcxt;
+	ParallelLookupShared	*shared;
+	ItemPointer	tids_shared;
+	Size	*offsets;
+	char	*tuples_shared;
+	Size	tids_size, offsets_size, tuples_size, off;
+	int	i;
+
+	Assert(nworkers > 0 && ntuples > 0);
+
+	EnterParallelMode();
+	pcxt = CreateParallelContext("pg_squeeze", "squeeze_lookup_main",
+								 nworkers
+#if PG_VERSION_NUM >= 110000 && PG_VERSION_NUM < 120000
+								 , true
+#endif
+		);
+
+	tids_size = mul_size(ntuples, sizeof(ItemPointerData));
+	offsets_size = mul_size(ntuples, sizeof(Size));
+	tuples_size = 0;
+	for (i = 0; i < ntuples; i++)
+		tuples_size = add_size(tuples_size,
+							   MAXALIGN(sizeof(HeapTupleData)) +
+							   MAXALIGN(tuples[i]->t_len));
+	shm_toc_estimate_chunk(&pcxt->estimator, sizeof(ParallelLookupShared));
+	shm_toc_estimate_chunk(&pcxt->estimator, tids_size);
+	shm_toc_estimate_chunk(&pcxt->estimator, offsets_size);
+	shm_toc_estimate_chunk(&pcxt->estimator, tuples_size);
+	shm_toc_estimate_keys(&pcxt->estimator, 4);
+
+	InitializeParallelDSM(pcxt);
+
+	shared = (ParallelLookupShared *)
+		shm_toc_allocate(pcxt->toc, sizeof(ParallelLookupShared));
+	shared->relid = RelationGetRelid(rel);
+	shared->indexid = RelationGetRelid(ident_index);
+	pg_atomic_init_u32(&shared->next, 0);
+	shared->ntuples = ntuples;
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_LOOKUP_SHARED, shared);
+
+	tids_shared = (ItemPointer) shm_toc_allocate(pcxt->toc, tids_size);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_LOOKUP_TIDS, tids_shared);
+
+	/* Each tuple is stored as HeapTupleData followed by the data. */
+	offsets = (Size *) shm_toc_allocate(pcxt->toc, offsets_size);
+	tuples_shared = (char *) shm_toc_allocate(pcxt->toc, tuples_size);
+	off = 0;
+	for (i = 0; i < ntuples; i++)
+	{
+		HeapTuple	tup = tuples[i];
+
+		offsets[i] = off;
+		memcpy(tuples_shared + off, tup, sizeof(HeapTupleData));
+		off += MAXALIGN(sizeof(HeapTupleData));
+		memcpy(tuples_shared + off, tup->t_data, tup->t_len);
+		off += MAXALIGN(tup->t_len);
+	}
+	Assert(off == tuples_size);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_LOOKUP_OFFSETS, offsets);
+	shm_toc_insert(pcxt->toc, PARALLEL_KEY_LOOKUP_TUPLES, tuples_shared);
+
+	LaunchParallelWorkers(pcxt);
+	elog(DEBUG1, "pg_squeeze: %d workers launched to look up %d tuples",
+		 pcxt->nworkers_launched, ntuples);
+
+	/* Participate, and also make sure the work gets done w/o workers. */
+	lookup_tuples(shared, tids_shared, offsets, tuples_shared, rel,
+				  ident_index);
+
+	WaitForParallelWorkersToFinish(pcxt);
+	memcpy(tids, tids_shared, tids_size);
+
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+}
+
+/*
+ * Entry point of the tuple lookup worker.
+ */
+void
+squeeze_lookup_main(dsm_segment *seg, shm_toc *toc)
+{
+	ParallelLookupShared	*shared;
+	ItemPointer	tids;
+	Size	*offsets;
+	char	*tuples;
+	Relation	rel, ident_index;
+
+	shared = (ParallelLookupShared *) shm_toc_lookup(toc,
+													 PARALLEL_KEY_LOOKUP_SHARED,
+													 false);
+	tids = (ItemPointer) shm_toc_lookup(toc, PARALLEL_KEY_LOOKUP_TIDS, false);
+	offsets = (Size *) shm_toc_lookup(toc, PARALLEL_KEY_LOOKUP_OFFSETS,
+									  false);
+	tuples = (char *) shm_toc_lookup(toc, PARALLEL_KEY_LOOKUP_TUPLES, false);
+
+	/*
+	 * The leader holds stronger lock, but members of a lock group do not
+	 * conflict.
+	 */
+	rel = heap_open(shared->relid, AccessShareLock);
+	ident_index = index_open(shared->indexid, AccessShareLock);
+
+	lookup_tuples(shared, tids, offsets, tuples, rel, ident_index);
+
+	index_close(ident_index, AccessShareLock);
+	heap_close(rel, AccessShareLock);
+}
+
+/*
+ * Look up tuples until there's none left.
+ */
+static void
+lookup_tuples(ParallelLookupShared *shared, ItemPointer tids, Size *offsets,
+			  char *tuples, Relation rel, Relation ident_index)
+{
+	ScanKey	key;
+	int	nkeys;
+	IndexScanDesc	scan;
+	TupleTableSlot	*slot = NULL;
+
+	key = build_identity_key(shared->indexid, rel, &nkeys);
+	scan = index_beginscan(rel, ident_index, GetActiveSnapshot(), nkeys, 0);
+#if PG_VERSION_NUM >= 120000
+	slot = table_slot_create(rel, NULL);
+#endif
+
+	while (true)
+	{
+		uint32	start, end, i;
+
+		start = pg_atomic_fetch_add_u32(&shared->next,
+										PARALLEL_LOOKUP_CHUNK_SIZE);
+		if (start >= (uint32) shared->ntuples)
+			break;
+		end = Min(start + PARALLEL_LOOKUP_CHUNK_SIZE,
+				  (uint32) shared->ntuples);
+
+		for (i = start; i < end; i++)
+		{
+			HeapTupleData	tup;
+			char	*src = tuples + offsets[i];
+
+			memcpy(&tup, src, sizeof(HeapTupleData));
+			tup.t_data = (HeapTupleHeader)
+				(src + MAXALIGN(sizeof(HeapTupleData)));
+
+			find_tuple_by_key(rel, scan, key, nkeys, &tup, slot, &tids[i]);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+#if PG_VERSION_NUM >= 120000
+	ExecDropSingleTupleTableSlot(slot);
+#endif
+	index_endscan(scan);
+	pfree(key);
+}
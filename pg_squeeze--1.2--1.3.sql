@@ -0,0 +1,563 @@
+/* pg_squeeze--1.2--1.3.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_squeeze UPDATE TO '1.3'" to load this file. \quit
+
+-- Progress of the squeeze_table() calls that are currently running. Only
+-- available if pg_squeeze is in shared_preload_libraries.
+CREATE FUNCTION get_progress(
+       OUT pid			int,
+       OUT datid		oid,
+       OUT relid		oid,
+       OUT phase		text,
+       OUT started		timestamptz,
+       OUT heap_blks_total	bigint,
+       OUT heap_blks_scanned	bigint,
+       OUT tuples_copied	bigint,
+       OUT indexes_total	int,
+       OUT indexes_built	int,
+       OUT merge_attempt	int,
+       OUT wal_decoded		pg_lsn,
+       OUT wal_target		pg_lsn,
+       OUT changes_pending	bigint,
+       OUT changes_applied	bigint,
+       OUT throttle_time	interval)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'squeeze_get_progress'
+LANGUAGE C;
+
+CREATE VIEW progress AS
+	SELECT	p.pid, p.datid, d.datname, p.relid, p.phase, p.started,
+		p.heap_blks_total, p.heap_blks_scanned, p.tuples_copied,
+		p.indexes_total, p.indexes_built, p.merge_attempt,
+		p.wal_decoded, p.wal_target, p.changes_pending,
+		p.changes_applied, p.throttle_time
+	FROM	squeeze.get_progress() p
+		LEFT JOIN pg_catalog.pg_database d ON d.oid = p.datid;
+
+ALTER TABLE log
+	ADD COLUMN setup_decoding_time	interval,
+	ADD COLUMN initial_load_time	interval,
+	ADD COLUMN index_build_time	interval,
+	ADD COLUMN index_build_times	interval[],
+	ADD COLUMN catch_up_time	interval,
+	ADD COLUMN lock_wait_time	interval,
+	ADD COLUMN lock_held_time	interval,
+	ADD COLUMN swap_time	interval,
+	ADD COLUMN tuples_copied	bigint,
+	ADD COLUMN size_before	bigint,
+	ADD COLUMN size_after	bigint,
+	ADD COLUMN wal_generated	bigint,
+	ADD COLUMN wal_decoded	bigint,
+	ADD COLUMN changes_inserted	bigint,
+	ADD COLUMN changes_updated	bigint,
+	ADD COLUMN changes_deleted	bigint,
+	ADD COLUMN merge_attempts	int;
+
+COMMENT ON COLUMN log.setup_decoding_time IS
+	 'Time to set up logical decoding, including the wait for running transactions.';
+COMMENT ON COLUMN log.initial_load_time IS
+	 'Time to copy the table contents into new storage.';
+COMMENT ON COLUMN log.index_build_time IS
+	 'Time to build all the indexes after the initial load.';
+COMMENT ON COLUMN log.index_build_times IS
+	 'Time to build each index, NULL if it was not built separately.';
+COMMENT ON COLUMN log.catch_up_time IS
+	 'Time to apply concurrent data changes before requesting the exclusive lock.';
+COMMENT ON COLUMN log.lock_wait_time IS
+	 'Time spent waiting for the exclusive lock.';
+COMMENT ON COLUMN log.lock_held_time IS
+	 'Time the exclusive lock was held.';
+COMMENT ON COLUMN log.swap_time IS
+	 'Time to swap the storage of the old and new table.';
+COMMENT ON COLUMN log.tuples_copied IS
+	 'Number of rows copied by the initial load.';
+COMMENT ON COLUMN log.size_before IS
+	 'Size of the table (w/o TOAST and indexes) before processing, in bytes.';
+COMMENT ON COLUMN log.size_after IS
+	 'Size of the table (w/o TOAST and indexes) after processing, in bytes.';
+COMMENT ON COLUMN log.wal_generated IS
+	 'WAL written by the whole cluster during the processing, in bytes.';
+COMMENT ON COLUMN log.wal_decoded IS
+	 'WAL decoded to capture concurrent data changes, in bytes.';
+COMMENT ON COLUMN log.changes_inserted IS
+	 'Number of rows inserted due to concurrent data changes.';
+COMMENT ON COLUMN log.changes_updated IS
+	 'Number of rows updated due to concurrent data changes.';
+COMMENT ON COLUMN log.changes_deleted IS
+	 'Number of rows deleted due to concurrent data changes.';
+COMMENT ON COLUMN log.merge_attempts IS
+	 'Number of attempts to finish the processing under the exclusive lock.';
+
+-- Statistics of the last successful call of squeeze_table() in the current
+-- session.
+CREATE FUNCTION last_stats(
+       OUT setup_decoding_time	interval,
+       OUT initial_load_time	interval,
+       OUT index_build_time	interval,
+       OUT index_build_times	interval[],
+       OUT catch_up_time	interval,
+       OUT lock_wait_time	interval,
+       OUT lock_held_time	interval,
+       OUT swap_time		interval,
+       OUT tuples_copied	bigint,
+       OUT size_before		bigint,
+       OUT size_after		bigint,
+       OUT wal_generated	bigint,
+       OUT wal_decoded		bigint,
+       OUT changes_inserted	bigint,
+       OUT changes_updated	bigint,
+       OUT changes_deleted	bigint,
+       OUT merge_attempts	int)
+RETURNS record
+AS 'MODULE_PATHNAME', 'squeeze_last_stats'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION process_current_task()
+RETURNS void
+LANGUAGE plpgsql
+AS $$
+DECLARE
+	v_tabschema	name;
+	v_tabname	name;
+	v_cl_index	name;
+	v_rel_tbsp	name;
+	v_ind_tbsps	name[][];
+	v_task_id	int;
+	v_tried		int;
+	v_last_try	bool;
+	v_skip_analyze	bool;
+	v_stmt		text;
+	v_start		timestamptz;
+
+	-- Error info to be logged.
+	v_sql_state	text;
+	v_err_msg	text;
+	v_err_detail	text;
+BEGIN
+	SELECT tb.tabschema, tb.tabname, tb.clustering_index,
+tb.rel_tablespace, tb.ind_tablespaces, t.id, t.tried,
+t.tried >= tb.max_retry, tb.skip_analyze
+	INTO v_tabschema, v_tabname, v_cl_index, v_rel_tbsp, v_ind_tbsps,
+ v_task_id, v_tried, v_last_try, v_skip_analyze
+	FROM squeeze.tasks t, squeeze.tables tb
+	WHERE t.table_id = tb.id AND t.active AND
+		t.worker_pid = pg_backend_pid();
+
+	IF NOT FOUND THEN
+		-- Unexpected deletion by someone else?
+		RETURN;
+	END IF;
+
+	-- The maintenance window might have ended since the task was
+	-- activated, e.g. if it's being retried. Leave it for the next window.
+	PERFORM
+	FROM	squeeze.tasks t
+	WHERE	t.id = v_task_id AND NOT squeeze.task_can_start(t);
+	IF FOUND THEN
+		UPDATE squeeze.tasks
+		SET active = false, worker_pid = NULL
+		WHERE id = v_task_id;
+		RETURN;
+	END IF;
+
+	-- Do the actual work.
+	BEGIN
+		v_start := clock_timestamp();
+
+		-- Do the actual processing.
+		--
+		-- If someone dropped the table in between, the exception
+		-- handler below should log the error and cleanup the task.
+		PERFORM squeeze.squeeze_table(v_tabschema, v_tabname,
+ v_cl_index, v_rel_tbsp, v_ind_tbsps);
+
+		INSERT INTO squeeze.log(tabschema, tabname, started, finished,
+			setup_decoding_time, initial_load_time,
+			index_build_time, index_build_times, catch_up_time,
+			lock_wait_time, lock_held_time, swap_time,
+			tuples_copied, size_before, size_after,
+			wal_generated, wal_decoded, changes_inserted,
+			changes_updated, changes_deleted, merge_attempts)
+		SELECT v_tabschema, v_tabname, v_start, clock_timestamp(),
+			s.setup_decoding_time, s.initial_load_time,
+			s.index_build_time, s.index_build_times,
+			s.catch_up_time, s.lock_wait_time, s.lock_held_time,
+			s.swap_time, s.tuples_copied, s.size_before,
+			s.size_after, s.wal_generated, s.wal_decoded,
+			s.changes_inserted, s.changes_updated,
+			s.changes_deleted, s.merge_attempts
+		FROM squeeze.last_stats() s;
+
+		PERFORM squeeze.cleanup_task(v_task_id);
+
+		IF NOT v_skip_analyze THEN
+                        -- Analyze the new table, unless user rejects it
+                        -- explicitly.
+			--
+			-- XXX Besides updating planner statistics in general,
+			-- this sets pg_class(relallvisible) to 0, so that
+			-- planner is not too optimistic about this
+			-- figure. The preferrable solution would be to run
+			-- (lazy) VACUUM (with the ANALYZE option) to
+			-- initialize visibility map. However, to make the
+			-- effort worthwile, we shouldn't do it until all
+			-- transactions can see all the changes done by
+			-- squeeze_table() function. What's the most suitable
+			-- way to wait? Asynchronous execution of the VACUUM
+			-- is probably needed in any case.
+                        v_stmt := 'ANALYZE "' || v_tabschema || '"."' ||
+                                v_tabname || '"';
+
+			EXECUTE v_stmt;
+		END IF;
+	EXCEPTION
+		WHEN OTHERS THEN
+			GET STACKED DIAGNOSTICS v_sql_state := RETURNED_SQLSTATE;
+			GET STACKED DIAGNOSTICS v_err_msg := MESSAGE_TEXT;
+			GET STACKED DIAGNOSTICS v_err_detail := PG_EXCEPTION_DETAIL;
+
+			INSERT INTO squeeze.errors(tabschema, tabname,
+				sql_state, err_msg, err_detail)
+			VALUES (v_tabschema, v_tabname, v_sql_state, v_err_msg,
+				v_err_detail);
+
+			-- If the active task failed too many times, delete
+			-- it. start_next_task() will prepare the next one.
+			IF v_last_try THEN
+				PERFORM squeeze.cleanup_task(v_task_id);
+				RETURN;
+			ELSE
+				-- Account for the current attempt.
+				UPDATE squeeze.tasks
+				SET tried = tried + 1
+				WHERE id = v_task_id;
+			END IF;
+	END;
+END;
+$$;
+
+ALTER TABLE tasks ADD COLUMN worker_pid int;
+DROP INDEX tasks_active_idx;
+CREATE UNIQUE INDEX ON tasks(table_id);
+
+-- Is the task being processed by another worker? (Active task of a worker
+-- that no longer exists can be taken over.)
+CREATE FUNCTION task_is_taken(a_task tasks)
+RETURNS bool
+LANGUAGE sql
+STABLE
+AS $$
+	SELECT	a_task.active AND a_task.worker_pid IS NOT NULL AND
+		a_task.worker_pid <> pg_catalog.pg_backend_pid() AND EXISTS (
+			SELECT	a.pid
+			FROM	pg_catalog.pg_stat_activity a
+			WHERE	a.pid = a_task.worker_pid);
+$$;
+
+-- Stop the squeeze workers of the current database if they are running.
+CREATE OR REPLACE FUNCTION stop_worker()
+RETURNS boolean
+LANGUAGE sql
+AS $$
+	-- When looking for the PIDs we rely on the fact that each worker holds
+	-- lock on its slot, i.e. on the extension with non-zero objsubid.
+	-- Regular backends trying to ALTER or DROP the extension only lock the
+	-- whole object, so they are not affected.
+	--
+	-- Aggregate the results, otherwise only the first row would be
+	-- evaluated and only one worker would be stopped.
+	SELECT	count(pg_terminate_backend(pid)) > 0
+	FROM	(SELECT DISTINCT l.pid
+		 FROM	pg_catalog.pg_locks l,
+			pg_catalog.pg_extension e
+		 WHERE	e.extname = 'pg_squeeze' AND
+			(l.classid, l.objid) = (3079, e.oid) AND
+			l.objsubid > 0 AND
+			l.database = (SELECT oid
+				      FROM pg_catalog.pg_database
+				      WHERE datname = current_database())) s;
+$$;
+
+ALTER TABLE tables
+	ADD COLUMN priority	int	NOT NULL	DEFAULT 0,
+	ADD COLUMN window_start	timetz,
+	ADD COLUMN window_end	timetz;
+
+COMMENT ON COLUMN tables.priority IS
+	'Tasks of tables with higher priority are processed first.';
+COMMENT ON COLUMN tables.window_start IS
+	'Start of the maintenance window, i.e. the time of the day the '
+	'processing may start.';
+COMMENT ON COLUMN tables.window_end IS
+	'End of the maintenance window. The processing does not start unless '
+	'it is expected to complete before this time of the day.';
+
+ALTER TABLE tables
+	ADD COLUMN estimate_method	text	NOT NULL	DEFAULT 'approx',
+	ADD CHECK (estimate_method IN ('approx', 'sample')),
+	ADD COLUMN sample_size	int	NOT NULL	DEFAULT 10000,
+	ADD CHECK (sample_size > 0);
+
+COMMENT ON COLUMN tables.estimate_method IS
+	'Method to estimate free space if FSM is not fresh enough: ''approx'' '
+	'to scan all pages not marked all-visible, ''sample'' to scan a random '
+	'sample of pages.';
+COMMENT ON COLUMN tables.sample_size IS
+	'The number of pages to scan if estimate_method is ''sample''.';
+
+-- Like pgstattuple_approx(), but only scan a random sample of "sample_size"
+-- pages and extrapolate the results.
+CREATE FUNCTION pgstattuple_sample(IN reloid regclass,
+    IN sample_size int,
+    OUT table_len BIGINT,               -- physical table length in bytes
+    OUT scanned_percent FLOAT8,         -- what percentage of the table's pages was scanned
+    OUT approx_tuple_count BIGINT,      -- estimated number of live tuples
+    OUT approx_tuple_len BIGINT,        -- estimated total length in bytes of live tuples
+    OUT approx_tuple_percent FLOAT8,    -- live tuples in % (based on estimate)
+    OUT dead_tuple_count BIGINT,        -- estimated number of dead tuples
+    OUT dead_tuple_len BIGINT,          -- estimated total length in bytes of dead tuples
+    OUT dead_tuple_percent FLOAT8,      -- dead tuples in % (based on estimate)
+    OUT approx_free_space BIGINT,       -- estimated free space in bytes
+    OUT approx_free_percent FLOAT8)     -- free space in % (based on estimate)
+AS 'MODULE_PATHNAME', 'squeeze_pgstattuple_sample'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+ALTER TABLE tasks
+	ADD COLUMN reclaimable	bigint,
+	ADD COLUMN est_duration	interval;
+
+CREATE INDEX ON log(tabschema, tabname, started);
+
+-- Estimate how long the processing of a table of the given size (in bytes)
+-- takes. The throughput of the recent processing of the same table is used
+-- if available, otherwise that of any table.
+CREATE FUNCTION estimate_duration(a_tabschema name, a_tabname name,
+       a_size bigint)
+RETURNS interval
+LANGUAGE sql
+STABLE
+AS $$
+	SELECT	pg_catalog.make_interval(secs => a_size / COALESCE(
+		(SELECT	sum(l.size_before) /
+			NULLIF(sum(extract(epoch FROM l.finished - l.started)), 0)
+		FROM	(SELECT	*
+			FROM	squeeze.log l_sub
+			WHERE	(l_sub.tabschema, l_sub.tabname) =
+				(a_tabschema, a_tabname) AND
+				l_sub.size_before NOTNULL
+			ORDER BY l_sub.started DESC
+			LIMIT 5) l),
+		(SELECT	sum(l.size_before) /
+			NULLIF(sum(extract(epoch FROM l.finished - l.started)), 0)
+		FROM	(SELECT	*
+			FROM	squeeze.log l_sub
+			WHERE	l_sub.size_before NOTNULL
+			ORDER BY l_sub.started DESC
+			LIMIT 20) l),
+		-- No history at all. XXX Tune the value.
+		32 * 1048576)::double precision);
+$$;
+
+-- Time left until the given time of the day.
+CREATE FUNCTION time_left(a_time timetz)
+RETURNS interval
+LANGUAGE sql
+STABLE
+AS $$
+	-- The epoch of timetz is the number of seconds since midnight UTC, so
+	-- the difference does not depend on the time zones.
+	SELECT	pg_catalog.make_interval(secs =>
+		((2 * 86400 + extract(epoch FROM a_time) -
+		extract(epoch FROM now()::timetz))::numeric % 86400)::double precision);
+$$;
+
+-- Can the task be started now? The current time must be inside the
+-- maintenance window, and it's not worth starting the task if it's not
+-- expected to complete (including the final merge) before the window
+-- ends. The duration is estimated again because the table might have grown
+-- since the task was created.
+--
+-- The window of the table takes precedence over the one configured by
+-- squeeze.window_start and squeeze.window_end. If only the end is known, it
+-- is a deadline.
+CREATE FUNCTION task_can_start(a_task tasks)
+RETURNS bool
+LANGUAGE sql
+STABLE
+AS $$
+	SELECT	(w.w_start ISNULL OR w.w_end ISNULL OR
+		squeeze.time_left(w.w_start) = '0'::interval OR
+		squeeze.time_left(w.w_end) < squeeze.time_left(w.w_start))
+		AND
+		(w.w_end ISNULL OR
+		COALESCE(squeeze.estimate_duration(tb.tabschema, tb.tabname,
+				pg_catalog.pg_relation_size(pg_catalog.to_regclass(
+				pg_catalog.format('%I.%I', tb.tabschema, tb.tabname)))),
+			a_task.est_duration, '0'::interval) <=
+		squeeze.time_left(w.w_end))
+	FROM	squeeze.tables tb,
+		LATERAL (SELECT COALESCE(tb.window_start,
+				NULLIF(pg_catalog.current_setting(
+					'squeeze.window_start', true),
+					'')::timetz) AS w_start,
+			COALESCE(tb.window_end,
+				NULLIF(pg_catalog.current_setting(
+					'squeeze.window_end', true),
+					'')::timetz) AS w_end) w
+	WHERE	tb.id = a_task.table_id;
+$$;
+
+-- Create tasks for newly qualifying tables.
+CREATE OR REPLACE FUNCTION add_new_tasks() RETURNS void
+LANGUAGE sql
+AS $$
+	-- The previous estimates are obsolete now.
+	UPDATE squeeze.tables_internal
+	SET free_space = NULL, class_id = NULL, class_id_toast = NULL;
+
+	-- Mark tables that we're interested in.
+	UPDATE	squeeze.tables_internal i
+	SET class_id = c.oid, class_id_toast = c.reltoastrelid
+	FROM	pg_catalog.pg_stat_user_tables s,
+		squeeze.tables t,
+		pg_class c, pg_namespace n
+	WHERE
+		(t.tabschema, t.tabname) = (s.schemaname, s.relname) AND
+		i.table_id = t.id AND
+		n.nspname = t.tabschema AND c.relnamespace = n.oid AND
+		c.relname = t.tabname AND
+		-- Is there a matching schedule?
+		EXISTS (
+		       SELECT	u.s
+		       FROM	squeeze.tables t_sub,
+		       		UNNEST(t_sub.schedule) u(s)
+		       WHERE	t_sub.id = t.id AND
+		       		-- The schedule must have passed ...
+		       		u.s <= now()::timetz AND
+				-- ... and it should be one for which no
+				-- task was created yet.
+				(u.s > i.last_task_created::timetz OR
+				i.last_task_created ISNULL OR
+				-- The next schedule can be in front of the
+				-- last task if a new day started.
+				i.last_task_created::date < current_date)
+		)
+		-- Ignore tables for which a task currently exists.
+		AND NOT t.id IN (SELECT table_id FROM squeeze.tasks);
+
+	-- If VACUUM completed recenly enough, we consider the percentage of
+	-- dead tuples negligible and so retrieve the free space from FSM.
+	UPDATE	squeeze.tables_internal i
+	SET free_space = 100 * squeeze.get_heap_freespace(i.class_id)
+	FROM	pg_catalog.pg_stat_user_tables s,
+		squeeze.tables t
+	WHERE
+		i.class_id NOTNULL AND
+		i.table_id = t.id AND
+		(t.tabschema, t.tabname) = (s.schemaname, s.relname) AND
+		(
+			(s.last_vacuum >= now() - t.vacuum_max_age)
+			OR
+			(s.last_autovacuum >= now() - t.vacuum_max_age)
+		)
+		AND
+		-- Each processing makes the previous VACUUM unimportant.
+		(
+			i.last_task_finished ISNULL
+			OR
+			i.last_task_finished < s.last_vacuum
+			OR
+			i.last_task_finished < s.last_autovacuum
+		);
+
+	-- If VACUUM didn't run recently or there's no FSM, take the more
+	-- expensive approach, or sample the pages if the user prefers
+	-- so. (Use WITH as LATERAL doesn't work for UPDATE.)
+	WITH t_approx(table_id, free_space) AS (
+		SELECT	i.table_id, a.approx_free_percent + a.dead_tuple_percent
+		FROM	squeeze.tables_internal i,
+			squeeze.tables t,
+			squeeze.pgstattuple_approx(i.class_id) AS a
+		WHERE i.class_id NOTNULL AND i.free_space ISNULL AND
+			t.id = i.table_id AND t.estimate_method = 'approx'
+		UNION ALL
+		SELECT	i.table_id, a.approx_free_percent + a.dead_tuple_percent
+		FROM	squeeze.tables_internal i,
+			squeeze.tables t,
+			squeeze.pgstattuple_sample(i.class_id, t.sample_size) AS a
+		WHERE i.class_id NOTNULL AND i.free_space ISNULL AND
+			t.id = i.table_id AND t.estimate_method = 'sample')
+	UPDATE squeeze.tables_internal i
+	SET	free_space = a.free_space
+	FROM	t_approx a
+	WHERE	i.table_id = a.table_id;
+
+	-- Create a new task for each table having more free space than
+	-- needed.
+	UPDATE	squeeze.tables_internal i
+	SET	last_task_created = now()
+	FROM	squeeze.tables t
+	WHERE	i.class_id NOTNULL AND t.id = i.table_id AND i.free_space >
+		((100 - squeeze.get_heap_fillfactor(i.class_id)) + t.free_space_extra)
+		AND
+		pg_catalog.pg_relation_size(i.class_id, 'main') > t.min_size * 1048576;
+
+	-- now() is supposed to return the same value as it did in the previous
+	-- query.
+	INSERT INTO squeeze.tasks(table_id, reclaimable, est_duration)
+	SELECT	s.table_id,
+		-- Free space derived from fillfactor is not reclaimed.
+		(s.size * (s.free_space - (100 - s.fillfactor)) / 100)::bigint,
+		squeeze.estimate_duration(s.tabschema, s.tabname, s.size)
+	FROM	(SELECT	i.table_id, i.free_space, t.tabschema, t.tabname,
+			pg_catalog.pg_relation_size(i.class_id, 'main') AS size,
+			squeeze.get_heap_fillfactor(i.class_id) AS fillfactor
+		FROM	squeeze.tables_internal i, squeeze.tables t
+		WHERE	t.id = i.table_id AND i.last_task_created = now()) s;
+$$;
+
+-- Mark the next task as active, unless the current worker already has one.
+CREATE OR REPLACE FUNCTION start_next_task()
+RETURNS void
+LANGUAGE plpgsql
+AS $$
+DECLARE
+	v_tabschema	name;
+	v_tabname	name;
+BEGIN
+	-- The task that failed last time should be retried first.
+	PERFORM
+	FROM squeeze.tasks WHERE active AND worker_pid = pg_backend_pid();
+	IF FOUND THEN
+		RETURN;
+	END IF;
+
+	-- Do not wait for tasks that other workers are taking right now.
+	UPDATE	squeeze.tasks t
+	INTO	v_tabschema, v_tabname
+	SET	active = true, worker_pid = pg_backend_pid()
+	FROM	squeeze.tables tb
+	WHERE
+		tb.id = t.table_id AND
+		t.id = (SELECT t_sub.id
+			FROM squeeze.tasks t_sub, squeeze.tables tb_sub
+			WHERE tb_sub.id = t_sub.table_id AND
+				NOT squeeze.task_is_taken(t_sub) AND
+				squeeze.task_can_start(t_sub)
+			-- Higher priority first, then the task that reclaims
+			-- the most space per second of processing.
+			ORDER BY tb_sub.priority DESC,
+				t_sub.reclaimable /
+				GREATEST(extract(epoch FROM t_sub.est_duration), 1)
+				DESC NULLS LAST,
+				t_sub.id
+			LIMIT 1
+			FOR UPDATE OF t_sub SKIP LOCKED)
+	RETURNING tb.tabschema, tb.tabname;
+
+	IF NOT FOUND THEN
+		RETURN;
+	END IF;
+END;
+$$;
@@ -1,4 +1,4 @@
-/* pg_squeeze--1.1.sql */
+/* pg_squeeze--1.3.sql */
 
 -- complain if script is sourced in psql, rather than via CREATE EXTENSION
 \echo Use "CREATE EXTENSION pg_squeeze" to load this file. \quit
@@ -43,10 +43,28 @@ CREATE TABLE tables (
 	-- TODO Tune the default value.
 	vacuum_max_age	interval	NOT NULL	DEFAULT '1 hour',
 
+	-- How to estimate the free space if FSM cannot be used: 'approx'
+	-- means that all pages not marked all-visible are scanned, 'sample'
+	-- that only a random sample of "sample_size" pages is.
+	estimate_method	text	NOT NULL	DEFAULT 'approx',
+	CHECK (estimate_method IN ('approx', 'sample')),
+	sample_size	int	NOT NULL	DEFAULT 10000,
+	CHECK (sample_size > 0),
+
 	max_retry	int		NOT NULL	DEFAULT 0,
 
 	-- No ANALYZE after the processing has completed.
-	skip_analyze	bool		NOT NULL	DEFAULT false
+	skip_analyze	bool		NOT NULL	DEFAULT false,
+
+	-- Tasks of tables with higher priority are processed first.
+	priority	int		NOT NULL	DEFAULT 0,
+
+	-- Maintenance window: the processing may start at "window_start" and
+	-- should complete by "window_end" (times of the day). NULL means that
+	-- squeeze.window_start / squeeze.window_end configuration variable
+	-- applies.
+	window_start	timetz,
+	window_end	timetz
 );
 
 COMMENT ON TABLE tables IS
@@ -75,10 +93,24 @@ COMMENT ON COLUMN tables.min_size IS
 COMMENT ON COLUMN tables.vacuum_max_age IS
 	'If less than this elapsed since the last VACUUM, try to use FSM to '
 	'estimate the amount of free space.';
+COMMENT ON COLUMN tables.estimate_method IS
+	'Method to estimate free space if FSM is not fresh enough: ''approx'' '
+	'to scan all pages not marked all-visible, ''sample'' to scan a random '
+	'sample of pages.';
+COMMENT ON COLUMN tables.sample_size IS
+	'The number of pages to scan if estimate_method is ''sample''.';
 COMMENT ON COLUMN tables.max_retry IS
 	'The maximum nmber of times failed processing is retried.';
 COMMENT ON COLUMN tables.skip_analyze IS
 	'Only squeeze the table, without running ANALYZE afterwards.';
+COMMENT ON COLUMN tables.priority IS
+	'Tasks of tables with higher priority are processed first.';
+COMMENT ON COLUMN tables.window_start IS
+	'Start of the maintenance window, i.e. the time of the day the '
+	'processing may start.';
+COMMENT ON COLUMN tables.window_end IS
+	'End of the maintenance window. The processing does not start unless '
+	'it is expected to complete before this time of the day.';
 
 
 -- Fields that would normally fit into "tables" but require no attention of
@@ -139,25 +171,57 @@ CREATE TABLE tasks (
 	-- Is this the task the next call of process() function will pick?
 	active		bool	NOT NULL	DEFAULT false,
 
+	-- PID of the worker that processes the task if it's active.
+	worker_pid	int,
+
 	-- How many times did we try to process the task? The common use case
 	-- is that a concurrent DDL broke the processing.
-	tried		int	NOT NULL	DEFAULT 0
+	tried		int	NOT NULL	DEFAULT 0,
+
+	-- Estimated amount of disk space (in bytes) the processing reclaims.
+	reclaimable	bigint,
+
+	-- Estimated duration of the processing, see estimate_duration().
+	est_duration	interval
 );
 
--- Make sure there is at most one active task anytime.
-CREATE UNIQUE INDEX ON tasks(active) WHERE active;
+-- Multiple workers can process tasks at the same time, but never two tasks
+-- for the same table.
+CREATE UNIQUE INDEX ON tasks(table_id);
 
 -- Each successfully completed processing of a table is recorded here.
 CREATE TABLE log (
 	tabschema	name	NOT NULL,
 	tabname		name	NOT NULL,
 	started		timestamptz	NOT NULL,
-	finished	timestamptz	NOT NULL
+	finished	timestamptz	NOT NULL,
+
+	-- Statistics of the processing, see squeeze.last_stats().
+	setup_decoding_time	interval,
+	initial_load_time	interval,
+	index_build_time	interval,
+	index_build_times	interval[],
+	catch_up_time	interval,
+	lock_wait_time	interval,
+	lock_held_time	interval,
+	swap_time	interval,
+	tuples_copied	bigint,
+	size_before	bigint,
+	size_after	bigint,
+	wal_generated	bigint,
+	wal_decoded	bigint,
+	changes_inserted	bigint,
+	changes_updated	bigint,
+	changes_deleted	bigint,
+	merge_attempts	int
 );
 
 -- XXX Some other indexes might be useful. Analyze the typical use later.
 CREATE INDEX ON log(started);
 
+-- Needed to estimate the duration of the next processing of a table.
+CREATE INDEX ON log(tabschema, tabname, started);
+
 COMMENT ON TABLE log IS
 	'Successfully completed squeeze operations.';
 COMMENT ON COLUMN log.tabschema IS
@@ -168,6 +232,40 @@ COMMENT ON COLUMN log.started IS
 	 'When the processing started.';
 COMMENT ON COLUMN log.finished IS
 	 'When the processing finished.';
+COMMENT ON COLUMN log.setup_decoding_time IS
+	 'Time to set up logical decoding, including the wait for running transactions.';
+COMMENT ON COLUMN log.initial_load_time IS
+	 'Time to copy the table contents into new storage.';
+COMMENT ON COLUMN log.index_build_time IS
+	 'Time to build all the indexes after the initial load.';
+COMMENT ON COLUMN log.index_build_times IS
+	 'Time to build each index, NULL if it was not built separately.';
+COMMENT ON COLUMN log.catch_up_time IS
+	 'Time to apply concurrent data changes before requesting the exclusive lock.';
+COMMENT ON COLUMN log.lock_wait_time IS
+	 'Time spent waiting for the exclusive lock.';
+COMMENT ON COLUMN log.lock_held_time IS
+	 'Time the exclusive lock was held.';
+COMMENT ON COLUMN log.swap_time IS
+	 'Time to swap the storage of the old and new table.';
+COMMENT ON COLUMN log.tuples_copied IS
+	 'Number of rows copied by the initial load.';
+COMMENT ON COLUMN log.size_before IS
+	 'Size of the table (w/o TOAST and indexes) before processing, in bytes.';
+COMMENT ON COLUMN log.size_after IS
+	 'Size of the table (w/o TOAST and indexes) after processing, in bytes.';
+COMMENT ON COLUMN log.wal_generated IS
+	 'WAL written by the whole cluster during the processing, in bytes.';
+COMMENT ON COLUMN log.wal_decoded IS
+	 'WAL decoded to capture concurrent data changes, in bytes.';
+COMMENT ON COLUMN log.changes_inserted IS
+	 'Number of rows inserted due to concurrent data changes.';
+COMMENT ON COLUMN log.changes_updated IS
+	 'Number of rows updated due to concurrent data changes.';
+COMMENT ON COLUMN log.changes_deleted IS
+	 'Number of rows deleted due to concurrent data changes.';
+COMMENT ON COLUMN log.merge_attempts IS
+	 'Number of attempts to finish the processing under the exclusive lock.';
 
 CREATE TABLE errors (
 	id		bigserial	NOT NULL	PRIMARY KEY,
@@ -223,6 +321,23 @@ CREATE FUNCTION pgstattuple_approx(IN reloid regclass,
 AS 'MODULE_PATHNAME', 'squeeze_pgstattuple_approx'
 LANGUAGE C STRICT PARALLEL SAFE;
 
+-- Like pgstattuple_approx(), but only scan a random sample of "sample_size"
+-- pages and extrapolate the results.
+CREATE FUNCTION pgstattuple_sample(IN reloid regclass,
+    IN sample_size int,
+    OUT table_len BIGINT,               -- physical table length in bytes
+    OUT scanned_percent FLOAT8,         -- what percentage of the table's pages was scanned
+    OUT approx_tuple_count BIGINT,      -- estimated number of live tuples
+    OUT approx_tuple_len BIGINT,        -- estimated total length in bytes of live tuples
+    OUT approx_tuple_percent FLOAT8,    -- live tuples in % (based on estimate)
+    OUT dead_tuple_count BIGINT,        -- estimated number of dead tuples
+    OUT dead_tuple_len BIGINT,          -- estimated total length in bytes of dead tuples
+    OUT dead_tuple_percent FLOAT8,      -- dead tuples in % (based on estimate)
+    OUT approx_free_space BIGINT,       -- estimated free space in bytes
+    OUT approx_free_percent FLOAT8)     -- free space in % (based on estimate)
+AS 'MODULE_PATHNAME', 'squeeze_pgstattuple_sample'
+LANGUAGE C STRICT PARALLEL SAFE;
+
 -- Unregister dropped tables. (CASCADE behaviour ensures deletion of the
 -- related records in "tables_internal" and "tasks" tables.)
 CREATE FUNCTION cleanup_tables() RETURNS void
@@ -302,12 +417,22 @@ AS $$
 		);
 
 	-- If VACUUM didn't run recently or there's no FSM, take the more
-	-- expensive approach. (Use WITH as LATERAL doesn't work for UPDATE.)
+	-- expensive approach, or sample the pages if the user prefers
+	-- so. (Use WITH as LATERAL doesn't work for UPDATE.)
 	WITH t_approx(table_id, free_space) AS (
 		SELECT	i.table_id, a.approx_free_percent + a.dead_tuple_percent
 		FROM	squeeze.tables_internal i,
+			squeeze.tables t,
 			squeeze.pgstattuple_approx(i.class_id) AS a
-		WHERE i.class_id NOTNULL AND i.free_space ISNULL)
+		WHERE i.class_id NOTNULL AND i.free_space ISNULL AND
+			t.id = i.table_id AND t.estimate_method = 'approx'
+		UNION ALL
+		SELECT	i.table_id, a.approx_free_percent + a.dead_tuple_percent
+		FROM	squeeze.tables_internal i,
+			squeeze.tables t,
+			squeeze.pgstattuple_sample(i.class_id, t.sample_size) AS a
+		WHERE i.class_id NOTNULL AND i.free_space ISNULL AND
+			t.id = i.table_id AND t.estimate_method = 'sample')
 	UPDATE squeeze.tables_internal i
 	SET	free_space = a.free_space
 	FROM	t_approx a
@@ -325,13 +450,112 @@ AS $$
 
 	-- now() is supposed to return the same value as it did in the previous
 	-- query.
-	INSERT INTO squeeze.tasks(table_id)
-	SELECT	table_id
-	FROM	squeeze.tables_internal i
-	WHERE	i.last_task_created = now();
+	INSERT INTO squeeze.tasks(table_id, reclaimable, est_duration)
+	SELECT	s.table_id,
+		-- Free space derived from fillfactor is not reclaimed.
+		(s.size * (s.free_space - (100 - s.fillfactor)) / 100)::bigint,
+		squeeze.estimate_duration(s.tabschema, s.tabname, s.size)
+	FROM	(SELECT	i.table_id, i.free_space, t.tabschema, t.tabname,
+			pg_catalog.pg_relation_size(i.class_id, 'main') AS size,
+			squeeze.get_heap_fillfactor(i.class_id) AS fillfactor
+		FROM	squeeze.tables_internal i, squeeze.tables t
+		WHERE	t.id = i.table_id AND i.last_task_created = now()) s;
+$$;
+
+-- Is the task being processed by another worker? (Active task of a worker
+-- that no longer exists can be taken over.)
+CREATE FUNCTION task_is_taken(a_task tasks)
+RETURNS bool
+LANGUAGE sql
+STABLE
+AS $$
+	SELECT	a_task.active AND a_task.worker_pid IS NOT NULL AND
+		a_task.worker_pid <> pg_catalog.pg_backend_pid() AND EXISTS (
+			SELECT	a.pid
+			FROM	pg_catalog.pg_stat_activity a
+			WHERE	a.pid = a_task.worker_pid);
+$$;
+
+-- Estimate how long the processing of a table of the given size (in bytes)
+-- takes. The throughput of the recent processing of the same table is used
+-- if available, otherwise that of any table.
+CREATE FUNCTION estimate_duration(a_tabschema name, a_tabname name,
+       a_size bigint)
+RETURNS interval
+LANGUAGE sql
+STABLE
+AS $$
+	SELECT	pg_catalog.make_interval(secs => a_size / COALESCE(
+		(SELECT	sum(l.size_before) /
+			NULLIF(sum(extract(epoch FROM l.finished - l.started)), 0)
+		FROM	(SELECT	*
+			FROM	squeeze.log l_sub
+			WHERE	(l_sub.tabschema, l_sub.tabname) =
+				(a_tabschema, a_tabname) AND
+				l_sub.size_before NOTNULL
+			ORDER BY l_sub.started DESC
+			LIMIT 5) l),
+		(SELECT	sum(l.size_before) /
+			NULLIF(sum(extract(epoch FROM l.finished - l.started)), 0)
+		FROM	(SELECT	*
+			FROM	squeeze.log l_sub
+			WHERE	l_sub.size_before NOTNULL
+			ORDER BY l_sub.started DESC
+			LIMIT 20) l),
+		-- No history at all. XXX Tune the value.
+		32 * 1048576)::double precision);
+$$;
+
+-- Time left until the given time of the day.
+CREATE FUNCTION time_left(a_time timetz)
+RETURNS interval
+LANGUAGE sql
+STABLE
+AS $$
+	-- The epoch of timetz is the number of seconds since midnight UTC, so
+	-- the difference does not depend on the time zones.
+	SELECT	pg_catalog.make_interval(secs =>
+		((2 * 86400 + extract(epoch FROM a_time) -
+		extract(epoch FROM now()::timetz))::numeric % 86400)::double precision);
+$$;
+
+-- Can the task be started now? The current time must be inside the
+-- maintenance window, and it's not worth starting the task if it's not
+-- expected to complete (including the final merge) before the window
+-- ends. The duration is estimated again because the table might have grown
+-- since the task was created.
+--
+-- The window of the table takes precedence over the one configured by
+-- squeeze.window_start and squeeze.window_end. If only the end is known, it
+-- is a deadline.
+CREATE FUNCTION task_can_start(a_task tasks)
+RETURNS bool
+LANGUAGE sql
+STABLE
+AS $$
+	SELECT	(w.w_start ISNULL OR w.w_end ISNULL OR
+		squeeze.time_left(w.w_start) = '0'::interval OR
+		squeeze.time_left(w.w_end) < squeeze.time_left(w.w_start))
+		AND
+		(w.w_end ISNULL OR
+		COALESCE(squeeze.estimate_duration(tb.tabschema, tb.tabname,
+				pg_catalog.pg_relation_size(pg_catalog.to_regclass(
+				pg_catalog.format('%I.%I', tb.tabschema, tb.tabname)))),
+			a_task.est_duration, '0'::interval) <=
+		squeeze.time_left(w.w_end))
+	FROM	squeeze.tables tb,
+		LATERAL (SELECT COALESCE(tb.window_start,
+				NULLIF(pg_catalog.current_setting(
+					'squeeze.window_start', true),
+					'')::timetz) AS w_start,
+			COALESCE(tb.window_end,
+				NULLIF(pg_catalog.current_setting(
+					'squeeze.window_end', true),
+					'')::timetz) AS w_end) w
+	WHERE	tb.id = a_task.table_id;
 $$;
 
--- Mark the next task as active.
+-- Mark the next task as active, unless the current worker already has one.
 CREATE FUNCTION start_next_task()
 RETURNS void
 LANGUAGE plpgsql
@@ -340,19 +564,34 @@ DECLARE
 	v_tabschema	name;
 	v_tabname	name;
 BEGIN
+	-- The task that failed last time should be retried first.
 	PERFORM
-	FROM squeeze.tasks WHERE active;
+	FROM squeeze.tasks WHERE active AND worker_pid = pg_backend_pid();
 	IF FOUND THEN
 		RETURN;
 	END IF;
 
+	-- Do not wait for tasks that other workers are taking right now.
 	UPDATE	squeeze.tasks t
 	INTO	v_tabschema, v_tabname
-	SET	active = true
+	SET	active = true, worker_pid = pg_backend_pid()
 	FROM	squeeze.tables tb
 	WHERE
 		tb.id = t.table_id AND
-		t.id = (SELECT id FROM squeeze.tasks ORDER BY id LIMIT 1)
+		t.id = (SELECT t_sub.id
+			FROM squeeze.tasks t_sub, squeeze.tables tb_sub
+			WHERE tb_sub.id = t_sub.table_id AND
+				NOT squeeze.task_is_taken(t_sub) AND
+				squeeze.task_can_start(t_sub)
+			-- Higher priority first, then the task that reclaims
+			-- the most space per second of processing.
+			ORDER BY tb_sub.priority DESC,
+				t_sub.reclaimable /
+				GREATEST(extract(epoch FROM t_sub.est_duration), 1)
+				DESC NULLS LAST,
+				t_sub.id
+			LIMIT 1
+			FOR UPDATE OF t_sub SKIP LOCKED)
 	RETURNING tb.tabschema, tb.tabname;
 
 	IF NOT FOUND THEN
@@ -380,7 +619,7 @@ AS $$
 	WHERE d.table_id = t.table_id;
 $$;
 
--- Process the currently active task.
+-- Process the task that the current worker has activated.
 CREATE FUNCTION process_current_task()
 RETURNS void
 LANGUAGE plpgsql
@@ -409,13 +648,26 @@ t.tried >= tb.max_retry, tb.skip_analyze
 	INTO v_tabschema, v_tabname, v_cl_index, v_rel_tbsp, v_ind_tbsps,
  v_task_id, v_tried, v_last_try, v_skip_analyze
 	FROM squeeze.tasks t, squeeze.tables tb
-	WHERE t.table_id = tb.id AND t.active;
+	WHERE t.table_id = tb.id AND t.active AND
+		t.worker_pid = pg_backend_pid();
 
 	IF NOT FOUND THEN
 		-- Unexpected deletion by someone else?
 		RETURN;
 	END IF;
 
+	-- The maintenance window might have ended since the task was
+	-- activated, e.g. if it's being retried. Leave it for the next window.
+	PERFORM
+	FROM	squeeze.tasks t
+	WHERE	t.id = v_task_id AND NOT squeeze.task_can_start(t);
+	IF FOUND THEN
+		UPDATE squeeze.tasks
+		SET active = false, worker_pid = NULL
+		WHERE id = v_task_id;
+		RETURN;
+	END IF;
+
 	-- Do the actual work.
 	BEGIN
 		v_start := clock_timestamp();
@@ -427,8 +679,22 @@ t.tried >= tb.max_retry, tb.skip_analyze
 		PERFORM squeeze.squeeze_table(v_tabschema, v_tabname,
  v_cl_index, v_rel_tbsp, v_ind_tbsps);
 
-		INSERT INTO squeeze.log(tabschema, tabname, started, finished)
-		VALUES (v_tabschema, v_tabname, v_start, clock_timestamp());
+		INSERT INTO squeeze.log(tabschema, tabname, started, finished,
+			setup_decoding_time, initial_load_time,
+			index_build_time, index_build_times, catch_up_time,
+			lock_wait_time, lock_held_time, swap_time,
+			tuples_copied, size_before, size_after,
+			wal_generated, wal_decoded, changes_inserted,
+			changes_updated, changes_deleted, merge_attempts)
+		SELECT v_tabschema, v_tabname, v_start, clock_timestamp(),
+			s.setup_decoding_time, s.initial_load_time,
+			s.index_build_time, s.index_build_times,
+			s.catch_up_time, s.lock_wait_time, s.lock_held_time,
+			s.swap_time, s.tuples_copied, s.size_before,
+			s.size_after, s.wal_generated, s.wal_decoded,
+			s.changes_inserted, s.changes_updated,
+			s.changes_deleted, s.merge_attempts
+		FROM squeeze.last_stats() s;
 
 		PERFORM squeeze.cleanup_task(v_task_id);
 
@@ -488,25 +754,87 @@ RETURNS void
 AS 'MODULE_PATHNAME', 'squeeze_table'
 LANGUAGE C;
 
+-- Statistics of the last successful call of squeeze_table() in the current
+-- session.
+CREATE FUNCTION last_stats(
+       OUT setup_decoding_time	interval,
+       OUT initial_load_time	interval,
+       OUT index_build_time	interval,
+       OUT index_build_times	interval[],
+       OUT catch_up_time	interval,
+       OUT lock_wait_time	interval,
+       OUT lock_held_time	interval,
+       OUT swap_time		interval,
+       OUT tuples_copied	bigint,
+       OUT size_before		bigint,
+       OUT size_after		bigint,
+       OUT wal_generated	bigint,
+       OUT wal_decoded		bigint,
+       OUT changes_inserted	bigint,
+       OUT changes_updated	bigint,
+       OUT changes_deleted	bigint,
+       OUT merge_attempts	int)
+RETURNS record
+AS 'MODULE_PATHNAME', 'squeeze_last_stats'
+LANGUAGE C;
+
 CREATE FUNCTION start_worker()
 RETURNS int
 AS 'MODULE_PATHNAME', 'squeeze_start_worker'
 LANGUAGE C;
 
--- Stop "squeeze worker" if it's currently running.
+-- Stop the squeeze workers of the current database if they are running.
 CREATE FUNCTION stop_worker()
 RETURNS boolean
 LANGUAGE sql
 AS $$
-	-- When looking for the PID we rely on the fact that the worker holds
-	-- lock on the extension. If the worker is not running, we could (in
-	-- theory) kill a regular backend trying to ALTER or DROP the
-	-- extension right now. It's not worth taking a different approach
-	-- just to avoid this extremely unlikely case (which shouldn't cause
-	-- data corruption).
-	SELECT	pg_terminate_backend(pid)
-	FROM	pg_catalog.pg_locks l,
-		pg_catalog.pg_extension e
-	WHERE  e.extname = 'pg_squeeze' AND
-		(l.classid, l.objid) = (3079, e.oid);
+	-- When looking for the PIDs we rely on the fact that each worker holds
+	-- lock on its slot, i.e. on the extension with non-zero objsubid.
+	-- Regular backends trying to ALTER or DROP the extension only lock the
+	-- whole object, so they are not affected.
+	--
+	-- Aggregate the results, otherwise only the first row would be
+	-- evaluated and only one worker would be stopped.
+	SELECT	count(pg_terminate_backend(pid)) > 0
+	FROM	(SELECT DISTINCT l.pid
+		 FROM	pg_catalog.pg_locks l,
+			pg_catalog.pg_extension e
+		 WHERE	e.extname = 'pg_squeeze' AND
+			(l.classid, l.objid) = (3079, e.oid) AND
+			l.objsubid > 0 AND
+			l.database = (SELECT oid
+				      FROM pg_catalog.pg_database
+				      WHERE datname = current_database())) s;
 $$;
+
+-- Progress of the squeeze_table() calls that are currently running. Only
+-- available if pg_squeeze is in shared_preload_libraries.
+CREATE FUNCTION get_progress(
+       OUT pid			int,
+       OUT datid		oid,
+       OUT relid		oid,
+       OUT phase		text,
+       OUT started		timestamptz,
+       OUT heap_blks_total	bigint,
+       OUT heap_blks_scanned	bigint,
+       OUT tuples_copied	bigint,
+       OUT indexes_total	int,
+       OUT indexes_built	int,
+       OUT merge_attempt	int,
+       OUT wal_decoded		pg_lsn,
+       OUT wal_target		pg_lsn,
+       OUT changes_pending	bigint,
+       OUT changes_applied	bigint,
+       OUT throttle_time	interval)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'squeeze_get_progress'
+LANGUAGE C;
+
+CREATE VIEW progress AS
+	SELECT	p.pid, p.datid, d.datname, p.relid, p.phase, p.started,
+		p.heap_blks_total, p.heap_blks_scanned, p.tuples_copied,
+		p.indexes_total, p.indexes_built, p.merge_attempt,
+		p.wal_decoded, p.wal_target, p.changes_pending,
+		p.changes_applied, p.throttle_time
+	FROM	squeeze.get_progress() p
+		LEFT JOIN pg_catalog.pg_database d ON d.oid = p.datid;
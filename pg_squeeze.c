@@ -10,6 +10,7 @@
 #include "pg_squeeze.h"
 
 #include "access/multixact.h"
+#include "access/rewriteheap.h"
 #include "access/sysattr.h"
 #include "catalog/catalog.h"
 #include "catalog/dependency.h"
@@ -27,6 +28,7 @@
 #include "commands/tablecmds.h"
 #include "commands/tablespace.h"
 #include "executor/executor.h"
+#include "funcapi.h"
 #include "lib/stringinfo.h"
 #include "nodes/primnodes.h"
 #include "nodes/makefuncs.h"
@@ -35,16 +37,21 @@
 #else
 #include "optimizer/planner.h"
 #endif
+#include "pgstat.h"
 #include "replication/logicalfuncs.h"
 #include "replication/snapbuild.h"
 #include "storage/bufmgr.h"
 #include "storage/freespace.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lmgr.h"
 #include "storage/proc.h"
 #include "storage/smgr.h"
 #include "storage/standbydefs.h"
 #include "tcop/tcopprot.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datetime.h"
 #include "utils/fmgroids.h"
 #include "utils/guc.h"
 #include "utils/lsyscache.h"
@@ -65,6 +72,18 @@ PG_MODULE_MAGIC;
 #define	REPL_SLOT_BASE_NAME	"pg_squeeze_slot_"
 #define	REPL_PLUGIN_NAME	"pg_squeeze"
 
+/*
+ * The maximum number of tuples the initial load passes to heap_multi_insert()
+ * at a time. (The same limit as COPY FROM uses.)
+ */
+#define MAX_MULTI_INSERT_TUPLES	1000
+
+/*
+ * How many tuples the sorted initial load processes between two attempts to
+ * decode concurrent changes.
+ */
+#define EARLY_DECODING_INTERVAL	10000
+
 static void squeeze_table_internal(PG_FUNCTION_ARGS);
 static int index_cat_info_compare(const void *arg1, const void *arg2);
 
@@ -112,28 +131,77 @@ static void resolve_index_tablepaces(TablespaceInfo *tbsp_info,
 									 ArrayType *ind_tbsp_a);
 static Snapshot build_historic_snapshot(SnapBuild *builder);
 static void perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
-								 Snapshot snap_hist, Relation rel_dst);
+								 Snapshot snap_hist, Relation rel_dst,
+								 LogicalDecodingContext *ctx);
+#if PG_VERSION_NUM >= 120000
+static void report_heap_scan_progress(TableScanDesc scan);
+#else
+static void report_heap_scan_progress(HeapScanDesc scan);
+#endif
+static void rewrite_insert_tuple(RewriteState rwstate, HeapTuple tup,
+								 TransactionId xid, CommandId cid);
 static Oid create_transient_table(CatalogState *cat_state, TupleDesc tup_desc,
 								  Oid tablespace, Oid relowner);
-static Oid *build_transient_indexes(Relation rel_dst, Relation rel_src,
+static void build_transient_indexes(Relation rel_dst, Relation rel_src,
 									Oid *indexes_src, int nindexes,
 									TablespaceInfo *tbsp_info,
-									CatalogState *cat_state);
-static ScanKey build_identity_key(Oid ident_idx_oid, Relation rel_src,
-								  int *nentries);
+									CatalogState *cat_state,
+									bool skip_build, Oid *indexes_dst,
+									LogicalDecodingContext *ctx);
+/*
+ * Throughput of the processing of concurrent changes, measured by
+ * catch_up_concurrent_changes().
+ */
+typedef struct CatchUpStats
+{
+	/* The amount of WAL decoded. */
+	double	bytes;
+
+	/* The time spent by decoding and applying the changes. */
+	double	usecs;
+} CatchUpStats;
+
+/*
+ * The maximum number of times we try to catch up with the concurrent changes
+ * before we request the exclusive lock, regardless the prediction.
+ */
+#define	MAX_CATCH_UP_ROUNDS		16
+
+/* The maximum number of attempts to perform the final merge. */
+#define	MAX_FINAL_MERGE_ATTEMPTS	4
+
+static void catch_up_concurrent_changes(LogicalDecodingContext *ctx,
+										CatalogState *cat_state,
+										Relation rel_dst, ScanKey ident_key,
+										int ident_key_nentries,
+										IndexInsertState *iistate,
+										CatchUpStats *stats);
 static bool perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 								Relation rel_dst, ScanKey ident_key,
 								int ident_key_nentries,
 								IndexInsertState *iistate,
 								CatalogState *cat_state,
-								LogicalDecodingContext *ctx);
+								LogicalDecodingContext *ctx,
+								bool *lock_timeout);
+static bool lock_source_relations(Oid relid_src, Oid *indexes_src,
+								  int nindexes);
+static bool try_lock_source_relations(Oid relid_src, Oid *indexes_src,
+									  int nindexes);
 static void swap_relation_files(Oid r1, Oid r2);
 static void swap_toast_names(Oid relid1, Oid toastrelid1, Oid relid2,
 							 Oid toastrelid2);
 static Oid get_toast_index(Oid toastrelid);
+static void reset_squeeze_stats(void);
+static void lock_table_for_squeeze(Oid relid, char *relschema,
+								   char *relname);
 
 int squeeze_worker_naptime;
 
+/* The size of the worker pool in each database. */
+int squeeze_workers_per_database = 1;
+
+SqueezeStats squeeze_stats;
+
 /*
  * The maximum time to hold AccessExclusiveLock during the final
  * processing. Note that it only process_concurrent_changes() execution time
@@ -143,6 +211,48 @@ int squeeze_worker_naptime;
  */
 int squeeze_max_xlock_time = 0;
 
+/*
+ * The maximum time to wait for the AccessExclusiveLock. Unlike the lock
+ * acquired by LockRelationOid(), our request does not stay in the lock queue,
+ * so other transactions do not have to wait behind it. Zero means that we
+ * wait as long as needed.
+ */
+int squeeze_max_lock_wait_time = 0;
+
+/* The maximum delay between two attempts to acquire the lock, in ms. */
+#define	LOCK_WAIT_MAX_DELAY		100
+
+/*
+ * The maximum number of parallel workers to scan the source table during the
+ * initial load. Zero means that the load is not parallel.
+ */
+int squeeze_max_parallel_load_workers = 0;
+
+/*
+ * Should the initial load write pages of the transient table directly,
+ * i.e. bypass the shared buffers?
+ */
+bool squeeze_direct_load = false;
+
+/*
+ * The maximum number of parallel workers to build indexes on the transient
+ * table. Zero means that the indexes are built one after another.
+ */
+int squeeze_max_parallel_index_workers = 0;
+
+/*
+ * The maximum number of parallel workers to look up the rows updated or
+ * deleted by concurrent data changes. Zero means that the leader does all
+ * the lookups.
+ */
+int squeeze_max_parallel_lookup_workers = 0;
+
+/*
+ * Should WAL be decoded during the initial load and index build, rather than
+ * only after these have finished?
+ */
+bool squeeze_early_decoding = false;
+
 /*
  * List of database OIDs for which the background worker should start started
  * during cluster startup. (We require OIDs because there seems to be now good
@@ -157,6 +267,21 @@ char *squeeze_worker_autostart = NULL;
  */
 char *squeeze_worker_role = NULL;
 
+/*
+ * Maintenance window for tables that have none in squeeze.tables. The
+ * values are only used by the SQL functions, so they are kept as strings.
+ */
+char *squeeze_window_start = NULL;
+char *squeeze_window_end = NULL;
+
+/*
+ * If non-zero, the final processing waits for the advisory lock of this
+ * key. Tests use it to change the table while squeeze_table() is running.
+ */
+int squeeze_test_advisory_lock = 0;
+
+static bool check_window_time(char **newval, void **extra, GucSource source);
+
 void
 _PG_init(void)
 {
@@ -193,7 +318,37 @@ _PG_init(void)
 		GUC_UNIT_S,
 		NULL, NULL, NULL);
 
-	if (squeeze_worker_autostart)
+	DefineCustomIntVariable(
+		"squeeze.workers_per_database",
+		"The maximum number of squeeze workers per database.",
+		"Each worker processes one task at a time, so this is the number "
+		"of tables of a single database that can be squeezed at the same "
+		"time. squeeze.start_worker() and squeeze.worker_autostart start "
+		"this many workers.",
+		&squeeze_workers_per_database,
+		1, 1, 64,
+		PGC_SIGHUP,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_workers",
+		"The maximum number of squeeze workers in the cluster.",
+		"If greater than zero, a launcher process starts squeeze workers "
+		"for all databases that have pending tasks, and this is the maximum "
+		"number of tables squeezed at the same time. Zero means that the "
+		"workers are only started by squeeze.start_worker() and "
+		"squeeze.worker_autostart.",
+		&squeeze_max_workers,
+		0, 0, 1024,
+		PGC_POSTMASTER,
+		0,
+		NULL, NULL, NULL);
+
+	if (squeeze_worker_autostart && squeeze_max_workers > 0)
+		ereport(LOG,
+				(errmsg("\"squeeze.worker_autostart\" is ignored because \"squeeze.max_workers\" is set")));
+	else if (squeeze_worker_autostart)
 	{
 		List	*dbnames = NIL;
 		char	*dbname, *c;
@@ -253,12 +408,14 @@ _PG_init(void)
 		{
 			WorkerConInit	*con;
 			BackgroundWorker worker;
+			int	i;
 
 			dbname = lfirst(lc);
 			con = allocate_worker_con_info(dbname, squeeze_worker_role);
 
 			squeeze_initialize_bgworker(&worker, con, NULL, 0);
-			RegisterBackgroundWorker(&worker);
+			for (i = 0; i < squeeze_workers_per_database; i++)
+				RegisterBackgroundWorker(&worker);
 		}
 		list_free_deep(dbnames);
 	}
@@ -274,6 +431,232 @@ _PG_init(void)
 		PGC_USERSET,
 		GUC_UNIT_MS,
 		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_lock_wait_time",
+		"The maximum time to wait for the exclusive lock on the processed table.",
+		"If greater than zero, the exclusive lock is requested repeatedly "
+		"w/o waiting in the lock queue, so other sessions do not get "
+		"blocked behind the request. If the lock cannot be acquired within "
+		"this time, the changes are processed again and the final stage is "
+		"retried a few more times.",
+		&squeeze_max_lock_wait_time,
+		0, 0, INT_MAX,
+		PGC_USERSET,
+		GUC_UNIT_MS,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_parallel_load_workers",
+		"The maximum number of workers to scan the source table.",
+		"If greater than zero and no clustering index is specified, parallel "
+		"workers scan the source table during the initial load. The number "
+		"of workers is also limited by max_parallel_workers.",
+		&squeeze_max_parallel_load_workers,
+		0, 0, 1024,
+		PGC_USERSET,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomBoolVariable(
+		"squeeze.direct_load",
+		"Write the new table directly during the initial load.",
+		"If enabled, the initial load builds pages of the new table in "
+		"private memory and writes them to disk w/o using shared buffers, "
+		"like CLUSTER and VACUUM FULL commands do.",
+		&squeeze_direct_load,
+		false,
+		PGC_USERSET,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_parallel_index_workers",
+		"The maximum number of workers to build indexes.",
+		"If greater than zero and the table has multiple indexes, parallel "
+		"workers build the indexes of the new table simultaneously, each "
+		"worker building one index at a time.",
+		&squeeze_max_parallel_index_workers,
+		0, 0, 1024,
+		PGC_USERSET,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_parallel_lookup_workers",
+		"The maximum number of workers to look up rows changed concurrently.",
+		"If greater than zero and many rows need to be updated or deleted "
+		"when applying the concurrent data changes to the new table, "
+		"parallel workers look up the rows in the identity index. The "
+		"changes are still applied by a single process.",
+		&squeeze_max_parallel_lookup_workers,
+		0, 0, 1024,
+		PGC_USERSET,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomBoolVariable(
+		"squeeze.early_decoding",
+		"Decode concurrent data changes during the initial load.",
+		"If enabled, WAL is decoded whenever at least one segment is "
+		"available during the initial load and index build, so that less "
+		"work remains for the final stages of the processing.",
+		&squeeze_early_decoding,
+		false,
+		PGC_USERSET,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_replication_slots",
+		"The maximum number of replication slots used by squeeze workers.",
+		"The launcher does not start a new worker if this number of workers "
+		"is already running or if no replication slot is free. Zero means "
+		"that only the free slots are checked.",
+		&squeeze_max_replication_slots,
+		0, 0, 1024,
+		PGC_SIGHUP,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_io_rate",
+		"The maximum rate (in MB/s) of the initial load.",
+		"If greater than zero, all backends running squeeze_table() together "
+		"copy the source tables at most this many megabytes per second.",
+		&squeeze_max_io_rate,
+		0, 0, INT_MAX / 1024,
+		PGC_SIGHUP,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_read_rate",
+		"The maximum rate (in MB/s) at which squeeze_table() reads data.",
+		"Zero means no limit. Unlike squeeze.max_io_rate, this limit "
+		"applies to each backend separately.",
+		&squeeze_max_read_rate,
+		0, 0, INT_MAX / 1024,
+		PGC_SIGHUP,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_write_rate",
+		"The maximum rate (in MB/s) at which squeeze_table() writes data.",
+		"The pages dirtied in the shared buffers are counted as written. "
+		"Zero means no limit.",
+		&squeeze_max_write_rate,
+		0, 0, INT_MAX / 1024,
+		PGC_SIGHUP,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_wal_rate",
+		"The maximum rate (in MB/s) of WAL generation during squeeze_table().",
+		"The WAL of the whole cluster is counted, but squeeze_table() "
+		"sleeps at most one second per check, so it slows down rather "
+		"than stops if other backends exceed the limit. Zero means no "
+		"limit.",
+		&squeeze_max_wal_rate,
+		0, 0, INT_MAX / 1024,
+		PGC_SIGHUP,
+		0,
+		NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.max_replay_lag",
+		"The maximum replay lag of physical standbys.",
+		"If the replay lag of any physical standby exceeds this value, "
+		"squeeze_table() pauses until the lag drops below half of it. The "
+		"exclusive lock on the table is never held during the pause. Zero "
+		"means that the lag is not checked.",
+		&squeeze_max_replay_lag,
+		0, 0, INT_MAX,
+		PGC_SIGHUP,
+		GUC_UNIT_MS,
+		NULL, NULL, NULL);
+
+	DefineCustomStringVariable(
+		"squeeze.window_start",
+		"Time of the day at which the maintenance window starts.",
+		"Squeeze workers do not start processing of a table outside the "
+		"window. Only effective if squeeze.window_end is set too. The "
+		"window of a particular table can be set in squeeze.tables.",
+		&squeeze_window_start,
+		NULL,
+		PGC_SIGHUP,
+		0,
+		check_window_time, NULL, NULL);
+
+	DefineCustomStringVariable(
+		"squeeze.window_end",
+		"Time of the day at which the maintenance window ends.",
+		"Squeeze workers do not start processing of a table unless it is "
+		"expected to complete before this time.",
+		&squeeze_window_end,
+		NULL,
+		PGC_SIGHUP,
+		0,
+		check_window_time, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"squeeze.test_advisory_lock",
+		"Advisory lock to wait for before the final processing.",
+		"If non-zero, squeeze_table() acquires and releases the advisory "
+		"lock of this key before it locks the table exclusively. Only "
+		"useful for testing.",
+		&squeeze_test_advisory_lock,
+		0, 0, INT_MAX,
+		PGC_SUSET,
+		GUC_NO_SHOW_ALL | GUC_NOT_IN_SAMPLE,
+		NULL, NULL, NULL);
+
+	/* Only effective if loaded via shared_preload_libraries. */
+	squeeze_progress_shmem_request();
+	squeeze_launcher_init();
+}
+
+/*
+ * Check that the value of squeeze.window_start / squeeze.window_end can be
+ * cast to timetz, as task_can_start() does. Otherwise the workers would
+ * fail on each attempt to start a task.
+ *
+ * The value is decoded the same way timetz_in() does it, but the errors are
+ * reported using the return codes rather than ereport().
+ */
+static bool
+check_window_time(char **newval, void **extra, GucSource source)
+{
+	char	workbuf[MAXDATELEN + 1];
+	char	*field[MAXDATEFIELDS];
+	int	ftype[MAXDATEFIELDS];
+	int	nf, dtype, tz;
+	struct pg_tm	tt;
+	fsec_t	fsec;
+	int	dterr;
+
+	/* Empty value means that the window is not set. */
+	if (*newval == NULL || strlen(*newval) == 0)
+		return true;
+
+	/* Time zone needed to decode the value is not known yet. */
+	if (session_timezone == NULL)
+		return true;
+
+	dterr = ParseDateTime(*newval, workbuf, sizeof(workbuf), field, ftype,
+						  MAXDATEFIELDS, &nf);
+	if (dterr == 0)
+		dterr = DecodeTimeOnly(field, ftype, nf, &dtype, &tt, &fsec, &tz);
+	if (dterr != 0)
+	{
+		GUC_check_errdetail("\"%s\" is not a valid time of the day.",
+							*newval);
+		return false;
+	}
+
+	return true;
 }
 
 /*
@@ -300,6 +683,9 @@ squeeze_table(PG_FUNCTION_ARGS)
 		 */
 		if (MyReplicationSlot != NULL)
 			ReplicationSlotRelease();
+
+		/* For the same reason, stop reporting the progress. */
+		squeeze_progress_end();
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
@@ -307,6 +693,88 @@ squeeze_table(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
+#define	LAST_STATS_COLUMNS	17
+
+static Datum
+usecs_to_interval_datum(int64 usecs)
+{
+	Interval	*result;
+
+	result = (Interval *) palloc(sizeof(Interval));
+	result->time = usecs;
+	result->day = 0;
+	result->month = 0;
+
+	return IntervalPGetDatum(result);
+}
+
+/*
+ * Return the statistics of the last successful call of squeeze_table() in
+ * the current backend, or NULL if there was no such call.
+ */
+extern Datum squeeze_last_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(squeeze_last_stats);
+Datum
+squeeze_last_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum	values[LAST_STATS_COLUMNS];
+	bool	nulls[LAST_STATS_COLUMNS];
+	Datum	*index_times;
+	bool	*index_nulls;
+	int	dims[1], lbs[1];
+	int	i, j = 0;
+	SqueezeStats	*stats = &squeeze_stats;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	if (tupdesc->natts != LAST_STATS_COLUMNS)
+		elog(ERROR, "incorrect number of output arguments");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	if (!stats->finished)
+		PG_RETURN_NULL();
+
+	memset(nulls, 0, sizeof(nulls));
+	values[j++] = usecs_to_interval_datum(stats->setup_decoding_time);
+	values[j++] = usecs_to_interval_datum(stats->initial_load_time);
+	values[j++] = usecs_to_interval_datum(stats->index_build_time);
+
+	index_times = (Datum *) palloc(stats->nindexes * sizeof(Datum));
+	index_nulls = (bool *) palloc(stats->nindexes * sizeof(bool));
+	for (i = 0; i < stats->nindexes; i++)
+	{
+		index_nulls[i] = stats->index_times[i] < 0;
+		index_times[i] = index_nulls[i] ? (Datum) 0 :
+			usecs_to_interval_datum(stats->index_times[i]);
+	}
+	dims[0] = stats->nindexes;
+	lbs[0] = 1;
+	values[j++] = PointerGetDatum(construct_md_array(index_times, index_nulls,
+													 1, dims, lbs,
+													 INTERVALOID,
+													 sizeof(Interval),
+													 false, 'd'));
+
+	values[j++] = usecs_to_interval_datum(stats->catch_up_time);
+	values[j++] = usecs_to_interval_datum(stats->lock_wait_time);
+	values[j++] = usecs_to_interval_datum(stats->lock_held_time);
+	values[j++] = usecs_to_interval_datum(stats->swap_time);
+	values[j++] = Int64GetDatum(stats->tuples_copied);
+	values[j++] = Int64GetDatum(stats->size_before);
+	values[j++] = Int64GetDatum(stats->size_after);
+	values[j++] = Int64GetDatum(stats->wal_generated);
+	values[j++] = Int64GetDatum(stats->wal_decoded);
+	values[j++] = Int64GetDatum(stats->changes_inserted);
+	values[j++] = Int64GetDatum(stats->changes_updated);
+	values[j++] = Int64GetDatum(stats->changes_deleted);
+	values[j++] = Int32GetDatum(stats->merge_attempts);
+	Assert(j == LAST_STATS_COLUMNS);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values,
+													   nulls)));
+}
+
 static void
 squeeze_table_internal(PG_FUNCTION_ARGS)
 {
@@ -323,19 +791,22 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	int	i, ident_key_nentries;
 	IndexInsertState	*iistate;
 	LogicalDecodingContext	*ctx;
+	DecodingOutputState	*dstate;
 	ReplicationSlot *slot;
 	Snapshot	snap_hist;
 	TupleDesc	tup_desc;
 	CatalogState		*cat_state;
-	XLogRecPtr	end_of_wal;
-	XLogRecPtr	xlog_insert_ptr;
 	int	nindexes;
 	Oid	*indexes_src = NULL, *indexes_dst = NULL;
 	bool	invalid_index = false;
+	bool	parallel_index_build;
 	IndexCatInfo	*ind_info;
 	TablespaceInfo	*tbsp_info;
 	ObjectAddress	object;
-	bool	source_finalized;
+	bool	source_finalized, lock_timeout = false;
+	CatchUpStats	catch_up_stats;
+	XLogRecPtr	wal_start;
+	TimestampTz	t_start;
 
 	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
 		ereport(ERROR,
@@ -358,8 +829,20 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	rel_src_owner = RelationGetForm(rel_src)->relowner;
 	toastrelid_src = rel_src->rd_rel->reltoastrelid;
 
+	/* Make sure no one else is squeezing the table right now. */
+	lock_table_for_squeeze(relid_src, NameStr(*relschema),
+						   NameStr(*relname));
+
+	squeeze_progress_start(relid_src);
+
+	reset_squeeze_stats();
+	squeeze_throttle_start();
+	squeeze_stats.size_before = (int64) RelationGetNumberOfBlocks(rel_src) *
+		BLCKSZ;
+	wal_start = GetXLogInsertRecPtr();
+
 	/*
-	 * Info to create transient table and to initialize tuplestore we'll use
+	 * Info to create transient table and to store the changes we'll get
 	 * during logical decoding.
 	 */
 	tup_desc = CreateTupleDescCopy(RelationGetDescr(rel_src));
@@ -476,6 +959,7 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	}
 
 	nindexes = cat_state->relninds;
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_INDEXES_TOTAL, nindexes);
 
 	/*
 	 * Existence of identity index was checked above, so number of indexes and
@@ -489,7 +973,17 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	for (i = 0; i < nindexes; i++)
 		indexes_src[i] = cat_state->indexes[i].oid;
 
+	squeeze_stats.nindexes = nindexes;
+	squeeze_stats.index_times = (int64 *)
+		MemoryContextAlloc(TopMemoryContext, nindexes * sizeof(int64));
+	for (i = 0; i < nindexes; i++)
+		squeeze_stats.index_times[i] = -1;
+
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_PHASE,
+								  SQUEEZE_PHASE_SETUP_DECODING);
+	t_start = GetCurrentTimestamp();
 	ctx = setup_decoding(relid_src, tup_desc);
+	squeeze_stats.setup_decoding_time = GetCurrentTimestamp() - t_start;
 
 	/*
 	 * Build an "historic snapshot", i.e. one that reflect the table state at
@@ -503,6 +997,22 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	/* The source relation will be needed for the initial load. */
 	rel_src = heap_open(relid_src, AccessShareLock);
 
+	/*
+	 * Now that we know the storage of the source relation, let the decoding
+	 * ignore data changes of other relations. (As long as we hold the lock,
+	 * the storage cannot change without check_catalog_changes() noticing.)
+	 */
+	dstate = (DecodingOutputState *) ctx->output_writer_private;
+	dstate->rnode = rel_src->rd_node;
+	if (OidIsValid(toastrelid_src))
+	{
+		Relation	toastrel;
+
+		toastrel = heap_open(toastrelid_src, AccessShareLock);
+		dstate->toast_rnode = toastrel->rd_node;
+		heap_close(toastrel, AccessShareLock);
+	}
+
 	/*
 	 * The new relation should not be visible for other transactions until we
 	 * commit, but exclusive lock just makes sense.
@@ -522,7 +1032,12 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	 * The historic snapshot is used to retrieve data w/o concurrent
 	 * changes.
 	 */
-	perform_initial_load(rel_src, relrv_cl_idx, snap_hist, rel_dst);
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_PHASE,
+								  SQUEEZE_PHASE_INITIAL_LOAD);
+	t_start = GetCurrentTimestamp();
+	perform_initial_load(rel_src, relrv_cl_idx, snap_hist, rel_dst,
+						 squeeze_early_decoding ? ctx : NULL);
+	squeeze_stats.initial_load_time = GetCurrentTimestamp() - t_start;
 
 	/*
 	 * We no longer need to preserve the rows processed during the initial
@@ -573,9 +1088,40 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	 * indexes.)
 	 */
 	PushActiveSnapshot(GetTransactionSnapshot());
-	indexes_dst = build_transient_indexes(rel_dst, rel_src, indexes_src,
-										  nindexes, tbsp_info, cat_state);
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_PHASE,
+								  SQUEEZE_PHASE_INDEX_BUILD);
+	t_start = GetCurrentTimestamp();
+	indexes_dst = (Oid *) palloc(nindexes * sizeof(Oid));
+
+	/*
+	 * The transient indexes do not exist yet, but their expressions and
+	 * predicates are those of the source indexes.
+	 */
+	parallel_index_build = squeeze_max_parallel_index_workers > 0 &&
+		nindexes > 1 && index_build_is_parallel_safe(indexes_src, nindexes);
+	if (parallel_index_build)
+	{
+		/*
+		 * Only create the catalog entries now and let the parallel workers
+		 * build the indexes. The leader participates in the build, so it
+		 * makes no sense to launch a worker per index.
+		 */
+		build_transient_indexes(rel_dst, rel_src, indexes_src, nindexes,
+								tbsp_info, cat_state, true, indexes_dst,
+								NULL);
+		CommandCounterIncrement();
+		build_indexes_parallel(rel_dst, indexes_dst, nindexes,
+							   Min(squeeze_max_parallel_index_workers,
+								   nindexes - 1));
+		squeeze_progress_update_param(SQUEEZE_PROGRESS_INDEXES_BUILT,
+									  nindexes);
+	}
+	else
+		build_transient_indexes(rel_dst, rel_src, indexes_src, nindexes,
+								tbsp_info, cat_state, false, indexes_dst,
+								squeeze_early_decoding ? ctx : NULL);
 	PopActiveSnapshot();
+	squeeze_stats.index_build_time = GetCurrentTimestamp() - t_start;
 
 	/*
 	 * Make the identity index of the transient table visible, for the sake of
@@ -633,20 +1179,6 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	/* Executor state to update indexes. */
 	iistate = get_index_insert_state(rel_dst, ident_idx_dst);
 
-	/*
-	 * Flush all WAL records inserted so far (possibly except for the last
-	 * incomplete page, see GetInsertRecPtr), to minimize the amount of data
-	 * we need to flush while holding exclusive lock on the source table.
-	 */
- 	xlog_insert_ptr = GetInsertRecPtr();
-	XLogFlush(xlog_insert_ptr);
-
-	/*
-	 * Since we'll do some more changes, all the WAL records flushed so far
-	 * need to be decoded for sure.
-	 */
-	end_of_wal = GetFlushRecPtr();
-
 	/*
 	 * Decode and apply the data changes that occurred while the initial load
 	 * was in progress. The XLOG reader should continue where setup_decoding()
@@ -655,11 +1187,18 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	 * Even if the amount of concurrent changes of our source table might not
 	 * be significant, both initial load and index build could have produced
 	 * many XLOG records that we need to read. Do so before requesting
-	 * exclusive lock on the source relation.
+	 * exclusive lock on the source relation, and keep doing so until the
+	 * remaining work seems to fit into squeeze_max_xlock_time.
 	 */
-	process_concurrent_changes(ctx, end_of_wal, cat_state, rel_dst,
-							   ident_key, ident_key_nentries, iistate,
-							   NoLock, NULL);
+	catch_up_stats.bytes = 0;
+	catch_up_stats.usecs = 0;
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_PHASE,
+								  SQUEEZE_PHASE_CATCH_UP);
+	t_start = GetCurrentTimestamp();
+	catch_up_concurrent_changes(ctx, cat_state, rel_dst, ident_key,
+								ident_key_nentries, iistate,
+								&catch_up_stats);
+	squeeze_stats.catch_up_time += GetCurrentTimestamp() - t_start;
 
 	/*
 	 * This (supposedly cheap) special check should avoid one particular
@@ -690,23 +1229,51 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	 * disable it.
 	 */
 	source_finalized = false;
-	for (i = 0; i < 4; i++)
+	for (i = 0; i < MAX_FINAL_MERGE_ATTEMPTS; i++)
 	{
+		/* Catch up again with the changes that arrived during the attempt. */
+		if (i > 0)
+		{
+			squeeze_progress_update_param(SQUEEZE_PROGRESS_PHASE,
+										  SQUEEZE_PHASE_CATCH_UP);
+			t_start = GetCurrentTimestamp();
+			catch_up_concurrent_changes(ctx, cat_state, rel_dst, ident_key,
+										ident_key_nentries, iistate,
+										&catch_up_stats);
+			squeeze_stats.catch_up_time += GetCurrentTimestamp() - t_start;
+		}
+
+		squeeze_progress_update_param(SQUEEZE_PROGRESS_PHASE,
+									  SQUEEZE_PHASE_FINAL_MERGE);
+		squeeze_progress_update_param(SQUEEZE_PROGRESS_MERGE_ATTEMPT, i + 1);
+		squeeze_stats.merge_attempts = i + 1;
 		if (perform_final_merge(relid_src, indexes_src, nindexes,
 								rel_dst, ident_key, ident_key_nentries,
-								iistate, cat_state, ctx))
+								iistate, cat_state, ctx, &lock_timeout))
 		{
 			source_finalized = true;
 			break;
 		}
+		else if (lock_timeout)
+			elog(DEBUG1,
+				 "Exclusive lock on table %u could not be acquired in time.",
+				 relid_src);
 		else
 			elog(DEBUG1,
 				 "Exclusive lock on table %u had to be released.", relid_src);
 	}
 	if (!source_finalized)
-		ereport(ERROR,
-				(errcode(ERRCODE_OBJECT_IN_USE),
-				 errmsg("\"squeeze_max_xlock_time\" prevented squeeze from completion")));
+	{
+		/* Report the reason of the last failure. */
+		if (lock_timeout)
+			ereport(ERROR,
+					(errcode(ERRCODE_LOCK_NOT_AVAILABLE),
+					 errmsg("\"squeeze_max_lock_wait_time\" prevented squeeze from completion")));
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_IN_USE),
+					 errmsg("\"squeeze_max_xlock_time\" prevented squeeze from completion")));
+	}
 
 	/*
 	 * Done with decoding.
@@ -720,6 +1287,9 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	pfree(ident_key);
 	free_index_insert_state(iistate);
 
+	squeeze_stats.size_after = (int64) RelationGetNumberOfBlocks(rel_dst) *
+		BLCKSZ;
+
 	/* The destination table is no longer necessary, so close it. */
 	/* XXX (Should have been closed right after
 	 * process_concurrent_changes()?) */
@@ -729,6 +1299,9 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	 * Exchange storage (including TOAST) and indexes between the source and
 	 * destination tables.
 	 */
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_PHASE,
+								  SQUEEZE_PHASE_SWAP);
+	t_start = GetCurrentTimestamp();
 	swap_relation_files(relid_src, relid_dst);
 	CommandCounterIncrement();
 
@@ -741,6 +1314,7 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	for (i = 0; i < nindexes; i++)
 		swap_relation_files(indexes_src[i], indexes_dst[i]);
 	CommandCounterIncrement();
+	squeeze_stats.swap_time = GetCurrentTimestamp() - t_start;
 
 	if (nindexes > 0)
 	{
@@ -758,7 +1332,56 @@ squeeze_table_internal(PG_FUNCTION_ARGS)
 	object.classId = RelationRelationId;
 	object.objectSubId = 0;
 	object.objectId = relid_dst;
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_PHASE,
+								  SQUEEZE_PHASE_CLEANUP);
 	performDeletion(&object, DROP_RESTRICT, PERFORM_DELETION_INTERNAL);
+
+	/*
+	 * The lock will only be released at the end of the transaction, but
+	 * nothing else we do while holding it should take significant time.
+	 */
+	squeeze_stats.lock_held_time += GetCurrentTimestamp() -
+		squeeze_stats.lock_acquired;
+	squeeze_stats.lock_acquired = 0;
+	squeeze_stats.wal_generated = GetXLogInsertRecPtr() - wal_start;
+	squeeze_stats.finished = true;
+
+	squeeze_progress_end();
+}
+
+/*
+ * Make sure that only one backend can process the given table at a time.
+ *
+ * Neither of the locks on the relation itself is suitable: we do not hold
+ * any for most of the time, and even if we did, it'd conflict with other
+ * transactions. Thus use a lock on the relation as a "database object" (as
+ * opposed to LOCKTAG_RELATION), which only pg_squeeze uses. It's released at
+ * the end of the transaction.
+ */
+static void
+lock_table_for_squeeze(Oid relid, char *relschema, char *relname)
+{
+	LOCKTAG		tag;
+	LockAcquireResult	lock_res;
+
+	SET_LOCKTAG_OBJECT(tag, MyDatabaseId, RelationRelationId, relid, 0);
+	lock_res = LockAcquire(&tag, ExclusiveLock, false, true);
+	if (lock_res == LOCKACQUIRE_NOT_AVAIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_IN_USE),
+				 errmsg("Table \"%s\".\"%s\" is already being squeezed",
+						relschema, relname)));
+}
+
+/*
+ * Initialize squeeze_stats for the next call of squeeze_table().
+ */
+static void
+reset_squeeze_stats(void)
+{
+	if (squeeze_stats.index_times != NULL)
+		pfree(squeeze_stats.index_times);
+	memset(&squeeze_stats, 0, sizeof(SqueezeStats));
 }
 
 static int
@@ -875,13 +1498,14 @@ setup_decoding(Oid relid, TupleDesc tup_desc)
 	oldcontext = MemoryContextSwitchTo(TopTransactionContext);
 
 	/*
-	 * Each database has a separate background worker, so multiple squeezes
-	 * can be in progress anytime. Thus the slot name should be
-	 * database-specific.
+	 * Multiple squeezes can be in progress anytime, even in the same
+	 * database (there can be multiple workers per database, and
+	 * squeeze_table() can also be called interactively). Thus the slot name
+	 * should be backend-specific.
 	 */
 	buf = makeStringInfo();
 	appendStringInfoString(buf, REPL_SLOT_BASE_NAME);
-	appendStringInfo(buf, "%u", MyDatabaseId);
+	appendStringInfo(buf, "%u_%d", MyDatabaseId, MyProcPid);
 	ReplicationSlotCreate(buf->data, true, RS_EPHEMERAL);
 
 	/*
@@ -926,25 +1550,10 @@ setup_decoding(Oid relid, TupleDesc tup_desc)
 	 */
 	dstate = palloc0(sizeof(DecodingOutputState));
 	dstate->relid = relid;
-	dstate->tstore = tuplestore_begin_heap(false, false,
-										   maintenance_work_mem);
 	dstate->tupdesc = tup_desc;
-
-	/* Initialize the descriptor to store the changes ... */
-#if PG_VERSION_NUM >= 120000
-	dstate->tupdesc_change = CreateTemplateTupleDesc(1);
-#else
-	dstate->tupdesc_change = CreateTemplateTupleDesc(1, false);
-#endif
-
-	TupleDescInitEntry(dstate->tupdesc_change, 1, NULL, BYTEAOID, -1, 0);
-	/* ... as well as the corresponding slot. */
-#if PG_VERSION_NUM >= 120000
-	dstate->tsslot = MakeSingleTupleTableSlot(dstate->tupdesc_change,
-											  &TTSOpsMinimalTuple);
-#else
-	dstate->tsslot = MakeSingleTupleTableSlot(dstate->tupdesc_change);
-#endif
+	dstate->change_cxt = AllocSetContextCreate(TopTransactionContext,
+											   "pg_squeeze changes",
+											   ALLOCSET_DEFAULT_SIZES);
 
 	dstate->data_size = 0;
 	dstate->resowner = 	ResourceOwnerCreate(CurrentResourceOwner,
@@ -963,10 +1572,10 @@ decoding_cleanup(LogicalDecodingContext *ctx)
 
 	dstate = (DecodingOutputState *) ctx->output_writer_private;
 
-	ExecDropSingleTupleTableSlot(dstate->tsslot);
-	FreeTupleDesc(dstate->tupdesc_change);
+	if (dstate->spill_file != NULL)
+		BufFileClose(dstate->spill_file);
+	MemoryContextDelete(dstate->change_cxt);
 	FreeTupleDesc(dstate->tupdesc);
-	tuplestore_end(dstate->tstore);
 
 	FreeDecodingContext(ctx);
 }
@@ -1884,13 +2493,17 @@ build_historic_snapshot(SnapBuild *builder)
  * into rel_dst.
  *
  * Caller is responsible for opening and locking both relations.
+ *
+ * If ctx is passed, concurrent changes are decoded (but not applied) now and
+ * then, see decode_concurrent_changes_early().
  */
 static void
 perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
-					 Snapshot snap_hist, Relation rel_dst)
+					 Snapshot snap_hist, Relation rel_dst,
+					 LogicalDecodingContext *ctx)
 {
 	bool	use_sort;
-	int	batch_size, batch_max_size;
+	int	i, batch_size, batch_max_size;
 	Size	tuple_array_size;
 	bool	tuple_array_can_expand = true;
 	Tuplesortstate *tuplesort = NULL;
@@ -1902,10 +2515,19 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 	HeapScanDesc	heap_scan = NULL;
 #endif
 	IndexScanDesc	index_scan = NULL;
+	ParallelLoadState	*pload = NULL;
 	HeapTuple	*tuples = NULL;
+#if PG_VERSION_NUM >= 120000
+	TupleTableSlot	**multi_slots = NULL;
+#endif
+	CommandId	cid;
+	TransactionId	xid;
 	ResourceOwner	res_owner_old, res_owner_plan;
 	BulkInsertState bistate;
+	RewriteState	rwstate = NULL;
 	MemoryContext	load_cxt, old_cxt;
+	uint64	ntuples_sorted = 0;
+	int64	bytes_sorted = 0;
 
 	if (cluster_idx_rv != NULL)
 	{
@@ -1949,6 +2571,31 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 	else
 		use_sort = false;
 
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_HEAP_BLKS_TOTAL,
+								  RelationGetNumberOfBlocks(rel_src));
+
+	/*
+	 * Parallel scan only makes sense if the order of tuples does not
+	 * matter. (Even if explicit sort is used, the tuplesort is not ready to
+	 * receive the tuples from workers.)
+	 *
+	 * The leader inserts the tuples into the transient table while in
+	 * parallel mode, which is only allowed since PG 11: PG 10 refuses
+	 * heap_insert() and GetCurrentCommandId(true) whenever
+	 * IsInParallelMode() is true, not only in parallel workers. Use the
+	 * serial scan there.
+	 */
+#if PG_VERSION_NUM >= 110000
+	if (cluster_idx == NULL && squeeze_max_parallel_load_workers > 0)
+	{
+		pload = begin_parallel_load(rel_src, snap_hist,
+									squeeze_max_parallel_load_workers);
+
+		/* Decoding is not possible in parallel mode. */
+		ctx = NULL;
+	}
+	else
+#endif
 	if (use_sort || cluster_idx == NULL)
 #if PG_VERSION_NUM >= 120000
 		heap_scan = table_beginscan(rel_src, snap_hist, 0, (ScanKey) NULL);
@@ -1985,10 +2632,38 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 		/* The minimum value of maintenance_work_mem is 1024 kB. */
 		Assert(tuple_array_size / 1024 < maintenance_work_mem);
 		tuples = (HeapTuple *) palloc(tuple_array_size);
+
+#if PG_VERSION_NUM >= 120000
+		/* heap_multi_insert() receives the tuples in slots. */
+		multi_slots = (TupleTableSlot **)
+			palloc(MAX_MULTI_INSERT_TUPLES * sizeof(TupleTableSlot *));
+		for (i = 0; i < MAX_MULTI_INSERT_TUPLES; i++)
+			multi_slots[i] = MakeSingleTupleTableSlot(RelationGetDescr(rel_dst),
+													  &TTSOpsHeapTuple);
+#endif
 	}
 
 	/* Expect many insertions. */
 	bistate = GetBulkInsertState();
+	cid = GetCurrentCommandId(true);
+	xid = GetCurrentTransactionId();
+
+	/*
+	 * Prepare for writing the pages directly if the user wants so.
+	 *
+	 * The mapping files rewriteheap.c writes for catalog tables are not
+	 * useful here, so use the buffer manager if the table is accessible in
+	 * logical decoding (i.e. user_catalog_table).
+	 *
+	 * Since no tuple we insert can be older than our transaction, pass its
+	 * XID as the cutoff so that rewrite_heap_tuple() does not try to freeze
+	 * anything.
+	 */
+	if (squeeze_direct_load && !RelationIsAccessibleInLogicalDecoding(rel_src))
+		rwstate = begin_heap_rewrite(rel_src, rel_dst, xid, xid,
+									 rel_dst->rd_rel->relminmxid,
+									 XLogIsNeeded() &&
+									 RelationNeedsWAL(rel_dst));
 
 	/*
 	 * The processing can take many iterations. In case any data manipulation
@@ -2003,7 +2678,6 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 	while (true)
 	{
 		HeapTuple	tup_in = NULL;
-		int	i;
 		Size	data_size = 0;
 
 		/* Sorting cannot be split into batches. */
@@ -2045,6 +2719,9 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 			 * scan data is freed during the cleanup between batches.
 			 */
 			MemoryContextSwitchTo(old_cxt);
+			if (pload != NULL)
+				tup_in = parallel_load_next_tuple(pload);
+			else
 #if PG_VERSION_NUM >= 120000
 			{
 				bool	res;
@@ -2102,11 +2779,28 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 				/* tuplesort should have copied the tuple. */
 				if (flattened)
 					pfree(tup_in);
+
+				if ((i % EARLY_DECODING_INTERVAL) == 0)
+				{
+					report_heap_scan_progress(heap_scan);
+					squeeze_throttle();
+
+					if (ctx != NULL)
+					{
+						MemoryContextSwitchTo(old_cxt);
+						decode_concurrent_changes_early(ctx);
+						MemoryContextSwitchTo(load_cxt);
+					}
+				}
 			}
 			else
 			{
 				CHECK_FOR_INTERRUPTS();
 
+				/* The batch can be big, so do not wait until it's read. */
+				if (i > 0 && (i % EARLY_DECODING_INTERVAL) == 0)
+					squeeze_throttle();
+
 				/*
 				 * Check for a free slot early enough so that the current
 				 * tuple can be stored even if the array cannot be
@@ -2181,6 +2875,8 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 		 * table, but it's probably not worth checking each batch.)
 		 */
 
+		report_heap_scan_progress(heap_scan);
+
 		if (use_sort)
 			tuplesort_performsort(tuplesort);
 		else
@@ -2196,42 +2892,107 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 		}
 
 		batch_size = i;
-		i = 0;
-		while (true)
+		if (use_sort)
 		{
-			HeapTuple	tup_out;
+			while (true)
+			{
+				HeapTuple	tup_out;
 
-			CHECK_FOR_INTERRUPTS();
+				CHECK_FOR_INTERRUPTS();
 
-			if (use_sort)
 				tup_out = tuplesort_getheaptuple(tuplesort, true);
-			else
-			{
-				if (i == batch_size)
-					tup_out = NULL;
+				if (tup_out == NULL)
+					break;
+
+				/*
+				 * Insert the tuple into the new table.
+				 *
+				 * XXX Should this happen outside load_cxt? Currently
+				 * "bistate" is a flat object (i.e. it does not point to any
+				 * memory chunk that the previous call of heap_insert() might
+				 * have allocated) and thus the cleanup between batches should
+				 * not damage it, but can't it get more complex in future PG
+				 * versions?  If we switch to old_ctx for the insert, an extra
+				 * context seems to make more sense than checking that
+				 * heap_insert() does not leak memory.
+				 */
+				if (rwstate != NULL)
+					rewrite_insert_tuple(rwstate, tup_out, xid, cid);
 				else
-					tup_out = tuples[i++];
-			}
+					heap_insert(rel_dst, tup_out, cid, 0, bistate);
 
-			if (tup_out == NULL)
-				break;
+				bytes_sorted += tup_out->t_len;
+				if ((++ntuples_sorted % EARLY_DECODING_INTERVAL) == 0)
+				{
+					squeeze_progress_update_param(SQUEEZE_PROGRESS_TUPLES_COPIED,
+												  ntuples_sorted);
+
+					squeeze_throttle_io(bytes_sorted);
+					bytes_sorted = 0;
+					squeeze_throttle();
 
+					if (ctx != NULL)
+					{
+						MemoryContextSwitchTo(old_cxt);
+						decode_concurrent_changes_early(ctx);
+						MemoryContextSwitchTo(load_cxt);
+					}
+				}
+			}
+			squeeze_stats.tuples_copied = ntuples_sorted;
+			squeeze_progress_update_param(SQUEEZE_PROGRESS_TUPLES_COPIED,
+										  ntuples_sorted);
+		}
+		else if (rwstate != NULL)
+		{
+			for (i = 0; i < batch_size; i++)
+			{
+				CHECK_FOR_INTERRUPTS();
+
+				rewrite_insert_tuple(rwstate, tuples[i], xid, cid);
+				pfree(tuples[i]);
+			}
+		}
+		else
+		{
 			/*
-			 * Insert the tuple into the new table.
-			 *
-			 * XXX Should this happen outside load_cxt? Currently "bistate" is
-			 * a flat object (i.e. it does not point to any memory chunk that
-			 * the previous call of heap_insert() might have allocated) and
-			 * thus the cleanup between batches should not damage it, but
-			 * can't it get more complex in future PG versions?  If we switch
-			 * to old_ctx for the insert, an extra context seems to make more
-			 * sense than checking that heap_insert() does not leak memory.
+			 * Insert the batch using heap_multi_insert(), which fills each
+			 * page and WAL-logs the insertions into it at once. The same
+			 * concern about memory context as above applies here.
 			 */
-			heap_insert(rel_dst, tup_out, GetCurrentCommandId(true), 0,
-						bistate);
+			for (i = 0; i < batch_size; i += MAX_MULTI_INSERT_TUPLES)
+			{
+				int	ntuples = Min(batch_size - i, MAX_MULTI_INSERT_TUPLES);
+#if PG_VERSION_NUM >= 120000
+				int	j;
+#endif
+
+				CHECK_FOR_INTERRUPTS();
+
+#if PG_VERSION_NUM >= 120000
+				for (j = 0; j < ntuples; j++)
+					ExecStoreHeapTuple(tuples[i + j], multi_slots[j], false);
+				heap_multi_insert(rel_dst, multi_slots, ntuples, cid, 0,
+								  bistate);
+#else
+				heap_multi_insert(rel_dst, tuples + i, ntuples, cid, 0,
+								  bistate);
+#endif
+			}
+
+			for (i = 0; i < batch_size; i++)
+				pfree(tuples[i]);
+		}
+
+		if (!use_sort)
+		{
+			squeeze_stats.tuples_copied += batch_size;
+			squeeze_progress_update_param(SQUEEZE_PROGRESS_TUPLES_COPIED,
+										  squeeze_stats.tuples_copied);
 
-			if (!use_sort)
-				pfree(tup_out);
+			/* Respect squeeze.max_io_rate and the per-backend limits. */
+			squeeze_throttle_io(data_size);
+			squeeze_throttle();
 		}
 
 		/*
@@ -2244,20 +3005,47 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 		 * Free possibly-leaked memory.
 		 */
 		MemoryContextReset(load_cxt);
+
+		/* Catch up with the WAL written during the batch. */
+		if (ctx != NULL)
+		{
+			MemoryContextSwitchTo(old_cxt);
+			decode_concurrent_changes_early(ctx);
+			MemoryContextSwitchTo(load_cxt);
+		}
 	}
 	/*
 	 * At whichever stage the loop broke, the historic snapshot should no
 	 * longer be active.
 	 */
 
+	/* Whichever scan was used, all the blocks have been processed now. */
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_HEAP_BLKS_SCANNED,
+								  RelationGetNumberOfBlocks(rel_src));
+
 	/* Cleanup. */
 	FreeBulkInsertState(bistate);
 
+	/* Write the last page and sync the relation. */
+	if (rwstate != NULL)
+		end_heap_rewrite(rwstate);
+
 	if (use_sort)
 		tuplesort_end(tuplesort);
 	else
+	{
 		pfree(tuples);
 
+#if PG_VERSION_NUM >= 120000
+		for (i = 0; i < MAX_MULTI_INSERT_TUPLES; i++)
+			ExecDropSingleTupleTableSlot(multi_slots[i]);
+		pfree(multi_slots);
+#endif
+	}
+
+	if (pload != NULL)
+		end_parallel_load(pload);
+
 	if (heap_scan != NULL)
 #if PG_VERSION_NUM >= 120000
 		table_endscan(heap_scan);
@@ -2283,6 +3071,76 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 	MemoryContextDelete(load_cxt);
 }
 
+/*
+ * Report the number of heap blocks that the serial scan has processed so
+ * far. Index scan and parallel scan do not report anything here, the caller
+ * only updates the progress when the initial load has completed.
+ */
+static void
+#if PG_VERSION_NUM >= 120000
+report_heap_scan_progress(TableScanDesc scan)
+#else
+report_heap_scan_progress(HeapScanDesc scan)
+#endif
+{
+	HeapScanDesc	hscan;
+	BlockNumber	nscanned;
+
+	if (scan == NULL)
+		return;
+
+#if PG_VERSION_NUM >= 120000
+	hscan = (HeapScanDesc) scan;
+#else
+	hscan = scan;
+#endif
+
+	/* Not started yet or already finished? */
+	if (!BlockNumberIsValid(hscan->rs_cblock))
+		return;
+
+	/* Synchronized scan does not have to start at the first block. */
+	if (hscan->rs_cblock >= hscan->rs_startblock)
+		nscanned = hscan->rs_cblock - hscan->rs_startblock;
+	else
+		nscanned = hscan->rs_nblocks - hscan->rs_startblock +
+			hscan->rs_cblock;
+
+	squeeze_progress_update_param(SQUEEZE_PROGRESS_HEAP_BLKS_SCANNED,
+								  nscanned);
+}
+
+/*
+ * Write tuple into the transient relation w/o using the buffer manager.
+ *
+ * rewrite_heap_tuple() copies the visibility information from the "old
+ * tuple", so pass it a header that looks as if the tuple was inserted by the
+ * current command of our transaction.
+ */
+static void
+rewrite_insert_tuple(RewriteState rwstate, HeapTuple tup, TransactionId xid,
+					 CommandId cid)
+{
+	HeapTupleHeaderData	hdr;
+	HeapTupleData	tup_old;
+
+	memset(&hdr, 0, sizeof(HeapTupleHeaderData));
+	hdr.t_infomask = HEAP_XMAX_INVALID;
+	HeapTupleHeaderSetXmin(&hdr, xid);
+	HeapTupleHeaderSetXmax(&hdr, InvalidTransactionId);
+	HeapTupleHeaderSetCmin(&hdr, cid);
+	ItemPointerSetInvalid(&hdr.t_ctid);
+
+	tup_old.t_data = &hdr;
+	tup_old.t_len = tup->t_len;
+	ItemPointerSetInvalid(&tup_old.t_self);
+	tup_old.t_tableOid = InvalidOid;
+
+	/* The tuple is supposed to be a new one. */
+	ItemPointerSetInvalid(&tup->t_data->t_ctid);
+
+	rewrite_heap_tuple(rwstate, &tup_old, tup);
+}
 
 /*
  * Create a table into which we'll copy the contents of the source table, as
@@ -2434,23 +3292,29 @@ create_transient_table(CatalogState *cat_state, TupleDesc tup_desc,
  * indexes_src is array of existing indexes on the source relation and
  * nindexes the number of its entries.
  *
- * An array of oids of corresponding indexes created on the destination
- * relation is returned. The order of items does match, so we can use these
- * arrays to swap index storage.
+ * The oids of the corresponding indexes created on the destination relation
+ * are stored into indexes_dst. The order of items does match, so we can use
+ * these arrays to swap index storage.
+ *
+ * If skip_build is true, only the catalog entries and empty storage are
+ * created, and the caller is responsible for filling the indexes.
+ *
+ * If ctx is passed, concurrent changes are decoded (but not applied) after
+ * each index has been built.
  */
-static Oid *
+static void
 build_transient_indexes(Relation rel_dst, Relation rel_src,
 						Oid *indexes_src, int nindexes,
-						TablespaceInfo *tbsp_info, CatalogState *cat_state)
+						TablespaceInfo *tbsp_info, CatalogState *cat_state,
+						bool skip_build, Oid *indexes_dst,
+						LogicalDecodingContext *ctx)
 {
 	StringInfo	ind_name;
 	int	i;
-	Oid	*result;
 
 	Assert(nindexes > 0);
 
 	ind_name = makeStringInfo();
-	result = (Oid *) palloc(nindexes * sizeof(Oid));
 
 	for (i = 0; i < nindexes; i++)
 	{
@@ -2478,6 +3342,7 @@ build_transient_indexes(Relation rel_dst, Relation rel_src,
 #else
 		bool	isconstraint;
 #endif
+		TimestampTz	t_start;
 
 		ind_oid = indexes_src[i];
 		ind = index_open(ind_oid, AccessShareLock);
@@ -2543,6 +3408,8 @@ build_transient_indexes(Relation rel_dst, Relation rel_src,
 		flags = 0;
 		if (ind->rd_index->indisprimary)
 			flags |= INDEX_CREATE_IS_PRIMARY;
+		if (skip_build)
+			flags |= INDEX_CREATE_SKIP_BUILD;
 #else
 		isconstraint = ind->rd_index->indisprimary || ind_info->ii_Unique ||
 			ind->rd_index->indisexclusion;
@@ -2657,6 +3524,7 @@ build_transient_indexes(Relation rel_dst, Relation rel_src,
 		 * eventually be dropped. Therefore there's no need to record valid
 		 * dependency on parents.
 		 */
+		t_start = GetCurrentTimestamp();
 		ind_oid_new = index_create(rel_dst,
 								   ind_name->data,
 								   InvalidOid,
@@ -2687,13 +3555,13 @@ build_transient_indexes(Relation rel_dst, Relation rel_src,
 								   false, /* is_internal */
 								   NULL	  /* constraintId */
 #else
-								   false, /* skip_build */
+								   skip_build, /* skip_build */
 								   false, /* concurrent */
 								   false, /* is_internal */
 								   false  /* if_not_exists */
 #endif
 );
-		result[i] = ind_oid_new;
+		indexes_dst[i] = ind_oid_new;
 
 #if PG_VERSION_NUM >= 110000
 		debug_query_string = NULL;
@@ -2706,9 +3574,22 @@ build_transient_indexes(Relation rel_dst, Relation rel_src,
 		pfree(indoptions);
 		if (reloptions)
 			pfree(reloptions);
-	}
 
-	return result;
+		if (!skip_build)
+		{
+			squeeze_stats.index_times[i] = GetCurrentTimestamp() - t_start;
+			squeeze_progress_incr_param(SQUEEZE_PROGRESS_INDEXES_BUILT, 1);
+
+			/*
+			 * index_build() cannot be interrupted, so at least pay off the
+			 * I/O before building the next index.
+			 */
+			squeeze_throttle();
+		}
+
+		if (ctx != NULL && !skip_build)
+			decode_concurrent_changes_early(ctx);
+	}
 }
 
 /*
@@ -2716,7 +3597,7 @@ build_transient_indexes(Relation rel_dst, Relation rel_src,
  *
  * Caller must hold at least AccessShareLock on rel_src.
  */
-static ScanKey
+ScanKey
 build_identity_key(Oid ident_idx_oid, Relation rel_src, int *nentries)
 {
 	Relation	ident_idx_rel;
@@ -2779,23 +3660,115 @@ build_identity_key(Oid ident_idx_oid, Relation rel_src, int *nentries)
 	return result;
 }
 
+/*
+ * Process the concurrent data changes w/o holding the exclusive lock on the
+ * source table until the changes that remain to be processed under the lock
+ * can probably be processed within squeeze_max_xlock_time.
+ *
+ * The prediction is based on the throughput of the processing (the amount of
+ * WAL decoded per unit of time, including the application of the changes),
+ * accumulated in *stats across calls. The amount of WAL remaining at the end
+ * of each round is what the next round (or the final merge) has to process.
+ * If the changes arrive faster than we can process them, the backlog never
+ * gets small enough, so give up after MAX_CATCH_UP_ROUNDS rounds.
+ */
+static void
+catch_up_concurrent_changes(LogicalDecodingContext *ctx,
+							CatalogState *cat_state, Relation rel_dst,
+							ScanKey ident_key, int ident_key_nentries,
+							IndexInsertState *iistate, CatchUpStats *stats)
+{
+	int	i;
+
+	for (i = 0; i < MAX_CATCH_UP_ROUNDS; i++)
+	{
+		XLogRecPtr	xlog_insert_ptr, end_of_wal, start_lsn;
+		struct timeval	t_start, t_end;
+		double	backlog, predicted_ms;
+
+		/*
+		 * Flush all WAL records inserted so far (possibly except for the last
+		 * incomplete page, see GetInsertRecPtr), to minimize the amount of
+		 * data we need to flush while holding exclusive lock on the source
+		 * table.
+		 */
+		xlog_insert_ptr = GetInsertRecPtr();
+		XLogFlush(xlog_insert_ptr);
+
+		/*
+		 * Since we'll do some more changes, all the WAL records flushed so
+		 * far need to be decoded for sure.
+		 */
+		end_of_wal = GetFlushRecPtr();
+
+		start_lsn = ctx->reader->EndRecPtr;
+		gettimeofday(&t_start, NULL);
+		process_concurrent_changes(ctx, end_of_wal, cat_state, rel_dst,
+								   ident_key, ident_key_nentries, iistate,
+								   NoLock, NULL);
+		gettimeofday(&t_end, NULL);
+
+		if (!XLogRecPtrIsInvalid(start_lsn) &&
+			ctx->reader->EndRecPtr > start_lsn)
+		{
+			stats->bytes += ctx->reader->EndRecPtr - start_lsn;
+			stats->usecs += (t_end.tv_sec - t_start.tv_sec) * 1000000.0 +
+				(t_end.tv_usec - t_start.tv_usec);
+		}
+
+		/* No time limit, so no reason to wait. */
+		if (squeeze_max_xlock_time == 0)
+			return;
+
+		/* Nothing to base the prediction on. */
+		if (stats->bytes == 0 || stats->usecs <= 0)
+			return;
+
+		/*
+		 * Only use half of the time for the prediction. We also need to
+		 * acquire the locks, flush WAL and check the catalog before the
+		 * changes can be processed, and the rate of incoming changes can
+		 * vary.
+		 */
+		xlog_insert_ptr = GetXLogInsertRecPtr();
+		backlog = xlog_insert_ptr > ctx->reader->EndRecPtr ?
+			xlog_insert_ptr - ctx->reader->EndRecPtr : 0;
+		predicted_ms = backlog * stats->usecs / stats->bytes / 1000.0;
+		elog(DEBUG1,
+			 "pg_squeeze: %.0f bytes of WAL to be decoded, expected to take %.0f ms",
+			 backlog, predicted_ms);
+		if (predicted_ms <= squeeze_max_xlock_time / 2.0)
+			return;
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	elog(DEBUG1,
+		 "pg_squeeze: could not catch up with concurrent changes in %d rounds",
+		 MAX_CATCH_UP_ROUNDS);
+}
+
 /*
  * Try to perform the final processing of concurrent data changes of the
  * source table, which requires an exclusive lock. The return value tells
- * whether this step succeeded. (If not, caller might want to retry.)
+ * whether this step succeeded. (If not, caller might want to retry.) If the
+ * lock could not be acquired within squeeze_max_lock_wait_time, *lock_timeout
+ * is set to true.
  */
 static bool
 perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 					Relation rel_dst, ScanKey ident_key,
 					int ident_key_nentries, IndexInsertState *iistate,
 					CatalogState *cat_state,
-					LogicalDecodingContext *ctx)
+					LogicalDecodingContext *ctx,
+					bool *lock_timeout)
 {
 	bool	success;
 	XLogRecPtr	xlog_insert_ptr, end_of_wal;
 	int	i;
 	struct timeval t_end;
 	struct timeval *t_end_ptr = NULL;
+	TimestampTz	t_lock;
 
 	/*
 	 * Lock the source table exclusively last time, to finalize the work.
@@ -2821,16 +3794,28 @@ perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 	 * A, B, ... to complete while holding the exclusive lock can cause
 	 * deadlocks.)
 	 */
-	LockRelationOid(relid_src, AccessExclusiveLock);
 
 	/*
-	 * Lock the indexes too, as ALTER INDEX does not need table lock.
-	 *
-	 * The locking will succeed even if the index is no longer there. In that
-	 * case, ERROR will be raised during the catalog check below.
+	 * Let the test session change the data now, so that the changes are
+	 * only processed under the exclusive lock.
 	 */
-	for (i = 0; i < nindexes; i++)
-		LockRelationOid(indexes_src[i], AccessExclusiveLock);
+	if (squeeze_test_advisory_lock != 0)
+	{
+		Datum	key = Int64GetDatum((int64) squeeze_test_advisory_lock);
+
+		DirectFunctionCall1(pg_advisory_lock_int8, key);
+		DirectFunctionCall1(pg_advisory_unlock_int8, key);
+	}
+
+	t_lock = GetCurrentTimestamp();
+	*lock_timeout = !lock_source_relations(relid_src, indexes_src, nindexes);
+	squeeze_stats.lock_acquired = GetCurrentTimestamp();
+	squeeze_stats.lock_wait_time += squeeze_stats.lock_acquired - t_lock;
+	if (*lock_timeout)
+	{
+		squeeze_stats.lock_acquired = 0;
+		return false;
+	}
 
 	if (squeeze_max_xlock_time > 0)
 	{
@@ -2839,7 +3824,8 @@ perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 
 		gettimeofday(&t_start, NULL);
 		usec = t_start.tv_usec + 1000 * (squeeze_max_xlock_time % 1000);
-		t_end.tv_sec = t_start.tv_sec + usec / USECS_PER_SEC;
+		t_end.tv_sec = t_start.tv_sec + squeeze_max_xlock_time / 1000 +
+			usec / USECS_PER_SEC;
 		t_end.tv_usec = usec % USECS_PER_SEC;
 		t_end_ptr = &t_end;
 	}
@@ -2883,9 +3869,13 @@ perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 			UnlockRelationOid(indexes_src[i], AccessExclusiveLock);
 
 		UnlockRelationOid(relid_src, AccessExclusiveLock);
+		squeeze_stats.lock_held_time += GetCurrentTimestamp() -
+			squeeze_stats.lock_acquired;
+		squeeze_stats.lock_acquired = 0;
 
 		/*
-		 * Take time to reach end_of_wal.
+		 * Take time to reach end_of_wal. If the application of a batch was
+		 * interrupted, it's resumed first.
 		 *
 		 * XXX DecodingOutputState may contain some changes. The corner case
 		 * that the data_size has already reached maintenance_work_mem so the
@@ -2901,6 +3891,88 @@ perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 	return success;
 }
 
+/*
+ * Lock the source relation and its indexes exclusively. The indexes need to
+ * be locked too, as ALTER INDEX does not need table lock.
+ *
+ * The locking will succeed even if the index is no longer there. In that
+ * case, ERROR will be raised during the catalog check.
+ *
+ * If squeeze_max_lock_wait_time is set, do not wait in the lock queue, but
+ * keep trying with increasing delays. Return false if the locks could not be
+ * acquired within that time.
+ */
+static bool
+lock_source_relations(Oid relid_src, Oid *indexes_src, int nindexes)
+{
+	struct timeval	t_start;
+	long	delay = 1;
+	int	i;
+
+	if (squeeze_max_lock_wait_time == 0)
+	{
+		LockRelationOid(relid_src, AccessExclusiveLock);
+		for (i = 0; i < nindexes; i++)
+			LockRelationOid(indexes_src[i], AccessExclusiveLock);
+		return true;
+	}
+
+	gettimeofday(&t_start, NULL);
+	while (!try_lock_source_relations(relid_src, indexes_src, nindexes))
+	{
+		struct timeval	now;
+		long	elapsed;
+		int	rc;
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - t_start.tv_sec) * 1000L +
+			(now.tv_usec - t_start.tv_usec) / 1000L;
+		if (elapsed >= squeeze_max_lock_wait_time)
+			return false;
+
+		delay = Min(delay, squeeze_max_lock_wait_time - elapsed);
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, delay,
+					   PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		CHECK_FOR_INTERRUPTS();
+
+		delay = Min(delay * 2, LOCK_WAIT_MAX_DELAY);
+	}
+
+	return true;
+}
+
+/*
+ * Try to lock the source relation and its indexes w/o waiting. If any lock
+ * is not available, release those acquired and return false.
+ */
+static bool
+try_lock_source_relations(Oid relid_src, Oid *indexes_src, int nindexes)
+{
+	int	i;
+
+	if (!ConditionalLockRelationOid(relid_src, AccessExclusiveLock))
+		return false;
+
+	for (i = 0; i < nindexes; i++)
+	{
+		if (!ConditionalLockRelationOid(indexes_src[i], AccessExclusiveLock))
+		{
+			while (--i >= 0)
+				UnlockRelationOid(indexes_src[i], AccessExclusiveLock);
+			UnlockRelationOid(relid_src, AccessExclusiveLock);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 /*
  * Derived from swap_relation_files() in PG core, but removed anything we
  * don't need. Also incorporated the relevant parts of finish_heap_swap().
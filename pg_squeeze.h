@@ -16,6 +16,7 @@
 
 #include "access/genam.h"
 #include "access/heapam.h"
+#include "access/parallel.h"
 #include "access/relscan.h"
 #include "access/tuptoaster.h"
 #include "access/xlog_internal.h"
@@ -24,9 +25,12 @@
 #include "nodes/execnodes.h"
 #include "postmaster/bgworker.h"
 #include "replication/logical.h"
+#include "storage/buffile.h"
+#include "storage/shm_mq.h"
 #include "utils/inval.h"
 #include "utils/resowner.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 
 typedef enum
 {
@@ -44,52 +48,104 @@ typedef struct ConcurrentChange
 	/*
 	 * The actual tuple.
 	 *
-	 * The tuple data follows the ConcurrentChange structure. Before use make
-	 * sure the tuple is correctly aligned (ConcurrentChange can be stored as
-	 * bytea) and that tuple->t_data is fixed.
+	 * The tuple data follows the ConcurrentChange structure, at
+	 * MAXALIGN(sizeof(ConcurrentChange)) offset. Before use make sure that
+	 * tuple->t_data is fixed.
 	 */
 	HeapTupleData	tup_data;
 } ConcurrentChange;
 
+/* Space needed to store a change whose tuple has the given length. */
+#define ConcurrentChangeSize(t_len) \
+	(MAXALIGN(sizeof(ConcurrentChange)) + MAXALIGN(t_len))
+
+/*
+ * A piece of memory to store the decoded changes.
+ */
+typedef struct ChangeSegment
+{
+	struct ChangeSegment	*next;
+
+	/* The space available for changes and the space used so far. */
+	Size	size;
+	Size	used;
+
+	/* The changes follow, see ChangeSegmentData(). */
+} ChangeSegment;
+
+#define ChangeSegmentData(seg) \
+	((char *) (seg) + MAXALIGN(sizeof(ChangeSegment)))
+
+/* The default size of ChangeSegment, including the header. */
+#define CHANGE_SEGMENT_SIZE	(1024 * 1024)
+
 typedef struct DecodingOutputState
 {
 	/* The relation whose changes we're decoding. */
 	Oid	relid;
 
 	/*
-	 * Decoded changes are stored here. Although we try to avoid excessive
-	 * batches, it can happen that the changes need to be stored to disk. The
-	 * tuplestore does this transparently.
+	 * Storage of the relation and of its TOAST relation. WAL records
+	 * containing data changes of other relations are not passed to the
+	 * decoding machinery at all. Invalid relNode means that the records of
+	 * the particular relation are not expected (TOAST) or that the filtering
+	 * is not enabled yet.
 	 */
-	Tuplestorestate *tstore;
-
-	/* The current number of changes in tstore. */
-	double	nchanges;
+	RelFileNode	rnode;
+	RelFileNode	toast_rnode;
 
 	/*
-	 * Descriptor to store the ConcurrentChange structure serialized
-	 * (bytea). We can't store the tuple directly because tuplestore only
-	 * supports minimum tuple and we may need to transfer OID system column
-	 * from the output plugin. Also we need to transfer the change kind, so
-	 * it's better to put everything in the structure than to use 2
-	 * tuplestores "in parallel".
+	 * Decoded changes are appended to a list of memory segments allocated in
+	 * change_cxt. Each change is stored as ConcurrentChange, followed by the
+	 * tuple data, so the tuple can be used in place when the changes are
+	 * being applied.
+	 *
+	 * Although we try to avoid excessive batches, it can happen that the
+	 * changes do not fit into maintenance_work_mem. In such a case the
+	 * subsequent changes are written to spill_file, in the same format
+	 * except for the alignment padding.
 	 */
-	TupleDesc	tupdesc_change;
+	MemoryContext	change_cxt;
+	ChangeSegment	*seg_first;
+	ChangeSegment	*seg_last;
+	BufFile	*spill_file;
+
+	/* The current number of changes stored. */
+	double	nchanges;
 
 	/* Tuple descriptor needed to update indexes. */
 	TupleDesc	tupdesc;
 
-	/* Slot to retrieve data from tstore. */
-	TupleTableSlot	*tsslot;
-
 	/*
-	 * Total amount of space used by "change tuples". We use this field to
-	 * minimize the likelihood that tstore will have to be spilled to
+	 * Total amount of space used by the changes. We use this field to
+	 * minimize the likelihood that the changes will have to be spilled to
 	 * disk. (Such a spilling should only be necessary for huge transactions,
 	 * because decoding of these cannot be split into multiple steps.)
 	 */
 	Size	data_size;
 
+	/*
+	 * Position of the next change to be read. If read_seg is NULL, the
+	 * changes are read from spill_file into read_buf.
+	 */
+	ChangeSegment	*read_seg;
+	Size	read_off;
+	char	*read_buf;
+	Size	read_buf_size;
+
+	/*
+	 * If the application of the changes had to stop before the whole batch
+	 * was applied, apply_in_progress is set and the next call of
+	 * apply_concurrent_changes() resumes the batch. apply_coalesced tells
+	 * how the batch is being applied. If the changes are applied one by
+	 * one, the read position above tells where to resume. Otherwise
+	 * coalesced_batch contains the batch, at whatever stage of coalescing
+	 * or application it was interrupted.
+	 */
+	bool	apply_in_progress;
+	bool	apply_coalesced;
+	struct CoalescedBatch	*coalesced_batch;
+
 	ResourceOwner	resowner;
 } DecodingOutputState;
 
@@ -99,6 +155,62 @@ extern	XLogSegNo	squeeze_current_segment;
 extern void	_PG_init(void);
 
 extern int squeeze_worker_naptime;
+extern int squeeze_workers_per_database;
+extern int squeeze_max_parallel_load_workers;
+extern int squeeze_max_parallel_index_workers;
+extern int squeeze_max_parallel_lookup_workers;
+
+/*
+ * Statistics of the last call of squeeze_table() in this backend, see
+ * squeeze_last_stats(). The durations are in microseconds.
+ */
+typedef struct SqueezeStats
+{
+	int64	setup_decoding_time;
+	int64	initial_load_time;
+	int64	index_build_time;
+	int64	catch_up_time;
+	int64	lock_wait_time;
+	int64	lock_held_time;
+	int64	swap_time;
+
+	/*
+	 * Time to build each index, in the order of the source table's
+	 * indexes. -1 if the index was not built separately (i.e. it was filled
+	 * during the initial load or built by parallel workers along with other
+	 * indexes). The array is allocated in TopMemoryContext.
+	 */
+	int	nindexes;
+	int64	*index_times;
+
+	int64	tuples_copied;
+
+	/* Size of the main fork of the table before and after processing. */
+	int64	size_before;
+	int64	size_after;
+
+	/*
+	 * WAL inserted by the whole cluster while the table was being processed,
+	 * and the part of it that we had to decode.
+	 */
+	int64	wal_generated;
+	int64	wal_decoded;
+
+	/* Concurrent data changes, coalesced ones are counted only once. */
+	int64	changes_inserted;
+	int64	changes_updated;
+	int64	changes_deleted;
+
+	int	merge_attempts;
+
+	/* Has the processing completed? */
+	bool	finished;
+
+	/* The time the exclusive lock was acquired, 0 if we do not hold it. */
+	TimestampTz	lock_acquired;
+} SqueezeStats;
+
+extern SqueezeStats squeeze_stats;
 
 /* Everything we need to call ExecInsertIndexTuples(). */
 typedef struct IndexInsertState
@@ -108,6 +220,26 @@ typedef struct IndexInsertState
 	ExprContext	*econtext;
 
 	Relation	ident_index;
+
+	/*
+	 * Information needed to hash and compare values of the identity key, in
+	 * order to coalesce the concurrent changes of the same row. If any column
+	 * of the key has no hash function, ident_key_hashable is false and the
+	 * changes are applied one by one.
+	 *
+	 * ident_key_cmp_funcs are the btree comparison functions of the identity
+	 * index, used to look up the rows in the index order. ident_key_options
+	 * are the per-column flags of the index (pg_index(indoption)), the order
+	 * of DESC columns is reversed.
+	 */
+	int	ident_key_natts;
+	AttrNumber	*ident_key_attnos;
+	FmgrInfo	*ident_key_hash_funcs;
+	FmgrInfo	*ident_key_eq_funcs;
+	FmgrInfo	*ident_key_cmp_funcs;
+	int16	*ident_key_options;
+	Oid	*ident_key_collations;
+	bool	ident_key_hashable;
 } IndexInsertState;
 
 /*
@@ -196,10 +328,16 @@ typedef struct CatalogState
 } CatalogState;
 
 extern void check_catalog_changes(CatalogState *state, LOCKMODE lock_held);
+extern ScanKey build_identity_key(Oid ident_idx_oid, Relation rel_src,
+								  int *nentries);
 
 extern IndexInsertState *get_index_insert_state(Relation relation,
 												Oid ident_index_id);
 extern void free_index_insert_state(IndexInsertState *iistate);
+extern void find_tuple_by_key(Relation relation, IndexScanDesc scan,
+							  ScanKey key, int nkeys, HeapTuple tup_key,
+							  TupleTableSlot *ind_slot, ItemPointer ctid);
+extern void decode_concurrent_changes_early(LogicalDecodingContext *ctx);
 extern bool process_concurrent_changes(LogicalDecodingContext *ctx,
 									   XLogRecPtr end_of_wal,
 									   CatalogState	*cat_state,
@@ -237,6 +375,9 @@ typedef struct WorkerConInteractive
 {
 	Oid	dbid;
 	Oid	roleid;
+
+	/* Started by the launcher rather than by squeeze.start_worker()? */
+	bool	launched;
 } WorkerConInteractive;
 
 extern WorkerConInit *allocate_worker_con_info(char *dbname,
@@ -246,3 +387,115 @@ extern void squeeze_initialize_bgworker(BackgroundWorker *worker,
 										WorkerConInteractive *con_interactive,
 										Oid notify_pid);
 extern void squeeze_worker_main(Datum main_arg);
+extern void squeeze_worker_reload_config(void);
+
+extern int squeeze_max_workers;
+extern int squeeze_max_replication_slots;
+extern int squeeze_max_io_rate;
+extern char *squeeze_worker_role;
+
+extern void squeeze_launcher_init(void);
+extern bool squeeze_launcher_enabled(void);
+extern void squeeze_launcher_report_tasks(int64 ntasks);
+extern void squeeze_launcher_wakeup(void);
+extern int squeeze_launcher_pid(void);
+extern void squeeze_throttle_io(int64 bytes);
+extern void squeeze_launcher_main(Datum main_arg);
+
+/*
+ * State of the parallel initial load, as seen by the leader.
+ */
+typedef struct ParallelLoadState
+{
+	ParallelContext	*pcxt;
+
+	/* The source relation. */
+	Relation	rel;
+
+	/*
+	 * Queues to receive tuples from the workers. NULL means that the worker
+	 * has finished.
+	 */
+	shm_mq_handle	**queues;
+	int	nqueues;
+
+	/* The number of workers that haven't finished yet. */
+	int	nactive;
+
+	/* The queue to be checked first next time. */
+	int	next;
+
+	/* Storage for the tuple received from a queue. */
+	HeapTupleData	tuple;
+
+	/* The leader's own scan, if no worker could be launched. */
+#if PG_VERSION_NUM >= 120000
+	TableScanDesc	scan;
+	TupleTableSlot	*slot;
+#else
+	HeapScanDesc	scan;
+#endif
+
+	/* Tuple that the leader had to flatten, to be freed on the next call. */
+	HeapTuple	flattened;
+} ParallelLoadState;
+
+extern ParallelLoadState *begin_parallel_load(Relation rel, Snapshot snapshot,
+											  int nworkers);
+extern HeapTuple parallel_load_next_tuple(ParallelLoadState *state);
+extern void end_parallel_load(ParallelLoadState *state);
+extern void squeeze_parallel_load_main(dsm_segment *seg, shm_toc *toc);
+extern void build_indexes_parallel(Relation heap, Oid *indexes, int nindexes,
+								   int nworkers);
+extern bool index_build_is_parallel_safe(Oid *indexes, int nindexes);
+extern void squeeze_index_build_main(dsm_segment *seg, shm_toc *toc);
+extern void find_tuples_parallel(Relation rel, Relation ident_index,
+								 HeapTuple *tuples, int ntuples,
+								 ItemPointer tids, int nworkers);
+extern void squeeze_lookup_main(dsm_segment *seg, shm_toc *toc);
+
+/*
+ * Progress reporting, see progress.c.
+ *
+ * Phases of squeeze_table().
+ */
+#define	SQUEEZE_PHASE_INITIALIZING		0
+#define	SQUEEZE_PHASE_SETUP_DECODING	1
+#define	SQUEEZE_PHASE_INITIAL_LOAD		2
+#define	SQUEEZE_PHASE_INDEX_BUILD		3
+#define	SQUEEZE_PHASE_CATCH_UP			4
+#define	SQUEEZE_PHASE_FINAL_MERGE		5
+#define	SQUEEZE_PHASE_SWAP				6
+#define	SQUEEZE_PHASE_CLEANUP			7
+
+/* Indexes into the array of progress parameters. */
+#define	SQUEEZE_PROGRESS_PHASE				0
+#define	SQUEEZE_PROGRESS_HEAP_BLKS_TOTAL	1
+#define	SQUEEZE_PROGRESS_HEAP_BLKS_SCANNED	2
+#define	SQUEEZE_PROGRESS_TUPLES_COPIED		3
+#define	SQUEEZE_PROGRESS_INDEXES_TOTAL		4
+#define	SQUEEZE_PROGRESS_INDEXES_BUILT		5
+#define	SQUEEZE_PROGRESS_MERGE_ATTEMPT		6
+#define	SQUEEZE_PROGRESS_WAL_DECODED		7
+#define	SQUEEZE_PROGRESS_WAL_TARGET			8
+#define	SQUEEZE_PROGRESS_CHANGES_PENDING	9
+#define	SQUEEZE_PROGRESS_CHANGES_APPLIED	10
+/* Time spent sleeping due to the rate limits, in microseconds. */
+#define	SQUEEZE_PROGRESS_THROTTLE_TIME		11
+
+#define	SQUEEZE_PROGRESS_NPARAMS			12
+
+extern void squeeze_progress_shmem_request(void);
+extern void squeeze_progress_start(Oid relid);
+extern void squeeze_progress_end(void);
+extern void squeeze_progress_update_param(int index, int64 val);
+extern void squeeze_progress_incr_param(int index, int64 incr);
+
+extern int squeeze_max_read_rate;
+extern int squeeze_max_write_rate;
+extern int squeeze_max_wal_rate;
+extern int squeeze_max_replay_lag;
+
+extern void squeeze_throttle_start(void);
+extern void squeeze_throttle(void);
+extern void squeeze_throttle_sleep(long delay_ms);
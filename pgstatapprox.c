@@ -38,12 +38,14 @@
 #include "storage/procarray.h"
 #include "storage/lmgr.h"
 #include "utils/builtins.h"
+#include "utils/sampling.h"
 #if PG_VERSION_NUM < 120000
 #include "utils/tqual.h"
 #endif
 #include "commands/vacuum.h"
 
 PG_FUNCTION_INFO_V1(squeeze_pgstattuple_approx);
+PG_FUNCTION_INFO_V1(squeeze_pgstattuple_sample);
 
 typedef struct output_type
 {
@@ -61,6 +63,138 @@ typedef struct output_type
 
 #define NUM_OUTPUT_COLUMNS 10
 
+static Datum statapprox_common(FunctionCallInfo fcinfo, Oid relid,
+							   int sample_size);
+
+/*
+ * Add the statistics of a single block to *stat. If the page has only
+ * visible tuples, the free space is taken from the FSM, otherwise the page
+ * is read and its tuples are counted. Returns true if the page was read and
+ * is not empty.
+ */
+static bool
+statapprox_block(Relation rel, BlockNumber blkno, Buffer *vmbuffer,
+				 BufferAccessStrategy bstrategy, TransactionId OldestXmin,
+				 output_type *stat, uint64 *misc_count)
+{
+	Buffer		buf;
+	Page		page;
+	OffsetNumber offnum,
+				maxoff;
+	Size		freespace;
+
+	/*
+	 * If the page has only visible tuples, then we can find out the free
+	 * space from the FSM and move on.
+	 */
+	if (VM_ALL_VISIBLE(rel, blkno, vmbuffer))
+	{
+		freespace = GetRecordedFreeSpace(rel, blkno);
+		stat->tuple_len += BLCKSZ - freespace;
+		stat->free_space += freespace;
+		return false;
+	}
+
+	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno,
+							 RBM_NORMAL, bstrategy);
+
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+
+	page = BufferGetPage(buf);
+
+	/*
+	 * It's not safe to call PageGetHeapFreeSpace() on new pages, so we
+	 * treat them as being free space for our purposes.
+	 */
+	if (!PageIsNew(page))
+		stat->free_space += PageGetHeapFreeSpace(page);
+	else
+		stat->free_space += BLCKSZ - SizeOfPageHeaderData;
+
+	if (PageIsNew(page) || PageIsEmpty(page))
+	{
+		UnlockReleaseBuffer(buf);
+		return false;
+	}
+
+	/*
+	 * Look at each tuple on the page and decide whether it's live or
+	 * dead, then count it and its size. Unlike lazy_scan_heap, we can
+	 * afford to ignore problems and special cases.
+	 */
+	maxoff = PageGetMaxOffsetNumber(page);
+
+	for (offnum = FirstOffsetNumber;
+		 offnum <= maxoff;
+		 offnum = OffsetNumberNext(offnum))
+	{
+		ItemId		itemid;
+		HeapTupleData tuple;
+
+		itemid = PageGetItemId(page, offnum);
+
+		if (!ItemIdIsUsed(itemid) || ItemIdIsRedirected(itemid) ||
+			ItemIdIsDead(itemid))
+		{
+			continue;
+		}
+
+		Assert(ItemIdIsNormal(itemid));
+
+		ItemPointerSet(&(tuple.t_self), blkno, offnum);
+
+		tuple.t_data = (HeapTupleHeader) PageGetItem(page, itemid);
+		tuple.t_len = ItemIdGetLength(itemid);
+		tuple.t_tableOid = RelationGetRelid(rel);
+
+		/*
+		 * We count live and dead tuples, but we also need to add up
+		 * others in order to feed vac_estimate_reltuples.
+		 */
+		switch (HeapTupleSatisfiesVacuum(&tuple, OldestXmin, buf))
+		{
+			case HEAPTUPLE_RECENTLY_DEAD:
+				(*misc_count)++;
+				/* Fall through */
+			case HEAPTUPLE_DEAD:
+				stat->dead_tuple_len += tuple.t_len;
+				stat->dead_tuple_count++;
+				break;
+			case HEAPTUPLE_LIVE:
+				stat->tuple_len += tuple.t_len;
+				stat->tuple_count++;
+				break;
+			case HEAPTUPLE_INSERT_IN_PROGRESS:
+			case HEAPTUPLE_DELETE_IN_PROGRESS:
+				(*misc_count)++;
+				break;
+			default:
+				elog(ERROR, "unexpected HeapTupleSatisfiesVacuum result");
+				break;
+		}
+	}
+
+	UnlockReleaseBuffer(buf);
+
+	return true;
+}
+
+/*
+ * Calculate percentages if the relation has one or more pages.
+ */
+static void
+statapprox_percentages(output_type *stat, BlockNumber nblocks,
+					   BlockNumber scanned)
+{
+	if (nblocks != 0)
+	{
+		stat->scanned_percent = 100 * scanned / nblocks;
+		stat->tuple_percent = 100.0 * stat->tuple_len / stat->table_len;
+		stat->dead_tuple_percent = 100.0 * stat->dead_tuple_len / stat->table_len;
+		stat->free_percent = 100.0 * stat->free_space / stat->table_len;
+	}
+}
+
 /*
  * This function takes an already open relation and scans its pages,
  * skipping those that have the corresponding visibility map bit set.
@@ -90,112 +224,86 @@ statapprox_heap(Relation rel, output_type *stat)
 
 	for (blkno = 0; blkno < nblocks; blkno++)
 	{
-		Buffer		buf;
-		Page		page;
-		OffsetNumber offnum,
-					maxoff;
-		Size		freespace;
-
 		CHECK_FOR_INTERRUPTS();
 
-		/*
-		 * If the page has only visible tuples, then we can find out the free
-		 * space from the FSM and move on.
-		 */
-		if (VM_ALL_VISIBLE(rel, blkno, &vmbuffer))
-		{
-			freespace = GetRecordedFreeSpace(rel, blkno);
-			stat->tuple_len += BLCKSZ - freespace;
-			stat->free_space += freespace;
-			continue;
-		}
+		if (statapprox_block(rel, blkno, &vmbuffer, bstrategy, OldestXmin,
+							 stat, &misc_count))
+			scanned++;
+	}
 
-		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno,
-								 RBM_NORMAL, bstrategy);
+	stat->table_len = (uint64) nblocks * BLCKSZ;
 
-		LockBuffer(buf, BUFFER_LOCK_SHARE);
+	stat->tuple_count = vac_estimate_reltuples(rel,
+#if PG_VERSION_NUM < 110000
+						   false, /* is_analyze */
+#endif
+						   nblocks, scanned,
+											   stat->tuple_count + misc_count);
 
-		page = BufferGetPage(buf);
+	statapprox_percentages(stat, nblocks, scanned);
 
-		/*
-		 * It's not safe to call PageGetHeapFreeSpace() on new pages, so we
-		 * treat them as being free space for our purposes.
-		 */
-		if (!PageIsNew(page))
-			stat->free_space += PageGetHeapFreeSpace(page);
-		else
-			stat->free_space += BLCKSZ - SizeOfPageHeaderData;
+	if (BufferIsValid(vmbuffer))
+	{
+		ReleaseBuffer(vmbuffer);
+		vmbuffer = InvalidBuffer;
+	}
+}
 
-		if (PageIsNew(page) || PageIsEmpty(page))
-		{
-			UnlockReleaseBuffer(buf);
-			continue;
-		}
+/*
+ * Like statapprox_heap(), but only process a random sample of sample_size
+ * blocks and extrapolate the results to the whole relation.
+ *
+ * The blocks are chosen the same way ANALYZE does, see BlockSampler. Since
+ * the free space per block is a fraction between 0 and BLCKSZ, the standard
+ * error of the estimated free space percentage does not exceed
+ * 50 / sqrt(sample_size) percent.
+ */
+static void
+statsample_heap(Relation rel, int sample_size, output_type *stat)
+{
+	BlockNumber scanned,
+				sampled,
+				nblocks;
+	Buffer		vmbuffer = InvalidBuffer;
+	BufferAccessStrategy bstrategy;
+	TransactionId OldestXmin;
+	BlockSamplerData bs;
+	uint64		misc_count = 0;
+	double		factor;
 
-		scanned++;
+	OldestXmin = GetOldestXmin(rel, PROCARRAY_FLAGS_VACUUM);
+	bstrategy = GetAccessStrategy(BAS_BULKREAD);
 
-		/*
-		 * Look at each tuple on the page and decide whether it's live or
-		 * dead, then count it and its size. Unlike lazy_scan_heap, we can
-		 * afford to ignore problems and special cases.
-		 */
-		maxoff = PageGetMaxOffsetNumber(page);
+	nblocks = RelationGetNumberOfBlocks(rel);
+	scanned = 0;
+	sampled = 0;
 
-		for (offnum = FirstOffsetNumber;
-			 offnum <= maxoff;
-			 offnum = OffsetNumberNext(offnum))
-		{
-			ItemId		itemid;
-			HeapTupleData tuple;
-
-			itemid = PageGetItemId(page, offnum);
-
-			if (!ItemIdIsUsed(itemid) || ItemIdIsRedirected(itemid) ||
-				ItemIdIsDead(itemid))
-			{
-				continue;
-			}
-
-			Assert(ItemIdIsNormal(itemid));
-
-			ItemPointerSet(&(tuple.t_self), blkno, offnum);
-
-			tuple.t_data = (HeapTupleHeader) PageGetItem(page, itemid);
-			tuple.t_len = ItemIdGetLength(itemid);
-			tuple.t_tableOid = RelationGetRelid(rel);
-
-			/*
-			 * We count live and dead tuples, but we also need to add up
-			 * others in order to feed vac_estimate_reltuples.
-			 */
-			switch (HeapTupleSatisfiesVacuum(&tuple, OldestXmin, buf))
-			{
-				case HEAPTUPLE_RECENTLY_DEAD:
-					misc_count++;
-					/* Fall through */
-				case HEAPTUPLE_DEAD:
-					stat->dead_tuple_len += tuple.t_len;
-					stat->dead_tuple_count++;
-					break;
-				case HEAPTUPLE_LIVE:
-					stat->tuple_len += tuple.t_len;
-					stat->tuple_count++;
-					break;
-				case HEAPTUPLE_INSERT_IN_PROGRESS:
-				case HEAPTUPLE_DELETE_IN_PROGRESS:
-					misc_count++;
-					break;
-				default:
-					elog(ERROR, "unexpected HeapTupleSatisfiesVacuum result");
-					break;
-			}
-		}
+	BlockSampler_Init(&bs, nblocks, sample_size, random());
+	while (BlockSampler_HasMore(&bs))
+	{
+		BlockNumber blkno = BlockSampler_Next(&bs);
 
-		UnlockReleaseBuffer(buf);
+		CHECK_FOR_INTERRUPTS();
+
+		if (statapprox_block(rel, blkno, &vmbuffer, bstrategy, OldestXmin,
+							 stat, &misc_count))
+			scanned++;
+		sampled++;
 	}
 
 	stat->table_len = (uint64) nblocks * BLCKSZ;
 
+	/* Extrapolate. */
+	if (sampled > 0)
+	{
+		factor = (double) nblocks / sampled;
+
+		stat->tuple_len = (uint64) (stat->tuple_len * factor);
+		stat->dead_tuple_len = (uint64) (stat->dead_tuple_len * factor);
+		stat->dead_tuple_count = (uint64) (stat->dead_tuple_count * factor);
+		stat->free_space = (uint64) (stat->free_space * factor);
+	}
+
 	stat->tuple_count = vac_estimate_reltuples(rel,
 #if PG_VERSION_NUM < 110000
 						   false, /* is_analyze */
@@ -203,16 +311,7 @@ statapprox_heap(Relation rel, output_type *stat)
 						   nblocks, scanned,
 											   stat->tuple_count + misc_count);
 
-	/*
-	 * Calculate percentages if the relation has one or more pages.
-	 */
-	if (nblocks != 0)
-	{
-		stat->scanned_percent = 100 * scanned / nblocks;
-		stat->tuple_percent = 100.0 * stat->tuple_len / stat->table_len;
-		stat->dead_tuple_percent = 100.0 * stat->dead_tuple_len / stat->table_len;
-		stat->free_percent = 100.0 * stat->free_space / stat->table_len;
-	}
+	statapprox_percentages(stat, nblocks, scanned);
 
 	if (BufferIsValid(vmbuffer))
 	{
@@ -227,7 +326,33 @@ statapprox_heap(Relation rel, output_type *stat)
 Datum
 squeeze_pgstattuple_approx(PG_FUNCTION_ARGS)
 {
-	Oid			relid = PG_GETARG_OID(0);
+	return statapprox_common(fcinfo, PG_GETARG_OID(0), 0);
+}
+
+/*
+ * Like squeeze_pgstattuple_approx(), but only process a random sample of
+ * blocks.
+ */
+Datum
+squeeze_pgstattuple_sample(PG_FUNCTION_ARGS)
+{
+	int			sample_size = PG_GETARG_INT32(1);
+
+	if (sample_size <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 (errmsg("sample size must be greater than zero"))));
+
+	return statapprox_common(fcinfo, PG_GETARG_OID(0), sample_size);
+}
+
+/*
+ * Compute the statistics of the whole relation if sample_size is zero,
+ * otherwise of a sample of sample_size blocks.
+ */
+static Datum
+statapprox_common(FunctionCallInfo fcinfo, Oid relid, int sample_size)
+{
 	Relation	rel;
 	output_type stat = {0};
 	TupleDesc	tupdesc;
@@ -271,7 +396,10 @@ squeeze_pgstattuple_approx(PG_FUNCTION_ARGS)
 				 errmsg("\"%s\" is not a table or materialized view",
 						RelationGetRelationName(rel))));
 
-	statapprox_heap(rel, &stat);
+	if (sample_size > 0)
+		statsample_heap(rel, sample_size, &stat);
+	else
+		statapprox_heap(rel, &stat);
 
 	relation_close(rel, AccessShareLock);
 
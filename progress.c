@@ -0,0 +1,343 @@
+/*-----------------------------------------------------
+ *
+ * progress.c
+ *     Progress reporting of the squeeze_table() function.
+ *
+ * Copyright (c) 2016-2018, Cybertec Schönig & Schönig GmbH
+ *
+ *-----------------------------------------------------
+ */
+#include "pg_squeeze.h"
+
+#include "access/htup_details.h"
+#include "funcapi.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+/*
+ * Progress of a single call of squeeze_table(). Only the backend that owns
+ * the slot writes to it, but the mutex is needed so that readers get a
+ * consistent copy.
+ */
+typedef struct SqueezeProgressSlot
+{
+	slock_t	mutex;
+
+	/* InvalidPid if the slot is not used. */
+	int	pid;
+
+	Oid	dbid;
+	Oid	relid;
+	TimestampTz	started;
+
+	int64	params[SQUEEZE_PROGRESS_NPARAMS];
+} SqueezeProgressSlot;
+
+typedef struct SqueezeProgressShared
+{
+	int	nslots;
+	SqueezeProgressSlot	slots[FLEXIBLE_ARRAY_MEMBER];
+} SqueezeProgressShared;
+
+/* NULL if the library was not loaded via shared_preload_libraries. */
+static SqueezeProgressShared *progress = NULL;
+
+/* The slot used by this backend, if any. */
+static SqueezeProgressSlot *my_slot = NULL;
+
+static int	progress_nslots = 0;
+static bool	xact_callback_registered = false;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size progress_shmem_size(void);
+static void progress_shmem_startup(void);
+static void progress_xact_callback(XactEvent event, void *arg);
+static const char *progress_phase_name(int64 phase);
+
+/*
+ * Request shared memory for the progress slots. To be called from
+ * _PG_init().
+ *
+ * Both client backends and background workers can run squeeze_table(), so
+ * reserve a slot for each of them.
+ */
+void
+squeeze_progress_shmem_request(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	progress_nslots = MaxConnections + max_worker_processes;
+	RequestAddinShmemSpace(progress_shmem_size());
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = progress_shmem_startup;
+}
+
+static Size
+progress_shmem_size(void)
+{
+	return add_size(offsetof(SqueezeProgressShared, slots),
+					mul_size(progress_nslots, sizeof(SqueezeProgressSlot)));
+}
+
+static void
+progress_shmem_startup(void)
+{
+	bool	found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	progress = ShmemInitStruct("pg_squeeze progress", progress_shmem_size(),
+							   &found);
+	if (!found)
+	{
+		int	i;
+
+		progress->nslots = progress_nslots;
+		for (i = 0; i < progress->nslots; i++)
+		{
+			SqueezeProgressSlot	*slot = &progress->slots[i];
+
+			SpinLockInit(&slot->mutex);
+			slot->pid = InvalidPid;
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Start reporting the progress of processing of relation relid.
+ *
+ * The slot is released by squeeze_progress_end(), or at the end of the
+ * transaction at the latest.
+ */
+void
+squeeze_progress_start(Oid relid)
+{
+	int	i;
+
+	if (progress == NULL)
+		return;
+
+	if (my_slot != NULL)
+		squeeze_progress_end();
+
+	if (!xact_callback_registered)
+	{
+		RegisterXactCallback(progress_xact_callback, NULL);
+		xact_callback_registered = true;
+	}
+
+	for (i = 0; i < progress->nslots; i++)
+	{
+		SqueezeProgressSlot	*slot = &progress->slots[i];
+
+		SpinLockAcquire(&slot->mutex);
+		if (slot->pid == InvalidPid)
+		{
+			slot->pid = MyProcPid;
+			slot->dbid = MyDatabaseId;
+			slot->relid = relid;
+			slot->started = GetCurrentTimestamp();
+			memset(slot->params, 0, sizeof(slot->params));
+			SpinLockRelease(&slot->mutex);
+
+			my_slot = slot;
+			return;
+		}
+		SpinLockRelease(&slot->mutex);
+	}
+
+	/* Should not happen, but the processing can continue anyway. */
+	elog(DEBUG1, "pg_squeeze: no free progress slot");
+}
+
+/*
+ * Stop reporting the progress.
+ */
+void
+squeeze_progress_end(void)
+{
+	if (my_slot == NULL)
+		return;
+
+	SpinLockAcquire(&my_slot->mutex);
+	my_slot->pid = InvalidPid;
+	SpinLockRelease(&my_slot->mutex);
+	my_slot = NULL;
+}
+
+/*
+ * Set the value of a progress parameter, see SQUEEZE_PROGRESS_* in
+ * pg_squeeze.h.
+ */
+void
+squeeze_progress_update_param(int index, int64 val)
+{
+	Assert(index >= 0 && index < SQUEEZE_PROGRESS_NPARAMS);
+
+	if (my_slot == NULL)
+		return;
+
+	SpinLockAcquire(&my_slot->mutex);
+	my_slot->params[index] = val;
+	SpinLockRelease(&my_slot->mutex);
+}
+
+/*
+ * Add incr to the value of a progress parameter.
+ */
+void
+squeeze_progress_incr_param(int index, int64 incr)
+{
+	Assert(index >= 0 && index < SQUEEZE_PROGRESS_NPARAMS);
+
+	if (my_slot == NULL)
+		return;
+
+	SpinLockAcquire(&my_slot->mutex);
+	my_slot->params[index] += incr;
+	SpinLockRelease(&my_slot->mutex);
+}
+
+/*
+ * Make sure the slot does not stay in use if the processing ended with
+ * ERROR.
+ */
+static void
+progress_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_COMMIT || event == XACT_EVENT_ABORT)
+		squeeze_progress_end();
+}
+
+static const char *
+progress_phase_name(int64 phase)
+{
+	switch (phase)
+	{
+		case SQUEEZE_PHASE_INITIALIZING:
+			return "initializing";
+		case SQUEEZE_PHASE_SETUP_DECODING:
+			return "setting up decoding";
+		case SQUEEZE_PHASE_INITIAL_LOAD:
+			return "initial load";
+		case SQUEEZE_PHASE_INDEX_BUILD:
+			return "building indexes";
+		case SQUEEZE_PHASE_CATCH_UP:
+			return "catching up";
+		case SQUEEZE_PHASE_FINAL_MERGE:
+			return "final merge";
+		case SQUEEZE_PHASE_SWAP:
+			return "swapping relation files";
+		case SQUEEZE_PHASE_CLEANUP:
+			return "cleaning up";
+	}
+
+	return "unknown";
+}
+
+#define	PROGRESS_COLUMNS	16
+
+/*
+ * Return the progress of all the squeeze_table() calls in progress.
+ */
+extern Datum squeeze_get_progress(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(squeeze_get_progress);
+Datum
+squeeze_get_progress(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate	*tupstore;
+	MemoryContext	per_query_ctx, old_cxt;
+	int	i;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	if (tupdesc->natts != PROGRESS_COLUMNS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	old_cxt = MemoryContextSwitchTo(per_query_ctx);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(old_cxt);
+
+	for (i = 0; progress != NULL && i < progress->nslots; i++)
+	{
+		SqueezeProgressSlot	slot;
+		Datum	values[PROGRESS_COLUMNS];
+		bool	nulls[PROGRESS_COLUMNS];
+		int64	*params = slot.params;
+		Interval	*throttle_time;
+		int	j = 0;
+
+		SpinLockAcquire(&progress->slots[i].mutex);
+		memcpy(&slot, &progress->slots[i], sizeof(SqueezeProgressSlot));
+		SpinLockRelease(&progress->slots[i].mutex);
+
+		if (slot.pid == InvalidPid)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[j++] = Int32GetDatum(slot.pid);
+		values[j++] = ObjectIdGetDatum(slot.dbid);
+		values[j++] = ObjectIdGetDatum(slot.relid);
+		values[j++] = CStringGetTextDatum(progress_phase_name(params[SQUEEZE_PROGRESS_PHASE]));
+		values[j++] = TimestampTzGetDatum(slot.started);
+		values[j++] = Int64GetDatum(params[SQUEEZE_PROGRESS_HEAP_BLKS_TOTAL]);
+		values[j++] = Int64GetDatum(params[SQUEEZE_PROGRESS_HEAP_BLKS_SCANNED]);
+		values[j++] = Int64GetDatum(params[SQUEEZE_PROGRESS_TUPLES_COPIED]);
+		values[j++] = Int32GetDatum((int32) params[SQUEEZE_PROGRESS_INDEXES_TOTAL]);
+		values[j++] = Int32GetDatum((int32) params[SQUEEZE_PROGRESS_INDEXES_BUILT]);
+		values[j++] = Int32GetDatum((int32) params[SQUEEZE_PROGRESS_MERGE_ATTEMPT]);
+
+		/* The LSNs are not known until the decoding has been set up. */
+		if (params[SQUEEZE_PROGRESS_WAL_DECODED] != InvalidXLogRecPtr)
+			values[j] = LSNGetDatum((XLogRecPtr) params[SQUEEZE_PROGRESS_WAL_DECODED]);
+		else
+			nulls[j] = true;
+		j++;
+		if (params[SQUEEZE_PROGRESS_WAL_TARGET] != InvalidXLogRecPtr)
+			values[j] = LSNGetDatum((XLogRecPtr) params[SQUEEZE_PROGRESS_WAL_TARGET]);
+		else
+			nulls[j] = true;
+		j++;
+
+		values[j++] = Int64GetDatum(params[SQUEEZE_PROGRESS_CHANGES_PENDING]);
+		values[j++] = Int64GetDatum(params[SQUEEZE_PROGRESS_CHANGES_APPLIED]);
+		throttle_time = (Interval *) palloc(sizeof(Interval));
+		throttle_time->time = params[SQUEEZE_PROGRESS_THROTTLE_TIME];
+		throttle_time->day = 0;
+		throttle_time->month = 0;
+		values[j++] = IntervalPGetDatum(throttle_time);
+		Assert(j == PROGRESS_COLUMNS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
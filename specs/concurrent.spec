@@ -0,0 +1,111 @@
+# Data changes performed by other sessions while squeeze_table() is running.
+#
+# Session s2 changes the table as well as its copy while s1 is squeezing the
+# table. squeeze.test_advisory_lock makes squeeze_table() wait for s2 before
+# the final processing, so the changes are decoded and applied under the
+# exclusive lock. At the end, the squeezed table must match the copy.
+
+setup
+{
+	CREATE EXTENSION IF NOT EXISTS pg_squeeze;
+
+	CREATE TABLE t(i int PRIMARY KEY, j int, k text);
+	INSERT INTO t(i, j, k)
+	SELECT x, x, repeat('x', 100) FROM generate_series(1, 20000) AS g(x);
+	CREATE TABLE t_copy AS SELECT * FROM t;
+
+	-- The identity index is DESC, so the keys are looked up in the
+	-- descending order.
+	CREATE TABLE d(i int NOT NULL, j int, k text);
+	CREATE UNIQUE INDEX d_i_idx_desc ON d(i DESC);
+	ALTER TABLE d REPLICA IDENTITY USING INDEX d_i_idx_desc;
+	INSERT INTO d(i, j, k)
+	SELECT x, x, repeat('x', 100) FROM generate_series(1, 20000) AS g(x);
+	CREATE TABLE d_copy AS SELECT * FROM d;
+
+	-- Change rows once or repeatedly, insert rows and update or delete them
+	-- afterwards, delete rows and insert them again, and change the
+	-- identity key.
+	CREATE FUNCTION change_rows(tab text) RETURNS void
+	LANGUAGE plpgsql
+	AS $$
+	DECLARE
+		rel	text;
+	BEGIN
+		FOREACH rel IN ARRAY ARRAY[tab, tab || '_copy']
+		LOOP
+			EXECUTE format('UPDATE %I SET j = j + 1 WHERE i <= 15000', rel);
+			EXECUTE format('UPDATE %I SET j = j + 1 WHERE i <= 15000 AND i %% 2 = 0', rel);
+			EXECUTE format('INSERT INTO %I(i, j, k) SELECT x, x, repeat(''y'', 100) FROM generate_series(20001, 20100) AS g(x)', rel);
+			EXECUTE format('UPDATE %I SET j = -j WHERE i > 20050', rel);
+			EXECUTE format('DELETE FROM %I WHERE i > 20090', rel);
+			EXECUTE format('DELETE FROM %I WHERE i BETWEEN 16001 AND 16100', rel);
+			EXECUTE format('DELETE FROM %I WHERE i BETWEEN 18001 AND 18100', rel);
+			EXECUTE format('INSERT INTO %I(i, j, k) SELECT x, -x, repeat(''z'', 100) FROM generate_series(18001, 18100) AS g(x)', rel);
+			EXECUTE format('UPDATE %I SET i = i + 100000 WHERE i BETWEEN 17001 AND 17100', rel);
+			EXECUTE format('UPDATE %I SET j = 0 WHERE i BETWEEN 117001 AND 117050', rel);
+		END LOOP;
+	END;
+	$$;
+
+	-- Compare the table to its copy, and count the rows using the identity
+	-- index.
+	CREATE FUNCTION check_rows(tab text, OUT rows_differ bigint,
+		OUT index_rows bigint)
+	LANGUAGE plpgsql
+	SET enable_seqscan TO off
+	SET enable_bitmapscan TO off
+	AS $$
+	BEGIN
+		EXECUTE format('SELECT count(*) FROM %I s FULL JOIN %I c USING (i, j, k) WHERE s.i ISNULL OR c.i ISNULL', tab, tab || '_copy')
+		INTO rows_differ;
+		EXECUTE format('SELECT count(*) FROM %I WHERE i > 0', tab)
+		INTO index_rows;
+	END;
+	$$;
+}
+
+teardown
+{
+	DROP TABLE t, t_copy, d, d_copy;
+	DROP FUNCTION change_rows(text);
+	DROP FUNCTION check_rows(text);
+}
+
+session "s1"
+setup			{ RESET ALL; SET squeeze.test_advisory_lock TO 1; }
+step "s1_squeeze_t"	{ SELECT squeeze.squeeze_table('public', 't', NULL, NULL, NULL); }
+step "s1_check_t"	{ SELECT * FROM check_rows('t'); }
+step "s1_squeeze_d"	{ SELECT squeeze.squeeze_table('public', 'd', NULL, NULL, NULL); }
+step "s1_check_d"	{ SELECT * FROM check_rows('d'); }
+step "s1_lookup_workers"	{ SET squeeze.max_parallel_lookup_workers TO 2; }
+step "s1_small_mem"	{ SET maintenance_work_mem TO '1MB'; }
+step "s1_xlock_time"	{ SET squeeze.max_xlock_time TO 20; }
+
+session "s2"
+step "s2_lock"		{ SELECT pg_advisory_lock(1); }
+step "s2_change_t"	{ SELECT change_rows('t'); }
+step "s2_change_d"	{ SELECT change_rows('d'); }
+step "s2_unlock"	{ SELECT pg_advisory_unlock(1); }
+
+# The changes are coalesced per identity key.
+permutation "s2_lock" "s1_squeeze_t" "s2_change_t" "s2_unlock" "s1_check_t"
+
+# The changes exceed twice maintenance_work_mem, so they are applied one by
+# one, in the order they were decoded.
+permutation "s1_small_mem" "s2_lock" "s1_squeeze_t" "s2_change_t" "s2_unlock" "s1_check_t"
+
+# More than 10000 rows need to be looked up, so the parallel workers help.
+permutation "s1_lookup_workers" "s2_lock" "s1_squeeze_d" "s2_change_d" "s2_unlock" "s1_check_d"
+
+# The same in order, and with the identity index not being the primary key.
+permutation "s1_small_mem" "s2_lock" "s1_squeeze_d" "s2_change_d" "s2_unlock" "s1_check_d"
+
+# The changes are coalesced and the rows are looked up by a single scan with
+# an array of keys, which the DESC index returns in the descending order.
+permutation "s2_lock" "s1_squeeze_d" "s2_change_d" "s2_unlock" "s1_check_d"
+
+# Coalescing and application of the changes are not expected to complete in
+# squeeze.max_xlock_time, so they are interrupted and resumed after the lock
+# has been released. The next attempt has little work left, so it succeeds.
+permutation "s1_xlock_time" "s2_lock" "s1_squeeze_t" "s2_change_t" "s2_unlock" "s1_check_t"
@@ -31,3 +31,136 @@ SELECT squeeze.squeeze_table('public', 'b', NULL, NULL, NULL);
 SELECT b.t = b_copy.t
 FROM   b, b_copy
 WHERE  b.i = b_copy.i;
+
+-- Helpers to check the contents and the indexes after processing.
+CREATE TABLE a_copy AS SELECT * FROM a;
+CREATE FUNCTION check_a(OUT rows_differ bigint, OUT index_rows bigint,
+	OUT indexes_valid bool)
+LANGUAGE sql
+SET enable_seqscan TO off
+SET enable_bitmapscan TO off
+AS $$
+	SELECT	(SELECT	count(*)
+		 FROM	a FULL JOIN a_copy USING (i, j)
+		 WHERE	a.i ISNULL OR a_copy.i ISNULL),
+		(SELECT	count(*) FROM a WHERE i > 0),
+		(SELECT	bool_and(indisvalid AND indisready)
+		 FROM	pg_index
+		 WHERE	indrelid = 'a'::regclass);
+$$;
+CREATE FUNCTION check_b(OUT rows_differ bigint, OUT index_rows bigint,
+	OUT indexes_valid bool)
+LANGUAGE sql
+SET enable_seqscan TO off
+SET enable_bitmapscan TO off
+AS $$
+	SELECT	(SELECT	count(*)
+		 FROM	b FULL JOIN b_copy USING (i, t)
+		 WHERE	b.i ISNULL OR b_copy.i ISNULL),
+		(SELECT	count(*) FROM b WHERE i > 0),
+		(SELECT	bool_and(indisvalid AND indisready)
+		 FROM	pg_index
+		 WHERE	indrelid = 'b'::regclass);
+$$;
+
+-- Parallel initial load.
+SET squeeze.max_parallel_load_workers TO 2;
+SELECT squeeze.squeeze_table('public', 'a', NULL, NULL, NULL);
+SELECT * FROM check_a();
+SELECT squeeze.squeeze_table('public', 'b', NULL, NULL, NULL);
+SELECT * FROM check_b();
+RESET squeeze.max_parallel_load_workers;
+
+-- Direct load.
+SET squeeze.direct_load TO on;
+SELECT squeeze.squeeze_table('public', 'a', NULL, NULL, NULL);
+SELECT * FROM check_a();
+SELECT squeeze.squeeze_table('public', 'a', 'a_i_idx_desc', NULL, NULL);
+SELECT * FROM check_a();
+SELECT squeeze.squeeze_table('public', 'b', NULL, NULL, NULL);
+SELECT * FROM check_b();
+RESET squeeze.direct_load;
+
+-- Parallel index build, including an expression index.
+SET squeeze.max_parallel_index_workers TO 2;
+CREATE INDEX a_expr_idx ON a((i + j));
+SELECT squeeze.squeeze_table('public', 'a', NULL, NULL, NULL);
+SELECT * FROM check_a();
+-- Function that parallel workers must not run, the build is serial then.
+CREATE FUNCTION unsafe_abs(int) RETURNS int
+LANGUAGE sql IMMUTABLE PARALLEL UNSAFE
+AS 'SELECT abs($1)';
+CREATE INDEX a_unsafe_idx ON a(unsafe_abs(j));
+SELECT squeeze.squeeze_table('public', 'a', NULL, NULL, NULL);
+SELECT * FROM check_a();
+DROP INDEX a_unsafe_idx;
+SELECT squeeze.squeeze_table('public', 'b', NULL, NULL, NULL);
+SELECT * FROM check_b();
+RESET squeeze.max_parallel_index_workers;
+
+-- Early decoding.
+SET squeeze.early_decoding TO on;
+SELECT squeeze.squeeze_table('public', 'a', NULL, NULL, NULL);
+SELECT * FROM check_a();
+SELECT squeeze.squeeze_table('public', 'b', NULL, NULL, NULL);
+SELECT * FROM check_b();
+RESET squeeze.early_decoding;
+
+-- Nothing is in progress now.
+SELECT count(*) FROM squeeze.progress;
+
+-- Statistics of the last call.
+SELECT squeeze.squeeze_table('public', 'a', NULL, NULL, NULL);
+SELECT tuples_copied FROM squeeze.last_stats();
+
+-- The sample covers the whole table, so it should match the approximation.
+SELECT	x.table_len = y.table_len AS table_len,
+	x.approx_tuple_count = y.approx_tuple_count AS tuple_count,
+	x.approx_free_space = y.approx_free_space AS free_space
+FROM	squeeze.pgstattuple_sample('b', 1000) x,
+	squeeze.pgstattuple_approx('b') y;
+
+-- Time that has already passed today is reached tomorrow.
+SELECT	squeeze.time_left(now()::timetz) = '0'::interval AS now,
+	abs(extract(epoch FROM squeeze.time_left(now()::timetz +
+		interval '2 hours')) - 7200) < 1 AS ahead,
+	abs(extract(epoch FROM squeeze.time_left(now()::timetz -
+		interval '1 hour')) - 82800) < 1 AS passed;
+
+-- Maintenance windows. The windows are relative to the current time, so
+-- some of them wrap past midnight, depending on when the test runs.
+INSERT INTO squeeze.tables(tabschema, tabname, schedule)
+VALUES ('public', 'a', '{}');
+INSERT INTO squeeze.tasks(table_id)
+SELECT id FROM squeeze.tables;
+-- The history says that processing of the table takes 1 hour.
+INSERT INTO squeeze.log(tabschema, tabname, started, finished, size_before)
+VALUES ('public', 'a', now() - interval '1 hour', now(),
+	pg_relation_size('a'));
+-- Inside the window.
+UPDATE squeeze.tables
+SET	window_start = now()::timetz - interval '1 hour',
+	window_end = now()::timetz + interval '2 hours';
+SELECT squeeze.task_can_start(t) FROM squeeze.tasks t;
+-- Before the window.
+UPDATE squeeze.tables
+SET	window_start = now()::timetz + interval '1 hour',
+	window_end = now()::timetz + interval '2 hours';
+SELECT squeeze.task_can_start(t) FROM squeeze.tasks t;
+-- After the window.
+UPDATE squeeze.tables
+SET	window_start = now()::timetz - interval '2 hours',
+	window_end = now()::timetz - interval '1 hour';
+SELECT squeeze.task_can_start(t) FROM squeeze.tasks t;
+-- Deadline only, reached tomorrow.
+UPDATE squeeze.tables
+SET	window_start = NULL,
+	window_end = now()::timetz - interval '1 minute';
+SELECT squeeze.task_can_start(t) FROM squeeze.tasks t;
+-- The task is not expected to complete before the window ends.
+UPDATE squeeze.tables
+SET	window_start = now()::timetz - interval '1 hour',
+	window_end = now()::timetz + interval '30 minutes';
+SELECT squeeze.task_can_start(t) FROM squeeze.tasks t;
+DELETE FROM squeeze.tables;
+DELETE FROM squeeze.log;
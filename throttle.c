@@ -0,0 +1,345 @@
+/*-----------------------------------------------------
+ *
+ * throttle.c
+ *     Limit the I/O and WAL rate of squeeze_table().
+ *
+ * Copyright (c) 2016-2018, Cybertec Schönig & Schönig GmbH
+ *
+ *-----------------------------------------------------
+ */
+#include "pg_squeeze.h"
+
+#include "access/xlog.h"
+#include "executor/instrument.h"
+#include "pgstat.h"
+#include "replication/walreceiver.h"
+#include "replication/walsender.h"
+#include "replication/walsender_private.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
+
+/*
+ * The maximum rate (in MB/s) at which squeeze_table() reads data, dirties
+ * pages and generates WAL. Zero means no limit.
+ */
+int squeeze_max_read_rate = 0;
+int squeeze_max_write_rate = 0;
+int squeeze_max_wal_rate = 0;
+
+/*
+ * The maximum replay lag (in milliseconds) of physical standbys. If any
+ * standby lags more, squeeze_table() pauses until the lag drops below half
+ * of this value. Zero means that the lag is not checked.
+ */
+int squeeze_max_replay_lag = 0;
+
+/* How often to check the replay lag while paused, in milliseconds. */
+#define	REPLAY_LAG_CHECK_INTERVAL	100
+
+/*
+ * The maximum total time (in milliseconds) a single call of squeeze_table()
+ * can spend waiting for the standbys. The lag reported by a standby that
+ * stopped replying does not change, so the pause must not be endless.
+ */
+#define	REPLAY_LAG_MAX_PAUSE	600000
+
+/*
+ * Do not sleep longer than this (in milliseconds) at a time, so that new
+ * values of the limits take effect soon.
+ */
+#define	THROTTLE_MAX_SLEEP	1000
+
+/*
+ * The state of the throttling. Each counter is a leaky bucket: whatever was
+ * read, written or generated since the last call is added to it, and the
+ * bucket drains at the configured rate. Whenever any of the buckets is not
+ * empty, the backend sleeps for the time needed to drain it, see
+ * squeeze_throttle().
+ */
+typedef struct ThrottleState
+{
+	TimestampTz	last_check;
+
+	/* The counters as of last_check. */
+	int64	blks_read;
+	int64	blks_dirtied;
+	XLogRecPtr	wal_pos;
+
+	/* Bytes not yet drained. */
+	double	read_level;
+	double	write_level;
+	double	wal_level;
+
+	/* Time spent waiting for the standbys so far, in milliseconds. */
+	long	replay_wait;
+} ThrottleState;
+
+static ThrottleState throttle;
+
+static void wait_for_standbys(void);
+static TimeOffset get_max_replay_lag(void);
+static void get_counters(int64 *blks_read, int64 *blks_dirtied,
+						 XLogRecPtr *wal_pos);
+static double drain(double level, double delta, int rate_mb, double secs,
+					long *delay_ms);
+
+/*
+ * Start the accounting. To be called when squeeze_table() starts.
+ */
+void
+squeeze_throttle_start(void)
+{
+	memset(&throttle, 0, sizeof(ThrottleState));
+	throttle.last_check = GetCurrentTimestamp();
+	get_counters(&throttle.blks_read, &throttle.blks_dirtied,
+				 &throttle.wal_pos);
+}
+
+/*
+ * Sleep if the data read, written or WAL generated since the last call
+ * exceeds the limits. Like vacuum_delay_point(), this should be called
+ * often enough during the I/O intensive stages of the processing.
+ *
+ * Reads are the blocks read into the buffers, writes are the blocks
+ * dirtied (these will be written sooner or later). squeeze.direct_load
+ * bypasses the buffers, so its writes are not limited.
+ *
+ * Per-backend WAL statistics are not available, so the WAL generated by the
+ * whole cluster is checked. (That is what the standbys need to receive
+ * anyway.) Since the other backends may generate WAL faster than the limit,
+ * the WAL bucket might never get empty. Therefore we sleep at most once per
+ * call, for no more than THROTTLE_MAX_SLEEP, and the WAL bucket does not
+ * hold more than such a sleep drains. Thus squeeze_table() slows down but
+ * does not stop if the cluster exceeds the limit.
+ *
+ * Besides that, wait if the standbys cannot keep up with replaying the WAL,
+ * see squeeze.max_replay_lag.
+ *
+ * Never call this while holding the exclusive lock on the table.
+ */
+void
+squeeze_throttle(void)
+{
+	int64	blks_read, blks_dirtied;
+	XLogRecPtr	wal_pos;
+	TimestampTz	now;
+	double	secs;
+	long	delay_ms;
+
+	/* Apply new values of the limits even if the table is huge. */
+	squeeze_worker_reload_config();
+
+	wait_for_standbys();
+
+	if (squeeze_max_read_rate <= 0 && squeeze_max_write_rate <= 0 &&
+		squeeze_max_wal_rate <= 0)
+		return;
+
+	now = GetCurrentTimestamp();
+	get_counters(&blks_read, &blks_dirtied, &wal_pos);
+	secs = (double) (now - throttle.last_check) / USECS_PER_SEC;
+
+	delay_ms = 0;
+	throttle.read_level = drain(throttle.read_level,
+								(double) (blks_read -
+										  throttle.blks_read) * BLCKSZ,
+								squeeze_max_read_rate, secs, &delay_ms);
+	throttle.write_level = drain(throttle.write_level,
+								 (double) (blks_dirtied -
+										   throttle.blks_dirtied) * BLCKSZ,
+								 squeeze_max_write_rate, secs, &delay_ms);
+	throttle.wal_level = drain(throttle.wal_level,
+							   (double) (wal_pos - throttle.wal_pos),
+							   squeeze_max_wal_rate, secs, &delay_ms);
+	if (squeeze_max_wal_rate > 0)
+		throttle.wal_level = Min(throttle.wal_level,
+								 squeeze_max_wal_rate * 1024.0 * 1024.0 *
+								 THROTTLE_MAX_SLEEP / 1000.0);
+
+	throttle.last_check = now;
+	throttle.blks_read = blks_read;
+	throttle.blks_dirtied = blks_dirtied;
+	throttle.wal_pos = wal_pos;
+
+	/*
+	 * If a bucket is still not empty, the next call will sleep again, with
+	 * the current values of the limits.
+	 */
+	if (delay_ms > 0)
+		squeeze_throttle_sleep(Min(delay_ms, THROTTLE_MAX_SLEEP));
+}
+
+/*
+ * Sleep for the given number of milliseconds and report the time in the
+ * progress view.
+ */
+void
+squeeze_throttle_sleep(long delay_ms)
+{
+	TimestampTz	start;
+	int	rc;
+
+	start = GetCurrentTimestamp();
+	rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+				   delay_ms, PG_WAIT_EXTENSION);
+	ResetLatch(MyLatch);
+
+	if (rc & WL_POSTMASTER_DEATH)
+		proc_exit(1);
+
+	squeeze_progress_incr_param(SQUEEZE_PROGRESS_THROTTLE_TIME,
+								GetCurrentTimestamp() - start);
+
+	CHECK_FOR_INTERRUPTS();
+}
+
+/*
+ * If the replay lag of any physical standby exceeds squeeze.max_replay_lag,
+ * sleep until it drops below half of that value. The WAL generated in
+ * between by other backends does not matter, the point is that squeeze does
+ * not make the lag worse.
+ *
+ * Once the total pause exceeds REPLAY_LAG_MAX_PAUSE, stop waiting.
+ */
+static void
+wait_for_standbys(void)
+{
+	bool	waiting = false;
+
+	while (squeeze_max_replay_lag > 0)
+	{
+		TimeOffset	lag, threshold;
+
+		if (throttle.replay_wait >= REPLAY_LAG_MAX_PAUSE)
+		{
+			if (waiting)
+				elog(LOG,
+					 "pg_squeeze: standbys did not catch up in %d ms, not waiting for them anymore",
+					 REPLAY_LAG_MAX_PAUSE);
+			break;
+		}
+
+		threshold = (TimeOffset) squeeze_max_replay_lag * 1000;
+		if (waiting)
+			threshold /= 2;
+
+		lag = get_max_replay_lag();
+		if (lag <= threshold)
+		{
+			if (waiting)
+				elog(LOG, "pg_squeeze: standbys caught up, resuming");
+			break;
+		}
+
+		if (!waiting)
+		{
+			elog(LOG,
+				 "pg_squeeze: replay lag is %ld ms, pausing",
+				 (long) (lag / 1000));
+			waiting = true;
+		}
+
+		squeeze_throttle_sleep(REPLAY_LAG_CHECK_INTERVAL);
+		throttle.replay_wait += REPLAY_LAG_CHECK_INTERVAL;
+		squeeze_worker_reload_config();
+	}
+}
+
+/*
+ * Return the highest replay lag (in microseconds) of the physical standbys
+ * that are streaming now, or zero if there's no such standby or if the
+ * standbys caught up.
+ *
+ * On PG >= 12, standbys that did not reply for wal_receiver_status_interval
+ * are ignored since their lag is not up-to-date.
+ */
+static TimeOffset
+get_max_replay_lag(void)
+{
+	TimeOffset	result = 0;
+#if PG_VERSION_NUM >= 120000
+	TimestampTz	now = GetCurrentTimestamp();
+#endif
+	int	i;
+
+	for (i = 0; i < max_wal_senders; i++)
+	{
+		WalSnd	*walsnd = &WalSndCtl->walsnds[i];
+		pid_t	pid;
+		WalSndState	state;
+		TimeOffset	lag;
+		PGPROC	*proc;
+#if PG_VERSION_NUM >= 120000
+		TimestampTz	reply_time;
+#endif
+
+		SpinLockAcquire(&walsnd->mutex);
+		pid = walsnd->pid;
+		state = walsnd->state;
+		lag = walsnd->applyLag;
+#if PG_VERSION_NUM >= 120000
+		reply_time = walsnd->replyTime;
+#endif
+		SpinLockRelease(&walsnd->mutex);
+
+		if (pid == 0 || state != WALSNDSTATE_STREAMING)
+			continue;
+
+#if PG_VERSION_NUM >= 120000
+		if (wal_receiver_status_interval > 0 &&
+			TimestampDifferenceExceeds(reply_time, now,
+									   wal_receiver_status_interval * 1000))
+			continue;
+#endif
+
+		/*
+		 * Only physical replication matters here. Unlike the physical
+		 * walsender, the logical one is connected to a database.
+		 */
+		proc = BackendPidGetProc(pid);
+		if (proc == NULL || OidIsValid(proc->databaseId))
+			continue;
+
+		/* -1 means that the lag is not known or the standby caught up. */
+		if (lag > result)
+			result = lag;
+	}
+
+	return result;
+}
+
+static void
+get_counters(int64 *blks_read, int64 *blks_dirtied, XLogRecPtr *wal_pos)
+{
+	*blks_read = pgBufferUsage.shared_blks_read +
+		pgBufferUsage.local_blks_read + pgBufferUsage.temp_blks_read;
+	*blks_dirtied = pgBufferUsage.shared_blks_dirtied +
+		pgBufferUsage.local_blks_dirtied + pgBufferUsage.temp_blks_written;
+	*wal_pos = GetXLogInsertRecPtr();
+}
+
+/*
+ * Add delta to the bucket level, drain the bucket for secs seconds and
+ * return the new level. If the bucket is not empty, update *delay_ms so it's
+ * at least the time needed to drain it.
+ */
+static double
+drain(double level, double delta, int rate_mb, double secs, long *delay_ms)
+{
+	double	rate;
+	long	delay;
+
+	if (rate_mb <= 0)
+		return 0;
+
+	rate = rate_mb * 1024.0 * 1024.0;
+	level = Max(level - rate * secs, 0) + delta;
+
+	delay = (long) (level * 1000.0 / rate);
+	if (delay > *delay_ms)
+		*delay_ms = delay;
+
+	return level;
+}
@@ -35,16 +35,23 @@ static void squeeze_worker_sigterm(SIGNAL_ARGS);
 
 static void run_command(char *command);
 static int64 get_task_count(void);
+static pid_t start_worker_internal(WorkerConInteractive *con);
 
+/*
+ * Start squeeze_workers_per_database workers and return PID of the first
+ * one. If some workers of the pool are already running, the new ones that
+ * find no free slot exit immediately.
+ *
+ * If squeeze.max_workers is set, the launcher starts the workers, so only
+ * ask it to do so and return its PID.
+ */
 PG_FUNCTION_INFO_V1(squeeze_start_worker);
 Datum
 squeeze_start_worker(PG_FUNCTION_ARGS)
 {
 	WorkerConInteractive	con;
-	BackgroundWorker worker;
-	BackgroundWorkerHandle *handle;
-	BgwHandleStatus status;
-	pid_t		pid;
+	pid_t		pid, result = 0;
+	int	i;
 
 	/*
 	 * The worker eventually runs squeeze_table() function, which in turn
@@ -55,9 +62,39 @@ squeeze_start_worker(PG_FUNCTION_ARGS)
 				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
 				 (errmsg("must be superuser to start squeeze worker"))));
 
+	/*
+	 * If the launcher is running, it decides how many workers the database
+	 * gets. Just make it check the database now.
+	 */
+	if (squeeze_launcher_enabled())
+	{
+		squeeze_launcher_wakeup();
+		PG_RETURN_INT32(squeeze_launcher_pid());
+	}
+
 	con.dbid = MyDatabaseId;
 	con.roleid = GetUserId();
-	squeeze_initialize_bgworker(&worker, NULL, &con, MyProcPid);
+	con.launched = false;
+
+	for (i = 0; i < squeeze_workers_per_database; i++)
+	{
+		pid = start_worker_internal(&con);
+		if (i == 0)
+			result = pid;
+	}
+
+	PG_RETURN_INT32(result);
+}
+
+static pid_t
+start_worker_internal(WorkerConInteractive *con)
+{
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus status;
+	pid_t		pid;
+
+	squeeze_initialize_bgworker(&worker, NULL, con, MyProcPid);
 
 	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
 		ereport(ERROR,
@@ -79,7 +116,7 @@ squeeze_start_worker(PG_FUNCTION_ARGS)
 				 errhint("Kill all remaining database processes and restart the database.")));
 	Assert(status == BGWH_STARTED);
 
-	PG_RETURN_INT32(pid);
+	return pid;
 }
 
 /*
@@ -158,10 +195,12 @@ squeeze_worker_main(Datum main_arg)
 {
 	Datum	arg;
 	Oid	extension_id;
-	LOCKTAG		tag;
+	LOCKTAG		tag, tag_ext;
 	LockAcquireResult	lock_res;
 	long	delay;
 	int64	ntasks;
+	int	slot, nslots;
+	bool	launched = false;
 
 	pqsignal(SIGHUP, squeeze_worker_sighup);
 	pqsignal(SIGTERM, squeeze_worker_sigterm);
@@ -189,6 +228,7 @@ squeeze_worker_main(Datum main_arg)
 		/* Ensure aligned access. */
 		memcpy(&con, MyBgworkerEntry->bgw_extra,
 			   sizeof(WorkerConInteractive));
+		launched = con.launched;
 
 		BackgroundWorkerInitializeConnectionByOid(con.dbid, con.roleid
 #if PG_VERSION_NUM >= 110000
@@ -199,29 +239,63 @@ squeeze_worker_main(Datum main_arg)
 
 	SetCurrentStatementStartTimestamp();
 	StartTransactionCommand();
-	extension_id = get_extension_oid("pg_squeeze", false);
+	/*
+	 * The launcher does not know which databases have the extension
+	 * installed.
+	 */
+	extension_id = get_extension_oid("pg_squeeze", launched);
 	CommitTransactionCommand();
 
+	if (!OidIsValid(extension_id))
+	{
+		squeeze_launcher_report_tasks(0);
+		proc_exit(0);
+	}
+
 	/*
-	 * Concurrent execution of the pg_squeeze functions should not cause data
-	 * corruption but those functions are not intended to be run
-	 * concurrently. Use extension lock to ensure that at most one worker
-	 * exists. (Side effect is that no one should be able to drop the
-	 * extension while the worker is running.)
+	 * Shared lock on the extension ensures that no one can drop the
+	 * extension while the worker is running. Do not wait if someone is just
+	 * doing so.
 	 *
 	 * LockDatabaseObject() would be more convenient, but we'd need to setup
 	 * the tag manually elsewhere, to request the lock conditionally. So be
 	 * consistent.
 	 */
-	SET_LOCKTAG_OBJECT(tag, MyDatabaseId, ExtensionRelationId, extension_id,
-					   0);
-	lock_res = LockAcquire(&tag, ExclusiveLock, false, true);
-
+	SET_LOCKTAG_OBJECT(tag_ext, MyDatabaseId, ExtensionRelationId,
+					   extension_id, 0);
+	lock_res = LockAcquire(&tag_ext, AccessShareLock, false, true);
 	if (lock_res == LOCKACQUIRE_NOT_AVAIL)
+	{
+		elog(WARNING, "pg_squeeze extension is being altered or dropped");
+		proc_exit(0);
+	}
+	Assert(lock_res == LOCKACQUIRE_OK);
+
+	/*
+	 * The number of workers per database is limited. Each worker occupies a
+	 * slot, represented by a lock on the extension object with objsubid
+	 * equal to the slot number. (squeeze.stop_worker() relies on the workers
+	 * holding locks on the extension object.)
+	 *
+	 * Concurrent execution of the pg_squeeze functions in multiple workers
+	 * is safe: each worker processes a different task, and squeeze_table()
+	 * refuses to process a table that another backend is processing.
+	 */
+	nslots = squeeze_workers_per_database;
+	for (slot = 1; slot <= nslots; slot++)
+	{
+		SET_LOCKTAG_OBJECT(tag, MyDatabaseId, ExtensionRelationId,
+						   extension_id, slot);
+		lock_res = LockAcquire(&tag, ExclusiveLock, false, true);
+		if (lock_res != LOCKACQUIRE_NOT_AVAIL)
+			break;
+	}
+
+	if (slot > nslots)
 	{
 		elog(WARNING,
-			 "one squeeze worker is already running on %u database",
-			 MyDatabaseId);
+			 "%d squeeze worker(s) already running on %u database",
+			 nslots, MyDatabaseId);
 
 		proc_exit(0);
 	}
@@ -229,6 +303,8 @@ squeeze_worker_main(Datum main_arg)
 
 	delay = 0L;
 	ntasks = get_task_count();
+	if (launched)
+		squeeze_launcher_report_tasks(ntasks);
 
 	while (!got_sigterm)
 	{
@@ -242,17 +318,17 @@ squeeze_worker_main(Datum main_arg)
 		if (rc & WL_POSTMASTER_DEATH)
 			proc_exit(1);
 
-		if (got_sighup)
-		{
-			got_sighup = false;
-			ProcessConfigFile(PGC_SIGHUP);
-		}
+		squeeze_worker_reload_config();
 
 		/*
 		 * Only try to add rows to "tasks" table if performed enough loops to
-		 * process the number we got last time.
+		 * process the number we got last time. Concurrent execution of the
+		 * functions would only cause conflicts, so leave the work to another
+		 * worker if it's just doing so.
 		 */
-		if (ntasks == 0)
+		if (ntasks == 0 &&
+			LockAcquire(&tag_ext, ExclusiveLock, false, true) ==
+			LOCKACQUIRE_OK)
 		{
 			/*
 			 * Unregister dropped tables instead of creating new tasks for
@@ -261,13 +337,27 @@ squeeze_worker_main(Datum main_arg)
 			run_command("SELECT squeeze.cleanup_tables()");
 
 			run_command("SELECT squeeze.add_new_tasks()");
+
+			if (!LockRelease(&tag_ext, ExclusiveLock, false))
+				elog(ERROR, "Failed to release extension lock");
+
 			ntasks = get_task_count();
-			elog(DEBUG1, "pg_squeeze (dboid=%u): %zd tasks added to queue",
+			elog(DEBUG1, "pg_squeeze (dboid=%u): %zd tasks in queue",
 				 MyDatabaseId, ntasks);
+			if (launched)
+				squeeze_launcher_report_tasks(ntasks);
 		}
 
 		if (ntasks == 0)
 		{
+			/*
+			 * Worker started by the launcher does not wait. The launcher
+			 * will start a new one when the database needs to be checked
+			 * again.
+			 */
+			if (launched)
+				break;
+
 			/*
 			 * As there's no urgent work, wait some time.
 			 *
@@ -312,9 +402,31 @@ squeeze_worker_main(Datum main_arg)
 
 	if (!LockRelease(&tag, ExclusiveLock, false))
 		elog(ERROR, "Failed to release extension lock");
+	if (!LockRelease(&tag_ext, AccessShareLock, false))
+		elog(ERROR, "Failed to release extension lock");
 	proc_exit(0);
 }
 
+/*
+ * Reload the configuration file if the worker received SIGHUP. Besides the
+ * main loop, this is called during the processing of a table so that new
+ * values of the throttling parameters take effect. (Nothing to do in other
+ * backends.)
+ *
+ * The configuration cannot be changed in parallel mode (e.g. during the
+ * parallel initial load), so leave got_sighup set until the parallel
+ * operation is done.
+ */
+void
+squeeze_worker_reload_config(void)
+{
+	if (got_sighup && !IsInParallelMode())
+	{
+		got_sighup = false;
+		ProcessConfigFile(PGC_SIGHUP);
+	}
+}
+
 static void
 squeeze_worker_sighup(SIGNAL_ARGS)
 {
@@ -364,7 +476,10 @@ run_command(char *command)
 }
 
 
-/* Return the number pending tasks, i.e. of rows of squeeze.tasks table. */
+/*
+ * Return the number pending tasks, i.e. of rows of squeeze.tasks table that
+ * no other worker is processing and that can be started now.
+ */
 static int64
 get_task_count(void)
 {
@@ -372,7 +487,8 @@ get_task_count(void)
 	Datum	res_datum;
 	bool	isnull;
 	int64	result;
-	char	*command = "SELECT count(*) FROM squeeze.tasks";
+	char	*command = "SELECT count(*) FROM squeeze.tasks t "
+		"WHERE NOT squeeze.task_is_taken(t) AND squeeze.task_can_start(t)";
 #ifdef USE_ASSERT_CHECKING
 	Oid	restype;
 #endif